@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "Epoch.h"
+#include "SpinWait.h"
+#include "err.h"
+
+struct EpochRecord {
+    _Alignas(64) atomic_ullong active; // epoch the thread entered at, 0 outside
+    unsigned depth; // of nested sections, used by the owner only
+    atomic_bool used; // owned by a live thread
+    EpochRecord *next;
+};
+
+// Records of all threads that have entered a section.
+static _Atomic(EpochRecord *) epoch_records;
+static atomic_ullong epoch_now = 1;
+static _Thread_local EpochRecord *epoch_record;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+
+// Hands the record of an exiting thread over to new threads.
+static void epoch_record_release(void *arg) {
+    EpochRecord *record = arg;
+    atomic_store_explicit(&record->used, false, memory_order_release);
+}
+
+static void epoch_init(void) {
+    if (pthread_key_create(&epoch_key, epoch_record_release) != 0)
+        syserr("pthread_key_create failed");
+}
+
+static EpochRecord *epoch_record_get(void) {
+    if (epoch_record) return epoch_record;
+    pthread_once(&epoch_once, epoch_init);
+
+    EpochRecord *record = atomic_load(&epoch_records);
+    for (; record; record = record->next) {
+        bool used = false;
+        if (!atomic_load_explicit(&record->used, memory_order_relaxed)
+            && atomic_compare_exchange_strong(&record->used, &used, true))
+            break;
+    }
+    if (!record) {
+        record = aligned_alloc(64, sizeof(EpochRecord));
+        if (!record) syserr("memory alloc failed!");
+        atomic_init(&record->active, 0);
+        atomic_init(&record->used, true);
+        record->next = atomic_load(&epoch_records);
+        while (!atomic_compare_exchange_weak(&epoch_records, &record->next, record)) {}
+    }
+    record->depth = 0;
+    pthread_setspecific(epoch_key, record);
+    epoch_record = record;
+    return record;
+}
+
+EpochRecord *epoch_enter(void) {
+    EpochRecord *record = epoch_record_get();
+    if (record->depth++ == 0) atomic_store(&record->active, atomic_load(&epoch_now));
+    return record;
+}
+
+void epoch_exit(EpochRecord *record) {
+    if (--record->depth == 0) atomic_store_explicit(&record->active, 0, memory_order_release);
+}
+
+unsigned long long epoch_retire(void) {
+    return atomic_fetch_add(&epoch_now, 1) + 1;
+}
+
+bool epoch_passed(unsigned long long epoch) {
+    for (EpochRecord *record = atomic_load(&epoch_records); record; record = record->next) {
+        unsigned long long active = atomic_load(&record->active);
+        if (active != 0 && active < epoch) return false;
+    }
+    return true;
+}
+
+void epoch_synchronize(void) {
+    unsigned long long epoch = epoch_retire();
+    for (EpochRecord *record = atomic_load(&epoch_records); record; record = record->next) {
+        unsigned spins = 0;
+        unsigned long long active;
+        while ((active = atomic_load(&record->active)) != 0 && active < epoch) {
+            spin_wait(&spins);
+        }
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <stdbool.h>
+
+// Epoch-based reclamation, shared by all lock-free readers of the process
+// (watch indexes, the name table). A reader announces the epoch it entered at
+// in its thread's own record; whoever unlinks something frees it only once
+// no record shows an epoch older than the one after the unlink.
+typedef struct EpochRecord EpochRecord;
+
+// Announces that the thread may use shared objects until epoch_exit().
+// Sections may nest; only the outermost one counts.
+EpochRecord *epoch_enter(void);
+
+void epoch_exit(EpochRecord *record);
+
+// Moves to a new epoch and returns it: what was unlinked before the call
+// may be freed once epoch_passed() says so for the returned epoch.
+unsigned long long epoch_retire(void);
+
+// Whether no thread is still in a section entered before `epoch`. Never waits.
+bool epoch_passed(unsigned long long epoch);
+
+// Waits until no thread can use what was unlinked before the call.
+void epoch_synchronize(void);
@@ -4,58 +4,209 @@
 
 #include "HashMap.h"
 
-// We fix the number of hash buckets for simplicity.
-#define N_BUCKETS 8
+// The number of hash buckets is a power of two, at least MIN_BUCKETS.
+// It doubles when there are more than MAX_LOAD entries per bucket on average,
+// and shrinks to fit when there are fewer than one per two buckets.
+#define MIN_BUCKETS 8
+#define MAX_LOAD 2
 
 typedef struct Pair Pair;
 
 struct Pair {
-    char* key;
+    NameId key;
     void* value;
     Pair* next; // Next item in a single-linked list.
 };
 
 struct HashMap {
-    Pair* buckets[N_BUCKETS]; // Linked lists of key-value pairs.
+    Pair** buckets; // Linked lists of key-value pairs.
+    size_t n_buckets;
     size_t size; // total number of entries in map.
+    size_t modifications; // number of successful inserts and removes.
+    // Pairs packed together by hmap_compact, or reserved by hmap_new_sized:
+    // room for `arena_capacity` pairs. They are not free'd one by one:
+    // the arena is free'd once none of its `arena_pairs` pairs is in the map.
+    Pair* arena;
+    size_t arena_capacity;
+    size_t arena_pairs;
+    size_t arena_live;
+    // Memory given to hmap_new_at, which is not free'd: the map itself,
+    // `placed_buckets` (unless they are `min_buckets`), and the arena while it is
+    // the one the map started with (`arena_placed`).
+    bool placed;
+    bool arena_placed;
+    Pair** placed_buckets;
+    Pair* min_buckets[MIN_BUCKETS]; // `buckets` of a small map.
 };
 
-static unsigned int get_hash(const char* key);
+static unsigned int get_hash(NameId key);
+
+static bool in_arena(HashMap* map, Pair* p)
+{
+    return map->arena && p >= map->arena && p < map->arena + map->arena_capacity;
+}
+
+// Free the pair removed from the map.
+static void free_pair(HashMap* map, Pair* p)
+{
+    if (!in_arena(map, p)) {
+        free(p);
+    } else if (--map->arena_live == 0) {
+        if (!map->arena_placed)
+            free(map->arena);
+        map->arena_placed = false;
+        map->arena = NULL;
+        map->arena_capacity = 0;
+        map->arena_pairs = 0;
+    }
+}
+
+void hmap_free(HashMap* map)
+{
+    for (size_t h = 0; h < map->n_buckets; ++h) {
+        for (Pair* p = map->buckets[h]; p;) {
+            Pair* q = p;
+            p = p->next;
+            if (!in_arena(map, q))
+                free(q);
+        }
+    }
+    if (!map->arena_placed)
+        free(map->arena);
+    if (map->buckets != map->min_buckets && map->buckets != map->placed_buckets)
+        free(map->buckets);
+    if (!map->placed)
+        free(map);
+}
+
+// Number of buckets for `size` entries right after a resize.
+static size_t fit_buckets(size_t size)
+{
+    size_t n = MIN_BUCKETS;
+    while (n < size)
+        n *= 2;
+    return n;
+}
 
 HashMap* hmap_new()
+{
+    return hmap_new_sized(0);
+}
+
+HashMap* hmap_new_sized(size_t n_entries)
 {
     HashMap* map = malloc(sizeof(HashMap));
     if (!map)
         return NULL;
     memset(map, 0, sizeof(HashMap));
+    map->buckets = map->min_buckets;
+    map->n_buckets = fit_buckets(n_entries);
+    if (map->n_buckets > MIN_BUCKETS) {
+        map->buckets = calloc(map->n_buckets, sizeof(Pair*));
+        if (!map->buckets) {
+            free(map);
+            return NULL;
+        }
+    }
+    if (n_entries > 0) {
+        map->arena = malloc(n_entries * sizeof(Pair));
+        if (!map->arena) {
+            hmap_free(map);
+            return NULL;
+        }
+        map->arena_capacity = n_entries;
+    }
     return map;
 }
 
-void hmap_free(HashMap* map)
+size_t hmap_footprint(size_t n_entries)
+{
+    size_t n_buckets = fit_buckets(n_entries);
+    size_t bytes = sizeof(HashMap) + n_entries * sizeof(Pair);
+    if (n_buckets > MIN_BUCKETS)
+        bytes += n_buckets * sizeof(Pair*);
+    return bytes;
+}
+
+HashMap* hmap_new_at(void* mem, size_t n_entries)
 {
-    for (int h = 0; h < N_BUCKETS; ++h) {
+    HashMap* map = mem;
+    memset(map, 0, sizeof(HashMap));
+    map->placed = true;
+    map->buckets = map->min_buckets;
+    map->n_buckets = fit_buckets(n_entries);
+    // Pairs first: both they and the map hold pointers, so they stay aligned.
+    Pair* pairs = (Pair*)(map + 1);
+    if (map->n_buckets > MIN_BUCKETS) {
+        map->buckets = (Pair**)(pairs + n_entries);
+        memset(map->buckets, 0, map->n_buckets * sizeof(Pair*));
+        map->placed_buckets = map->buckets;
+    }
+    if (n_entries > 0) {
+        map->arena = pairs;
+        map->arena_capacity = n_entries;
+        map->arena_placed = true;
+    }
+    return map;
+}
+
+// Take a pair from the arena, or return NULL if there is no room left.
+static Pair* arena_pair(HashMap* map)
+{
+    if (!map->arena || map->arena_pairs == map->arena_capacity)
+        return NULL;
+    map->arena_live++;
+    return map->arena + map->arena_pairs++;
+}
+
+// Move all pairs to `n_buckets` buckets.
+// Keeps the current buckets if memory for the new ones can't be allocated.
+static void rehash(HashMap* map, size_t n_buckets)
+{
+    if (n_buckets == map->n_buckets)
+        return;
+    Pair** buckets = map->min_buckets;
+    if (n_buckets > MIN_BUCKETS) {
+        buckets = calloc(n_buckets, sizeof(Pair*));
+        if (!buckets)
+            return;
+    }
+    Pair* pairs = NULL;
+    for (size_t h = 0; h < map->n_buckets; ++h) {
         for (Pair* p = map->buckets[h]; p;) {
             Pair* q = p;
             p = p->next;
-            free(q->key);
-            free(q);
+            q->next = pairs;
+            pairs = q;
         }
     }
-    free(map);
+    if (map->buckets != map->min_buckets && map->buckets != map->placed_buckets)
+        free(map->buckets);
+    else if (map->buckets == map->min_buckets && buckets != map->min_buckets)
+        memset(map->min_buckets, 0, sizeof(map->min_buckets));
+    map->buckets = buckets;
+    map->n_buckets = n_buckets;
+    while (pairs) {
+        Pair* q = pairs;
+        pairs = pairs->next;
+        unsigned int h = get_hash(q->key) & (n_buckets - 1);
+        q->next = buckets[h];
+        buckets[h] = q;
+    }
 }
 
-static Pair* hmap_find(HashMap* map, int h, const char* key)
+static Pair* hmap_find(HashMap* map, unsigned int h, NameId key)
 {
     for (Pair* p = map->buckets[h]; p; p = p->next) {
-        if (strcmp(key, p->key) == 0)
+        if (p->key == key)
             return p;
     }
     return NULL;
 }
 
-void* hmap_get(HashMap* map, const char* key)
+void* hmap_get(HashMap* map, NameId key)
 {
-    int h = get_hash(key);
+    unsigned int h = get_hash(key) & (map->n_buckets - 1);
     Pair* p = hmap_find(map, h, key);
     if (p)
         return p->value;
@@ -63,34 +214,44 @@ void* hmap_get(HashMap* map, const char* key)
         return NULL;
 }
 
-bool hmap_insert(HashMap* map, const char* key, void* value)
+bool hmap_insert(HashMap* map, NameId key, void* value)
 {
-    if (!value)
+    if (!value || key == NAME_NONE)
         return false;
-    int h = get_hash(key);
+    unsigned int h = get_hash(key) & (map->n_buckets - 1);
     Pair* p = hmap_find(map, h, key);
     if (p)
         return false; // Already exists.
-    Pair* new_p = malloc(sizeof(Pair));
-    new_p->key = strdup(key);
+    Pair* new_p = arena_pair(map);
+    if (!new_p) {
+        new_p = malloc(sizeof(Pair));
+        if (!new_p)
+            return false;
+    }
+    new_p->key = key;
     new_p->value = value;
     new_p->next = map->buckets[h];
     map->buckets[h] = new_p;
     map->size++;
+    map->modifications++;
+    if (map->size > MAX_LOAD * map->n_buckets)
+        rehash(map, map->n_buckets * 2);
     return true;
 }
 
-bool hmap_remove(HashMap* map, const char* key)
+bool hmap_remove(HashMap* map, NameId key)
 {
-    int h = get_hash(key);
+    unsigned int h = get_hash(key) & (map->n_buckets - 1);
     Pair** pp = &(map->buckets[h]);
     while (*pp) {
         Pair* p = *pp;
-        if (strcmp(key, p->key) == 0) {
+        if (p->key == key) {
             *pp = p->next;
-            free(p->key);
-            free(p);
+            free_pair(map, p);
             map->size--;
+            map->modifications++;
+            if (map->n_buckets > MIN_BUCKETS && 2 * map->size < map->n_buckets)
+                rehash(map, fit_buckets(map->size));
             return true;
         }
         pp = &(p->next);
@@ -103,16 +264,72 @@ size_t hmap_size(HashMap* map)
     return map->size;
 }
 
+size_t hmap_modifications(HashMap* map)
+{
+    return map->modifications;
+}
+
+size_t hmap_memory(HashMap* map)
+{
+    size_t bytes = sizeof(HashMap) + map->arena_capacity * sizeof(Pair);
+    if (map->buckets != map->min_buckets)
+        bytes += map->n_buckets * sizeof(Pair*);
+    // Pairs outside of the arena.
+    bytes += (map->size - map->arena_live) * sizeof(Pair);
+    return bytes;
+}
+
+HashMap* hmap_compact(HashMap* map)
+{
+    if (map->arena_live == map->arena_pairs && map->arena_live == map->size
+        && map->arena_capacity == map->size
+        && map->n_buckets == fit_buckets(map->size))
+        return NULL; // Compact already.
+
+    HashMap* copy = hmap_new();
+    if (!copy)
+        return NULL;
+    if (map->size > 0) {
+        copy->arena = malloc(map->size * sizeof(Pair));
+        if (!copy->arena) {
+            hmap_free(copy);
+            return NULL;
+        }
+        copy->arena_capacity = map->size;
+    }
+    rehash(copy, fit_buckets(map->size));
+    if (copy->n_buckets != fit_buckets(map->size)) {
+        hmap_free(copy);
+        return NULL;
+    }
+
+    Pair* pairs = copy->arena;
+    for (size_t h = 0; h < map->n_buckets; ++h) {
+        for (Pair* p = map->buckets[h]; p; p = p->next) {
+            Pair* q = pairs++;
+            q->key = p->key;
+            q->value = p->value;
+            unsigned int ch = get_hash(q->key) & (copy->n_buckets - 1);
+            q->next = copy->buckets[ch];
+            copy->buckets[ch] = q;
+        }
+    }
+    copy->size = map->size;
+    copy->arena_pairs = map->size;
+    copy->arena_live = map->size;
+    return copy;
+}
+
 HashMapIterator hmap_iterator(HashMap* map)
 {
     HashMapIterator it = { 0, map->buckets[0] };
     return it;
 }
 
-bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value)
+bool hmap_next(HashMap* map, HashMapIterator* it, NameId* key, void** value)
 {
     Pair* p = it->pair;
-    while (!p && it->bucket < N_BUCKETS - 1) {
+    while (!p && it->bucket < (int)map->n_buckets - 1) {
         p = map->buckets[++it->bucket];
     }
     if (!p)
@@ -123,12 +340,9 @@ bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value
     return true;
 }
 
-static unsigned int get_hash(const char* key)
+// Ids are dense, so mixing their bits is enough (no need for the hash of the name).
+static unsigned int get_hash(NameId key)
 {
-    unsigned int hash = 17;
-    while (*key) {
-        hash = (hash << 3) + hash + *key;
-        ++key;
-    }
-    return hash % N_BUCKETS;
+    unsigned int hash = (uint32_t) key * 2654435761u; // Ids differ in the lower half.
+    return hash ^ (hash >> 16);
 }
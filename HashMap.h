@@ -1,35 +1,61 @@
 #pragma once
 #include <stdbool.h>
 #include <sys/types.h>
+#include "NameTable.h"
 
 // A structure representing a mapping from keys to values.
-// Keys are C-strings (null-terminated char*), all distinct.
+// Keys are ids of interned names (see NameTable.h), all distinct, never NAME_NONE.
 // Values are non-null pointers (void*, which you can cast to any other pointer type).
 typedef struct HashMap HashMap;
 
 // Create a new, empty map.
 HashMap* hmap_new();
 
-// Clear the map and free its memory. This frees the map and the keys
-// copied by hmap_insert, but does not free any values.
+// Create a new, empty map with buckets for `n_entries` entries, and memory
+// for them allocated at once, so that inserting them takes no further allocations.
+HashMap* hmap_new_sized(size_t n_entries);
+
+// Return the number of bytes hmap_new_at needs for a map with `n_entries` entries.
+size_t hmap_footprint(size_t n_entries);
+
+// Create a map like hmap_new_sized, but in the hmap_footprint(n_entries) bytes
+// at `mem` (aligned like malloc'ed memory), which hmap_free does not free.
+// Never fails.
+HashMap* hmap_new_at(void* mem, size_t n_entries);
+
+// Clear the map and free its memory. This does not free any values.
 void hmap_free(HashMap* map);
 
 // Get the value stored under `key`, or NULL if not present.
-void* hmap_get(HashMap* map, const char* key);
+void* hmap_get(HashMap* map, NameId key);
 
 // Insert a `value` under `key` and return true,
 // or do nothing and return false if `key` already exists in the map.
 // `value` must not be NULL.
-// (The caller can free `key` at any time - the map internally uses a copy of it).
-bool hmap_insert(HashMap* map, const char* key, void* value);
+bool hmap_insert(HashMap* map, NameId key, void* value);
 
 // Remove the value under `key` and return true (the value is not free'd),
 // or do nothing and return false if `key` was not present.
-bool hmap_remove(HashMap* map, const char* key);
+bool hmap_remove(HashMap* map, NameId key);
 
 // Return the number of elements in the map.
 size_t hmap_size(HashMap* map);
 
+// Return the number of successful inserts and removes so far.
+// (Lets the caller check that the map did not change in the meantime.)
+size_t hmap_modifications(HashMap* map);
+
+// Return the number of bytes allocated for the map.
+size_t hmap_memory(HashMap* map);
+
+// Return a copy of the map with all its pairs packed into
+// a single fresh allocation and as few buckets as needed.
+// Returns NULL if the map is compact already, or if memory can't be allocated.
+// The values are shared with the map.
+// (Maps shrink on their own when entries are removed, but only a copy
+// moves the remaining entries out of memory fragmented by the removed ones.)
+HashMap* hmap_compact(HashMap* map);
+
 typedef struct HashMapIterator HashMapIterator;
 
 // Return an iterator to the map. See `hmap_next`.
@@ -43,13 +69,13 @@ HashMapIterator hmap_iterator(HashMap* map);
 // The map cannot be modified between calls to `hmap_iterator` and `hmap_next`.
 //
 // Usage: ```
-//     const char* key;
+//     NameId key;
 //     void* value;
 //     HashMapIterator it = hmap_iterator(map);
 //     while (hmap_next(map, &it, &key, &value))
 //         foo(key, value);
 // ```
-bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value);
+bool hmap_next(HashMap* map, HashMapIterator* it, NameId* key, void** value);
 
 struct HashMapIterator {
     int bucket;
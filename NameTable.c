@@ -0,0 +1,324 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Epoch.h"
+#include "NameTable.h"
+#include "err.h"
+
+/*
+ * Names are copied once, into records carved out of large blocks,
+ * and numbered from 1 in order of interning. A record is found by id
+ * through a two-level array of pages, and by name through an open-addressing
+ * table of slots holding the index of the id together with the hash
+ * of the name, so that probing compares hashes without touching the records,
+ * and the table is rebuilt (when half of it is used) without hashing
+ * the names again.
+ *
+ * name_find and name_str take no locks. A record and its page entry
+ * are written before the slot with its index is published (release),
+ * and a rebuilt table is filled before it is published, so whoever
+ * finds an index sees its record.
+ *
+ * A name whose last reference is given back is forgotten under the mutex:
+ * its slot becomes a tombstone, its page entry NULL, and its index goes
+ * to a free list with the generation of the id incremented. Readers
+ * may still be comparing the record, or probing a replaced table,
+ * so both are retired: kept until no reader has been inside
+ * since then (see Epoch.h), and then records are reused for
+ * new names of the same size, and tables freed.
+ * The fast path of name_intern takes a reference only from a count
+ * which is not 0 yet; a forgotten name can be taken back only under
+ * the mutex, before whoever dropped it to 0 gets there.
+ */
+
+#define PAGE_BITS 12
+#define PAGE_IDS (1u << PAGE_BITS)
+#define MAX_PAGES (1u << 16) // So at most 2^28 names at a time.
+#define BLOCK_BYTES 65536
+#define MIN_SLOTS 1024
+#define TOMBSTONE UINT64_MAX // Slot of a forgotten name.
+#define RECORD_ALIGN 8
+#define N_CLASSES 64 // Records of up to N_CLASSES * RECORD_ALIGN bytes are reused.
+
+typedef struct Name Name;
+
+struct Name {
+    NameId id;
+    union {
+        atomic_size_t refs; // Index entries keyed by the id, and interns on the way.
+        Name *next_free; // Once retired and out of sight of readers.
+    };
+    uint32_t len;
+    uint32_t bytes; // Of the record.
+    char str[];
+};
+
+typedef struct Table Table;
+
+struct Table {
+    size_t n_slots; // Power of two.
+    _Atomic uint64_t slots[]; // Hash << 32 | index, 0 for an empty slot.
+};
+
+typedef struct Retired Retired;
+
+// Record or table to be reused once readers are done with it.
+struct Retired {
+    unsigned long long epoch;
+    Name *name;
+    Table *table;
+};
+
+static struct {
+    pthread_mutex_t mutex; // For everything below but `table`.
+    _Atomic(Table *) table;
+    _Atomic(Name *) *pages[MAX_PAGES];
+    uint32_t n_indexes; // Ever given out.
+    size_t n_names; // Not forgotten.
+    size_t n_tombstones; // In `table`.
+    NameId *free_ids; // Next ids of free indexes.
+    size_t n_free_ids, cap_free_ids;
+    Retired *retired; // In order of epochs.
+    size_t n_retired, cap_retired;
+    Name *free_records[N_CLASSES]; // By size.
+    char *block; // Rest of the block records are carved out of.
+    size_t block_left;
+    size_t bytes; // Allocated for blocks, large records, pages and tables.
+} names = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static uint32_t hash_name(const char *name, size_t len) {
+    uint32_t hash = 2166136261u; // FNV-1a.
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns the record at `index`, or NULL if it has been forgotten.
+static Name *name_record(uint32_t index) {
+    return atomic_load_explicit(&names.pages[index >> PAGE_BITS][index & (PAGE_IDS - 1)],
+                                memory_order_acquire);
+}
+
+static Name *table_find(Table *t, const char *name, size_t len, uint32_t hash) {
+    if (!t) return NULL;
+    size_t mask = t->n_slots - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        uint64_t slot = atomic_load_explicit(&t->slots[i], memory_order_acquire);
+        if (slot == 0) return NULL;
+        if (slot == TOMBSTONE || (uint32_t) (slot >> 32) != hash) continue;
+        Name *n = name_record((uint32_t) slot);
+        if (n && n->len == len && memcmp(n->str, name, len) == 0) return n;
+    }
+}
+
+static void table_put(Table *t, uint64_t slot) {
+    size_t mask = t->n_slots - 1;
+    size_t i = (slot >> 32) & mask;
+    uint64_t old;
+    while ((old = atomic_load_explicit(&t->slots[i], memory_order_relaxed)) != 0 && old != TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (old == TOMBSTONE) --names.n_tombstones;
+    atomic_store_explicit(&t->slots[i], slot, memory_order_release);
+}
+
+static void retire(Name *name, Table *table) {
+    if (names.n_retired == names.cap_retired) {
+        names.cap_retired = names.cap_retired ? 2 * names.cap_retired : 64;
+        names.retired = realloc(names.retired, names.cap_retired * sizeof(Retired));
+        if (!names.retired) syserr("memory alloc failed!");
+    }
+    names.retired[names.n_retired++] = (Retired) {.epoch = epoch_retire(), .name = name, .table = table};
+}
+
+// Reuses records and frees tables readers are done with.
+static void reclaim(void) {
+    size_t n = 0;
+    while (n < names.n_retired && epoch_passed(names.retired[n].epoch)) {
+        Retired *r = &names.retired[n++];
+        if (r->table) {
+            names.bytes -= sizeof(Table) + r->table->n_slots * sizeof(uint64_t);
+            free(r->table);
+        } else if (r->name->bytes / RECORD_ALIGN < N_CLASSES) {
+            Name **list = &names.free_records[r->name->bytes / RECORD_ALIGN];
+            r->name->next_free = *list;
+            *list = r->name;
+        } else {
+            names.bytes -= r->name->bytes;
+            free(r->name);
+        }
+    }
+    names.n_retired -= n;
+    memmove(names.retired, names.retired + n, names.n_retired * sizeof(Retired));
+}
+
+// Replaces the table (or makes a first one) with one of at least four
+// slots per name, without tombstones.
+static Table *table_rebuild(Table *old) {
+    size_t n_slots = MIN_SLOTS;
+    while (n_slots < 4 * (names.n_names + 1)) n_slots *= 2;
+    size_t bytes = sizeof(Table) + n_slots * sizeof(uint64_t);
+    Table *t = calloc(1, bytes);
+    if (!t) syserr("memory alloc failed!");
+    t->n_slots = n_slots;
+    names.n_tombstones = 0;
+    for (size_t i = 0; old && i < old->n_slots; ++i) {
+        uint64_t slot = atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+        if (slot && slot != TOMBSTONE) table_put(t, slot);
+    }
+    names.bytes += bytes;
+    atomic_store_explicit(&names.table, t, memory_order_release);
+    if (old) retire(NULL, old);
+    return t;
+}
+
+// Returns a record of `bytes` bytes, reused if possible.
+static Name *record_alloc(size_t bytes) {
+    size_t class = bytes / RECORD_ALIGN;
+    if (class < N_CLASSES && names.free_records[class]) {
+        Name *n = names.free_records[class];
+        names.free_records[class] = n->next_free;
+        return n;
+    }
+    if (class >= N_CLASSES) {
+        Name *n = malloc(bytes);
+        if (!n) syserr("memory alloc failed!");
+        names.bytes += bytes;
+        return n;
+    }
+    if (names.block_left < bytes) {
+        names.block = malloc(BLOCK_BYTES);
+        if (!names.block) syserr("memory alloc failed!");
+        names.block_left = BLOCK_BYTES;
+        names.bytes += BLOCK_BYTES;
+    }
+    Name *n = (Name *) names.block;
+    names.block += bytes;
+    names.block_left -= bytes;
+    return n;
+}
+
+// Returns a free id: a forgotten one, or a new one.
+static NameId id_alloc(void) {
+    if (names.n_free_ids > 0) return names.free_ids[--names.n_free_ids];
+    NameId id = ++names.n_indexes;
+    if (id >> PAGE_BITS >= MAX_PAGES) fatal("too many distinct folder names");
+    _Atomic(Name *) **page = &names.pages[id >> PAGE_BITS];
+    if (!*page) {
+        *page = calloc(PAGE_IDS, sizeof(Name *));
+        if (!*page) syserr("memory alloc failed!");
+        names.bytes += PAGE_IDS * sizeof(Name *);
+    }
+    return id;
+}
+
+// Copies a new name into a record with one reference and gives it an id.
+static Name *name_add(const char *name, size_t len, uint32_t hash) {
+    if (names.n_retired > 0) reclaim();
+    size_t bytes = (sizeof(Name) + len + 1 + RECORD_ALIGN - 1) & ~(size_t) (RECORD_ALIGN - 1);
+    Name *n = record_alloc(bytes);
+    n->id = id_alloc();
+    atomic_init(&n->refs, 1);
+    n->len = len;
+    n->bytes = bytes;
+    memcpy(n->str, name, len);
+    n->str[len] = '\0';
+
+    uint32_t index = (uint32_t) n->id;
+    atomic_store_explicit(&names.pages[index >> PAGE_BITS][index & (PAGE_IDS - 1)], n,
+                          memory_order_release);
+    ++names.n_names;
+    Table *t = atomic_load_explicit(&names.table, memory_order_relaxed);
+    if (!t || 2 * (names.n_names + names.n_tombstones) > t->n_slots) t = table_rebuild(t);
+    table_put(t, (uint64_t) hash << 32 | index);
+    return n;
+}
+
+// Forgets the name with no references left.
+static void name_forget(Name *n) {
+    uint32_t index = (uint32_t) n->id;
+    uint64_t slot = (uint64_t) hash_name(n->str, n->len) << 32 | index;
+    Table *t = atomic_load_explicit(&names.table, memory_order_relaxed);
+    size_t mask = t->n_slots - 1;
+    size_t i = (slot >> 32) & mask;
+    while (atomic_load_explicit(&t->slots[i], memory_order_relaxed) != slot) i = (i + 1) & mask;
+    atomic_store_explicit(&t->slots[i], TOMBSTONE, memory_order_release);
+    ++names.n_tombstones;
+    --names.n_names;
+    atomic_store_explicit(&names.pages[index >> PAGE_BITS][index & (PAGE_IDS - 1)], NULL,
+                          memory_order_release);
+
+    if (names.n_free_ids == names.cap_free_ids) {
+        names.cap_free_ids = names.cap_free_ids ? 2 * names.cap_free_ids : 64;
+        names.free_ids = realloc(names.free_ids, names.cap_free_ids * sizeof(NameId));
+        if (!names.free_ids) syserr("memory alloc failed!");
+    }
+    names.free_ids[names.n_free_ids++] = ((n->id >> 32) + 1) << 32 | index;
+    retire(n, NULL);
+}
+
+// Takes a reference, unless the name has none left.
+static bool name_hold(Name *n) {
+    size_t refs = atomic_load_explicit(&n->refs, memory_order_relaxed);
+    while (refs > 0) {
+        if (atomic_compare_exchange_weak_explicit(&n->refs, &refs, refs + 1,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+NameId name_intern(const char *name, size_t len) {
+    uint32_t hash = hash_name(name, len);
+    EpochRecord *record = epoch_enter();
+    Name *n = table_find(atomic_load_explicit(&names.table, memory_order_acquire), name, len, hash);
+    NameId id = n && name_hold(n) ? n->id : NAME_NONE;
+    epoch_exit(record);
+    if (id != NAME_NONE) return id;
+
+    pthread_mutex_lock(&names.mutex);
+    n = table_find(atomic_load_explicit(&names.table, memory_order_relaxed), name, len, hash);
+    if (n) atomic_fetch_add_explicit(&n->refs, 1, memory_order_relaxed);
+    else n = name_add(name, len, hash);
+    id = n->id;
+    pthread_mutex_unlock(&names.mutex);
+    return id;
+}
+
+void name_release(NameId id) {
+    Name *n = name_record((uint32_t) id);
+    if (atomic_fetch_sub_explicit(&n->refs, 1, memory_order_acq_rel) > 1) return;
+
+    pthread_mutex_lock(&names.mutex);
+    // Unless it has been interned again, or forgotten already, in the meantime.
+    n = name_record((uint32_t) id);
+    if (n && n->id == id && atomic_load_explicit(&n->refs, memory_order_relaxed) == 0) name_forget(n);
+    pthread_mutex_unlock(&names.mutex);
+}
+
+NameId name_find(const char *name, size_t len) {
+    uint32_t hash = hash_name(name, len);
+    EpochRecord *record = epoch_enter();
+    Name *n = table_find(atomic_load_explicit(&names.table, memory_order_acquire), name, len, hash);
+    NameId id = n ? n->id : NAME_NONE;
+    epoch_exit(record);
+    return id;
+}
+
+const char *name_str(NameId id) {
+    return name_record((uint32_t) id)->str;
+}
+
+size_t name_len(NameId id) {
+    return name_record((uint32_t) id)->len;
+}
+
+size_t name_table_memory() {
+    pthread_mutex_lock(&names.mutex);
+    size_t bytes = names.bytes;
+    pthread_mutex_unlock(&names.mutex);
+    return bytes;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Interned folder names: each distinct name gets a small integer id,
+// shared by all trees of the process, so that child indexes store
+// and compare ids instead of copies of the names.
+// Names are reference counted: an entry of a child index holds
+// a reference to its key, taken by name_intern() before it is inserted
+// and given back by name_release() once it is removed.
+// A name nobody holds is forgotten and its id reused, but with
+// a new generation in its upper half, so a stale id never stands
+// for another name: it is just not found in any index.
+// All functions are thread-safe; only interning a new name
+// and forgetting one take a lock.
+typedef uint64_t NameId;
+
+// Id of no name, e.g. of one never interned (see name_find).
+#define NAME_NONE 0
+
+// Return the id of the `len` bytes at `name` (not necessarily null-terminated),
+// interning them if needed, and take a reference to it.
+NameId name_intern(const char* name, size_t len);
+
+// Give back a reference taken by name_intern().
+void name_release(NameId id);
+
+// Return the id of the `len` bytes at `name`, or NAME_NONE if they are not interned.
+// Takes no reference: the id is exact as long as the caller has locked
+// an index it may be found in, and may be stale otherwise.
+NameId name_find(const char* name, size_t len);
+
+// Return the null-terminated name with id `id`, valid as long as it is referenced.
+const char* name_str(NameId id);
+
+// Return the length of the name with id `id`.
+size_t name_len(NameId id);
+
+// Return the number of bytes allocated for interned names and their indexes.
+size_t name_table_memory();
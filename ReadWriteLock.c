@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <pthread.h>
 #include "ReadWriteLock.h"
+#include "Trace.h"
 #include "err.h"
 
 /**
@@ -23,6 +26,21 @@
  *
  * Also, waiting writers can only stop waiting
  * when the counter is zero at the time of their wake up.
+ *
+ * A timed waiter which runs out of time first checks
+ * whether it may take the lock anyway (it could have been
+ * woken and timed out at once). Only otherwise it leaves,
+ * and it never leaves when counted in a running cascade.
+ *
+ * An upgradable reader is counted as a working reader, and
+ * while it is in (`up_held`), writers and other upgradable readers
+ * can't get in. It waits on its own condition variable, like
+ * a new reader, but also while another one is in. Its upgrade
+ * counts as a waiting writer, which holds new readers back,
+ * and is woken up on its own condition variable by the last
+ * reader to leave, so a waiting writer can't take its turn.
+ *
+ * With TREE_TRACE, waits and releases are traced (see Trace.h).
  */
 struct RWLock {
     size_t wait_wr; // number of waiting writers
@@ -30,37 +48,74 @@ struct RWLock {
     size_t work_wr; // number of working writers
     size_t work_rd; // number of working readers
     size_t cascade_counter; // number of yet to-be-awaken readers
+    size_t wait_up; // number of waiting upgradable readers
+    bool up_held; // an upgradable reader is working (or upgrading)
+    bool upgrading; // it waits for readers to leave (counted in wait_wr)
     pthread_cond_t to_read;
     pthread_cond_t to_write;
+    pthread_cond_t to_up;
+    pthread_cond_t to_upgrade;
     pthread_mutex_t mutex;
 };
 
 RWLock *rwlock_new() {
     RWLock *r = malloc(sizeof(RWLock));
     if (!r) syserr("memory alloc failed!");
+    return rwlock_init(r);
+}
+
+RWLock *rwlock_init(void *mem) {
+    RWLock *r = mem;
 
+    // Deadlines of timed waits are given on the monotonic clock.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
     pthread_mutex_init(&r->mutex, 0);
-    pthread_cond_init(&r->to_write, 0);
-    pthread_cond_init(&r->to_read, 0);
+    pthread_cond_init(&r->to_write, &attr);
+    pthread_cond_init(&r->to_read, &attr);
+    pthread_cond_init(&r->to_up, &attr);
+    pthread_cond_init(&r->to_upgrade, &attr);
+    pthread_condattr_destroy(&attr);
 
     r->wait_wr = 0;
     r->wait_rd = 0;
     r->work_wr = 0;
     r->work_rd = 0;
     r->cascade_counter = 0;
+    r->wait_up = 0;
+    r->up_held = false;
+    r->upgrading = false;
     return r;
 }
 
+// Whether a writer has to wait.
+static bool wr_blocked(RWLock *lock) {
+    return lock->work_rd > 0 || lock->work_wr > 0 || lock->cascade_counter > 0 || lock->up_held;
+}
+
+// Whether a new upgradable reader has to wait.
+static bool up_blocked(RWLock *lock) {
+    return lock->cascade_counter > 0 || lock->wait_wr > 0 || lock->work_wr > 0 || lock->up_held;
+}
+
+// Wakes up waiting upgradable readers after a change that may let one in.
+static void wake_up_waiters(RWLock *lock) {
+    if (lock->wait_up > 0) pthread_cond_broadcast(&lock->to_up);
+}
+
 // Acquire read lock.
 int rwlock_rd_lock(RWLock *lock) {
     pthread_mutex_lock(&lock->mutex);
     ++lock->wait_rd;
     if (lock->cascade_counter > 0 || lock->wait_wr > 0 || lock->work_wr > 0) {
         // reader should wait
+        TRACE_BEGIN(TRACE_LOCK_WAIT, lock);
         do {
             pthread_cond_wait(&lock->to_read, &lock->mutex);
         } while (lock->work_wr > 0 || lock->cascade_counter == 0);
-        --lock->cascade_counter;
+        if (--lock->cascade_counter == 0) wake_up_waiters(lock);
+        TRACE_END(TRACE_LOCK_WAIT, lock);
     }
 
     --lock->wait_rd;
@@ -71,9 +126,12 @@ int rwlock_rd_lock(RWLock *lock) {
 
 // Release read lock.
 int rwlock_rd_unlock(RWLock *lock) {
+    TRACE_INSTANT(TRACE_LOCK_RELEASE, lock);
     pthread_mutex_lock(&lock->mutex);
     --lock->work_rd;
-    if (lock->cascade_counter == 0 && lock->work_rd == 0 && lock->wait_wr > 0) {
+    if (lock->cascade_counter == 0 && lock->work_rd == 0 && lock->upgrading) {
+        pthread_cond_signal(&lock->to_upgrade);
+    } else if (lock->cascade_counter == 0 && lock->work_rd == 0 && lock->wait_wr > 0) {
         pthread_cond_signal(&lock->to_write);
     } else if (lock->cascade_counter == 0 && lock->work_rd == 0 && lock->wait_rd > 0) {
         lock->cascade_counter = lock->wait_rd;
@@ -87,9 +145,13 @@ int rwlock_rd_unlock(RWLock *lock) {
 int rwlock_wr_lock(RWLock *lock) {
     pthread_mutex_lock(&lock->mutex);
     ++lock->wait_wr;
-    while (lock->work_rd > 0 || lock->work_wr > 0 || lock->cascade_counter > 0) {
+    if (wr_blocked(lock)) {
         // writer should wait
-        pthread_cond_wait(&lock->to_write, &lock->mutex);
+        TRACE_BEGIN(TRACE_LOCK_WAIT, lock);
+        do {
+            pthread_cond_wait(&lock->to_write, &lock->mutex);
+        } while (wr_blocked(lock));
+        TRACE_END(TRACE_LOCK_WAIT, lock);
     }
     --lock->wait_wr;
     ++lock->work_wr;
@@ -99,6 +161,7 @@ int rwlock_wr_lock(RWLock *lock) {
 
 // Release write lock.
 int rwlock_wr_unlock(RWLock *lock) {
+    TRACE_INSTANT(TRACE_LOCK_RELEASE, lock);
     pthread_mutex_lock(&lock->mutex);
     --lock->work_wr;
     // always at most only one writer working
@@ -108,14 +171,202 @@ int rwlock_wr_unlock(RWLock *lock) {
     } else if (lock->cascade_counter == 0 && lock->wait_wr > 0) {
         pthread_cond_signal(&lock->to_write);
     }
+    wake_up_waiters(lock);
     pthread_mutex_unlock(&lock->mutex);
     return 0;
 }
 
-int rwlock_free(RWLock *lock) {
+// Acquire read lock if it is free right now.
+int rwlock_try_rd_lock(RWLock *lock) {
+    int err = 0;
+    pthread_mutex_lock(&lock->mutex);
+    if (lock->cascade_counter > 0 || lock->wait_wr > 0 || lock->work_wr > 0)
+        err = EBUSY;
+    else
+        ++lock->work_rd;
+    pthread_mutex_unlock(&lock->mutex);
+    return err;
+}
+
+// Acquire write lock if it is free right now.
+int rwlock_try_wr_lock(RWLock *lock) {
+    int err = 0;
+    pthread_mutex_lock(&lock->mutex);
+    if (wr_blocked(lock))
+        err = EBUSY;
+    else
+        ++lock->work_wr;
+    pthread_mutex_unlock(&lock->mutex);
+    return err;
+}
+
+// Acquire read lock, waiting at most until `deadline`.
+int rwlock_timed_rd_lock(RWLock *lock, const struct timespec *deadline) {
+    pthread_mutex_lock(&lock->mutex);
+    ++lock->wait_rd;
+    if (lock->cascade_counter > 0 || lock->wait_wr > 0 || lock->work_wr > 0) {
+        // reader should wait
+        TRACE_BEGIN(TRACE_LOCK_WAIT, lock);
+        do {
+            if (pthread_cond_timedwait(&lock->to_read, &lock->mutex, deadline) == ETIMEDOUT
+                && (lock->work_wr > 0 || lock->cascade_counter == 0)) {
+                // not part of any cascade, so nobody counts on this reader
+                --lock->wait_rd;
+                pthread_mutex_unlock(&lock->mutex);
+                TRACE_END(TRACE_LOCK_WAIT, lock);
+                return ETIMEDOUT;
+            }
+        } while (lock->work_wr > 0 || lock->cascade_counter == 0);
+        if (--lock->cascade_counter == 0) wake_up_waiters(lock);
+        TRACE_END(TRACE_LOCK_WAIT, lock);
+    }
+
+    --lock->wait_rd;
+    ++lock->work_rd;
+    pthread_mutex_unlock(&lock->mutex);
+    return 0;
+}
+
+// Acquire write lock, waiting at most until `deadline`.
+int rwlock_timed_wr_lock(RWLock *lock, const struct timespec *deadline) {
+    pthread_mutex_lock(&lock->mutex);
+    ++lock->wait_wr;
+    if (wr_blocked(lock)) {
+        // writer should wait
+        TRACE_BEGIN(TRACE_LOCK_WAIT, lock);
+        do {
+            if (pthread_cond_timedwait(&lock->to_write, &lock->mutex, deadline) == ETIMEDOUT
+                && wr_blocked(lock)) {
+                --lock->wait_wr;
+                // Readers held back only by this writer can join the working ones.
+                if (lock->wait_wr == 0 && lock->work_wr == 0 && lock->cascade_counter == 0
+                    && lock->wait_rd > 0) {
+                    lock->cascade_counter = lock->wait_rd;
+                    pthread_cond_broadcast(&lock->to_read);
+                }
+                wake_up_waiters(lock);
+                pthread_mutex_unlock(&lock->mutex);
+                TRACE_END(TRACE_LOCK_WAIT, lock);
+                return ETIMEDOUT;
+            }
+        } while (wr_blocked(lock));
+        TRACE_END(TRACE_LOCK_WAIT, lock);
+    }
+    --lock->wait_wr;
+    ++lock->work_wr;
+    pthread_mutex_unlock(&lock->mutex);
+    return 0;
+}
+
+// Acquire upgradable read lock.
+int rwlock_up_lock(RWLock *lock) {
+    pthread_mutex_lock(&lock->mutex);
+    if (up_blocked(lock)) {
+        ++lock->wait_up;
+        TRACE_BEGIN(TRACE_LOCK_WAIT, lock);
+        do {
+            pthread_cond_wait(&lock->to_up, &lock->mutex);
+        } while (up_blocked(lock));
+        TRACE_END(TRACE_LOCK_WAIT, lock);
+        --lock->wait_up;
+    }
+    lock->up_held = true;
+    ++lock->work_rd;
+    pthread_mutex_unlock(&lock->mutex);
+    return 0;
+}
+
+// Release upgradable read lock (when not upgraded).
+int rwlock_up_unlock(RWLock *lock) {
+    TRACE_INSTANT(TRACE_LOCK_RELEASE, lock);
+    pthread_mutex_lock(&lock->mutex);
+    --lock->work_rd;
+    lock->up_held = false;
+    if (lock->cascade_counter == 0 && lock->work_rd == 0 && lock->wait_wr > 0) {
+        pthread_cond_signal(&lock->to_write);
+    } else if (lock->cascade_counter == 0 && lock->work_rd == 0 && lock->wait_rd > 0) {
+        lock->cascade_counter = lock->wait_rd;
+        pthread_cond_broadcast(&lock->to_read);
+    }
+    wake_up_waiters(lock);
+    pthread_mutex_unlock(&lock->mutex);
+    return 0;
+}
+
+// Acquire upgradable read lock if it is free right now.
+int rwlock_try_up_lock(RWLock *lock) {
+    int err = 0;
+    pthread_mutex_lock(&lock->mutex);
+    if (up_blocked(lock)) {
+        err = EBUSY;
+    } else {
+        lock->up_held = true;
+        ++lock->work_rd;
+    }
+    pthread_mutex_unlock(&lock->mutex);
+    return err;
+}
+
+// Acquire upgradable read lock, waiting at most until `deadline`.
+int rwlock_timed_up_lock(RWLock *lock, const struct timespec *deadline) {
+    pthread_mutex_lock(&lock->mutex);
+    if (up_blocked(lock)) {
+        ++lock->wait_up;
+        TRACE_BEGIN(TRACE_LOCK_WAIT, lock);
+        do {
+            if (pthread_cond_timedwait(&lock->to_up, &lock->mutex, deadline) == ETIMEDOUT
+                && up_blocked(lock)) {
+                --lock->wait_up;
+                pthread_mutex_unlock(&lock->mutex);
+                TRACE_END(TRACE_LOCK_WAIT, lock);
+                return ETIMEDOUT;
+            }
+        } while (up_blocked(lock));
+        TRACE_END(TRACE_LOCK_WAIT, lock);
+        --lock->wait_up;
+    }
+    lock->up_held = true;
+    ++lock->work_rd;
+    pthread_mutex_unlock(&lock->mutex);
+    return 0;
+}
+
+// Turn the held upgradable read lock into a write lock.
+int rwlock_upgrade(RWLock *lock) {
+    pthread_mutex_lock(&lock->mutex);
+    --lock->work_rd;
+    if (lock->work_rd > 0 || lock->cascade_counter > 0) {
+        ++lock->wait_wr;
+        lock->upgrading = true;
+        TRACE_BEGIN(TRACE_LOCK_WAIT, lock);
+        do {
+            pthread_cond_wait(&lock->to_upgrade, &lock->mutex);
+        } while (lock->work_rd > 0 || lock->cascade_counter > 0);
+        TRACE_END(TRACE_LOCK_WAIT, lock);
+        lock->upgrading = false;
+        --lock->wait_wr;
+    }
+    lock->up_held = false;
+    ++lock->work_wr;
+    pthread_mutex_unlock(&lock->mutex);
+    return 0;
+}
+
+int rwlock_destroy(RWLock *lock) {
     pthread_cond_destroy(&lock->to_read);
     pthread_cond_destroy(&lock->to_write);
+    pthread_cond_destroy(&lock->to_up);
+    pthread_cond_destroy(&lock->to_upgrade);
     pthread_mutex_destroy(&lock->mutex);
+    return 0;
+}
+
+int rwlock_free(RWLock *lock) {
+    rwlock_destroy(lock);
     free(lock);
     return 0;
-}
\ No newline at end of file
+}
+
+size_t rwlock_size(void) {
+    return sizeof(RWLock);
+}
@@ -1,9 +1,28 @@
 #pragma once
+#include <stddef.h>
+#include <time.h>
 
+// Read-write lock used by the tree.
+// The implementation is chosen at compile time
+// with the RWLOCK_BACKEND CMake option:
+// - cascade: ReadWriteLock.c, mutex and condition variables (default),
+// - pthread: ReadWriteLockPthread.c, pthread_rwlock_t,
+// - spin: ReadWriteLockSpin.c, exclusive test-and-test-and-set spinlock,
+// - ticket: ReadWriteLockTicket.c, phase-fair ticket lock,
+// - queue: ReadWriteLockQueue.c, phase-fair queue lock (local spinning).
 typedef struct RWLock RWLock;
 
 RWLock *rwlock_new();
 
+// Locks can also be made in memory of the caller: rwlock_init() makes one
+// in the rwlock_size() bytes at `mem`, aligned to RWLOCK_ALIGN,
+// and rwlock_destroy() destroys it without freeing the memory.
+#define RWLOCK_ALIGN 64
+
+RWLock *rwlock_init(void *mem);
+
+int rwlock_destroy(RWLock *lock);
+
 int rwlock_rd_lock(RWLock *lock);
 
 int rwlock_rd_unlock(RWLock *lock);
@@ -12,6 +31,39 @@ int rwlock_wr_unlock(RWLock *lock);
 
 int rwlock_wr_lock(RWLock *lock);
 
+// Non-blocking variants: return EBUSY
+// instead of waiting when the lock is not free.
+int rwlock_try_rd_lock(RWLock *lock);
+
+int rwlock_try_wr_lock(RWLock *lock);
+
+// Variants waiting at most until `deadline`,
+// an absolute CLOCK_MONOTONIC time. Return ETIMEDOUT
+// (without holding the lock) once the deadline has passed.
+int rwlock_timed_rd_lock(RWLock *lock, const struct timespec *deadline);
+
+int rwlock_timed_wr_lock(RWLock *lock, const struct timespec *deadline);
+
+// Upgradable read lock: shared with readers, but exclusive
+// with writers and other upgradable holders, so what its holder
+// has read can't change until it either releases the lock
+// with rwlock_up_unlock() or turns it into a write lock with
+// rwlock_upgrade() (released with rwlock_wr_unlock() then).
+// The upgrade waits only for the readers already in; new ones
+// wait for the writer. It can't fail, so it has no timed variant.
+int rwlock_up_lock(RWLock *lock);
+
+int rwlock_up_unlock(RWLock *lock);
+
+int rwlock_try_up_lock(RWLock *lock);
+
+int rwlock_timed_up_lock(RWLock *lock, const struct timespec *deadline);
+
+int rwlock_upgrade(RWLock *lock);
+
 int rwlock_rm_lock(RWLock *lock);
 
-int rwlock_free(RWLock *lock);
\ No newline at end of file
+int rwlock_free(RWLock *lock);
+
+// Number of bytes allocated for a lock.
+size_t rwlock_size(void);
\ No newline at end of file
@@ -0,0 +1,174 @@
+// For pthread_rwlock_clock*lock().
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <pthread.h>
+#include "ReadWriteLock.h"
+#include "err.h"
+
+/**
+ * Read-write lock backed by pthread_rwlock_t.
+ *
+ * Where available, writers are preferred
+ * (like in the cascade implementation),
+ * otherwise the platform default policy is used.
+ *
+ * pthread_rwlock_t can't be upgraded, so writers and upgradable
+ * readers also hold `writer`, a mutex excluding each other.
+ * An upgradable reader holds it with a read lock, and upgrades
+ * by trading the read lock for the write lock: readers can slip in
+ * meanwhile, but no writer, so nothing it has read can change.
+ */
+struct RWLock {
+    pthread_rwlock_t rwlock;
+    pthread_mutex_t writer;
+};
+
+RWLock *rwlock_new() {
+    RWLock *r = malloc(sizeof(RWLock));
+    if (!r) syserr("memory alloc failed!");
+    return rwlock_init(r);
+}
+
+RWLock *rwlock_init(void *mem) {
+    RWLock *r = mem;
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    if (pthread_rwlock_init(&r->rwlock, &attr) != 0) syserr("rwlock init failed");
+    pthread_rwlockattr_destroy(&attr);
+    if (pthread_mutex_init(&r->writer, NULL) != 0) syserr("mutex init failed");
+    return r;
+}
+
+int rwlock_rd_lock(RWLock *lock) {
+    return pthread_rwlock_rdlock(&lock->rwlock);
+}
+
+int rwlock_rd_unlock(RWLock *lock) {
+    return pthread_rwlock_unlock(&lock->rwlock);
+}
+
+int rwlock_wr_lock(RWLock *lock) {
+    pthread_mutex_lock(&lock->writer);
+    return pthread_rwlock_wrlock(&lock->rwlock);
+}
+
+int rwlock_wr_unlock(RWLock *lock) {
+    int err = pthread_rwlock_unlock(&lock->rwlock);
+    pthread_mutex_unlock(&lock->writer);
+    return err;
+}
+
+int rwlock_try_rd_lock(RWLock *lock) {
+    return pthread_rwlock_tryrdlock(&lock->rwlock);
+}
+
+int rwlock_try_wr_lock(RWLock *lock) {
+    int err = pthread_mutex_trylock(&lock->writer);
+    if (err) return err;
+    err = pthread_rwlock_trywrlock(&lock->rwlock);
+    if (err) pthread_mutex_unlock(&lock->writer);
+    return err;
+}
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+// Locks the `writer` mutex, waiting at most until `deadline`.
+static int writer_timed_lock(RWLock *lock, const struct timespec *deadline) {
+    return pthread_mutex_clocklock(&lock->writer, CLOCK_MONOTONIC, deadline);
+}
+#else
+// Translates a CLOCK_MONOTONIC deadline to CLOCK_REALTIME,
+// which is what the POSIX timed lock functions expect.
+static struct timespec realtime_deadline(const struct timespec *deadline) {
+    struct timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    long long ns = (deadline->tv_sec - mono.tv_sec) * 1000000000LL
+                   + (deadline->tv_nsec - mono.tv_nsec) + real.tv_nsec;
+    real.tv_sec += ns / 1000000000LL;
+    real.tv_nsec = ns % 1000000000LL;
+    if (real.tv_nsec < 0) {
+        real.tv_nsec += 1000000000LL;
+        --real.tv_sec;
+    }
+    return real;
+}
+
+static int writer_timed_lock(RWLock *lock, const struct timespec *deadline) {
+    struct timespec real = realtime_deadline(deadline);
+    return pthread_mutex_timedlock(&lock->writer, &real);
+}
+#endif
+
+int rwlock_timed_rd_lock(RWLock *lock, const struct timespec *deadline) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+    return pthread_rwlock_clockrdlock(&lock->rwlock, CLOCK_MONOTONIC, deadline);
+#else
+    struct timespec real = realtime_deadline(deadline);
+    return pthread_rwlock_timedrdlock(&lock->rwlock, &real);
+#endif
+}
+
+int rwlock_timed_wr_lock(RWLock *lock, const struct timespec *deadline) {
+    int err = writer_timed_lock(lock, deadline);
+    if (err) return err;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+    err = pthread_rwlock_clockwrlock(&lock->rwlock, CLOCK_MONOTONIC, deadline);
+#else
+    struct timespec real = realtime_deadline(deadline);
+    err = pthread_rwlock_timedwrlock(&lock->rwlock, &real);
+#endif
+    if (err) pthread_mutex_unlock(&lock->writer);
+    return err;
+}
+
+int rwlock_up_lock(RWLock *lock) {
+    pthread_mutex_lock(&lock->writer);
+    return pthread_rwlock_rdlock(&lock->rwlock);
+}
+
+int rwlock_up_unlock(RWLock *lock) {
+    int err = pthread_rwlock_unlock(&lock->rwlock);
+    pthread_mutex_unlock(&lock->writer);
+    return err;
+}
+
+int rwlock_try_up_lock(RWLock *lock) {
+    int err = pthread_mutex_trylock(&lock->writer);
+    if (err) return err;
+    err = pthread_rwlock_tryrdlock(&lock->rwlock);
+    if (err) pthread_mutex_unlock(&lock->writer);
+    return err;
+}
+
+int rwlock_timed_up_lock(RWLock *lock, const struct timespec *deadline) {
+    int err = writer_timed_lock(lock, deadline);
+    if (err) return err;
+    err = rwlock_timed_rd_lock(lock, deadline);
+    if (err) pthread_mutex_unlock(&lock->writer);
+    return err;
+}
+
+int rwlock_upgrade(RWLock *lock) {
+    pthread_rwlock_unlock(&lock->rwlock);
+    return pthread_rwlock_wrlock(&lock->rwlock);
+}
+
+int rwlock_destroy(RWLock *lock) {
+    pthread_rwlock_destroy(&lock->rwlock);
+    pthread_mutex_destroy(&lock->writer);
+    return 0;
+}
+
+int rwlock_free(RWLock *lock) {
+    rwlock_destroy(lock);
+    free(lock);
+    return 0;
+}
+
+size_t rwlock_size(void) {
+    return sizeof(RWLock);
+}
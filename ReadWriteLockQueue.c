@@ -0,0 +1,322 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "ReadWriteLock.h"
+#include "SpinWait.h"
+#include "err.h"
+
+/**
+ * Phase-fair queue-based read-write lock
+ * (PF-Q, Brandenburg and Anderson).
+ *
+ * Writers wait in an MCS queue, each spinning on its own node.
+ * The writer at the head of the queue starts a writer phase:
+ * it closes the gate of its phase and sets the writer bits of `rin`,
+ * like in the ticket lock (ReadWriteLockTicket.c).
+ * Readers arriving from then on wait on that gate.
+ * Readers which arrived before are waited for on the writer's node:
+ * the last of them to leave, recognized by `rout` reaching `target`,
+ * wakes the writer up.
+ * When the writer leaves, it opens the gate (all readers of the phase
+ * go at once) and hands the lock over to the next writer in the queue.
+ *
+ * Phases alternate: a reader waits for at most one writer,
+ * a writer for at most one reader phase and the writers before it.
+ * Readers of a phase share one gate, as they are released together;
+ * every other waiter spins on a cache line nobody else spins on.
+ *
+ * The try and timed variants never queue, as in the ticket lock:
+ * a reader enters only when no writer is present, a writer only
+ * when the queue is empty and no reader is counted in.
+ * Then nobody waits for a phase the writer may have given up.
+ *
+ * An upgradable reader is a writer at the head of the queue
+ * which has not started its phase yet: readers are not held back,
+ * writers are. Upgrading starts the phase, giving the lock up
+ * passes the head of the queue on.
+ *
+ * Queue nodes are cached per thread, one per write
+ * (or upgradable read) lock held.
+ */
+
+#define READER_INC 0x100u
+#define WRITER_BITS 0x3u
+#define WRITER_PRESENT 0x2u
+#define PHASE_ID 0x1u
+
+typedef struct QNode QNode;
+
+struct QNode {
+    _Alignas(64) atomic_bool locked; // set while the owner has to wait
+    _Atomic(QNode *) next;
+    QNode *free_next;
+};
+
+struct RWLock {
+    _Alignas(64) atomic_uint rin;
+    _Alignas(64) atomic_uint rout; // WRITER_PRESENT set while a writer waits for readers
+    atomic_uint target; // `rout` value the waiting writer expects
+    _Atomic(QNode *) holder; // node of the writer in the critical section
+    _Alignas(64) atomic_bool gate[2]; // closed (true) during the writer phase of given id
+    _Alignas(64) _Atomic(QNode *) tail;
+    unsigned phase; // id of the next writer phase, owned by the head of the queue
+};
+
+static _Thread_local QNode *free_nodes;
+static pthread_key_t free_nodes_key;
+static pthread_once_t free_nodes_once = PTHREAD_ONCE_INIT;
+
+// Frees the node cache of an exiting thread.
+static void free_nodes_destroy(void *arg) {
+    QNode **list = arg;
+    while (*list) {
+        QNode *node = *list;
+        *list = node->free_next;
+        free(node);
+    }
+}
+
+static void free_nodes_init(void) {
+    if (pthread_key_create(&free_nodes_key, free_nodes_destroy) != 0)
+        syserr("pthread_key_create failed");
+}
+
+static QNode *node_get(void) {
+    QNode *node = free_nodes;
+    if (node) {
+        free_nodes = node->free_next;
+        return node;
+    }
+    pthread_once(&free_nodes_once, free_nodes_init);
+    pthread_setspecific(free_nodes_key, &free_nodes);
+    node = aligned_alloc(64, sizeof(QNode));
+    if (!node) syserr("memory alloc failed!");
+    return node;
+}
+
+static void node_put(QNode *node) {
+    node->free_next = free_nodes;
+    free_nodes = node;
+}
+
+RWLock *rwlock_new() {
+    RWLock *r = aligned_alloc(RWLOCK_ALIGN, sizeof(RWLock));
+    if (!r) syserr("memory alloc failed!");
+    return rwlock_init(r);
+}
+
+RWLock *rwlock_init(void *mem) {
+    RWLock *r = mem;
+    atomic_init(&r->rin, 0);
+    atomic_init(&r->rout, 0);
+    atomic_init(&r->target, 0);
+    atomic_init(&r->holder, NULL);
+    atomic_init(&r->gate[0], false);
+    atomic_init(&r->gate[1], false);
+    atomic_init(&r->tail, NULL);
+    r->phase = 0;
+    return r;
+}
+
+int rwlock_rd_lock(RWLock *lock) {
+    unsigned w = atomic_fetch_add_explicit(&lock->rin, READER_INC, memory_order_acquire) & WRITER_BITS;
+    if (w != 0) {
+        atomic_bool *gate = &lock->gate[w & PHASE_ID];
+        unsigned spins = 0;
+        while (atomic_load_explicit(gate, memory_order_acquire)) {
+            spin_wait(&spins);
+        }
+    }
+    return 0;
+}
+
+int rwlock_rd_unlock(RWLock *lock) {
+    unsigned out = atomic_fetch_add_explicit(&lock->rout, READER_INC, memory_order_acq_rel);
+    if ((out & WRITER_PRESENT)
+        && (out & ~WRITER_BITS) + READER_INC == atomic_load_explicit(&lock->target, memory_order_relaxed)) {
+        // Last reader the writer waits for.
+        QNode *writer = atomic_load_explicit(&lock->holder, memory_order_relaxed);
+        atomic_store_explicit(&writer->locked, false, memory_order_release);
+    }
+    return 0;
+}
+
+// Starts the writer phase of the head of the queue
+// and waits for the readers which are already in.
+static void writer_enter(RWLock *lock, QNode *node) {
+    unsigned w = WRITER_PRESENT | lock->phase;
+    lock->phase ^= PHASE_ID;
+    atomic_store_explicit(&lock->holder, node, memory_order_relaxed);
+    atomic_store_explicit(&lock->gate[w & PHASE_ID], true, memory_order_relaxed);
+    unsigned readers = atomic_fetch_add_explicit(&lock->rin, w, memory_order_acq_rel);
+    if (atomic_load_explicit(&lock->rout, memory_order_acquire) == readers) return;
+
+    atomic_store_explicit(&node->locked, true, memory_order_relaxed);
+    atomic_store_explicit(&lock->target, readers, memory_order_relaxed);
+    // Publishes `target` to the readers; from now on the last one wakes us up.
+    unsigned out = atomic_fetch_or_explicit(&lock->rout, WRITER_PRESENT, memory_order_acq_rel);
+    if (out != readers) {
+        unsigned spins = 0;
+        while (atomic_load_explicit(&node->locked, memory_order_acquire)) {
+            spin_wait(&spins);
+        }
+    }
+    atomic_fetch_and_explicit(&lock->rout, ~WRITER_PRESENT, memory_order_relaxed);
+}
+
+int rwlock_up_lock(RWLock *lock) {
+    QNode *node = node_get();
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&node->locked, true, memory_order_relaxed);
+    QNode *pred = atomic_exchange_explicit(&lock->tail, node, memory_order_acq_rel);
+    if (pred) {
+        atomic_store_explicit(&pred->next, node, memory_order_release);
+        unsigned spins = 0;
+        while (atomic_load_explicit(&node->locked, memory_order_acquire)) {
+            spin_wait(&spins);
+        }
+    }
+    // Readers look at `holder` only during a writer phase, which is not ours yet.
+    atomic_store_explicit(&lock->holder, node, memory_order_relaxed);
+    return 0;
+}
+
+int rwlock_upgrade(RWLock *lock) {
+    writer_enter(lock, atomic_load_explicit(&lock->holder, memory_order_relaxed));
+    return 0;
+}
+
+int rwlock_wr_lock(RWLock *lock) {
+    rwlock_up_lock(lock);
+    return rwlock_upgrade(lock);
+}
+
+// Passes the head of the queue to the next writer, if any.
+static void queue_leave(RWLock *lock, QNode *node) {
+    QNode *next = atomic_load_explicit(&node->next, memory_order_acquire);
+    if (!next) {
+        QNode *expected = node;
+        if (atomic_compare_exchange_strong_explicit(&lock->tail, &expected, NULL,
+                                                    memory_order_acq_rel, memory_order_relaxed)) {
+            node_put(node);
+            return;
+        }
+        // A successor is linking itself in.
+        unsigned spins = 0;
+        while (!(next = atomic_load_explicit(&node->next, memory_order_acquire))) {
+            spin_wait(&spins);
+        }
+    }
+    atomic_store_explicit(&next->locked, false, memory_order_release);
+    node_put(node);
+}
+
+int rwlock_wr_unlock(RWLock *lock) {
+    QNode *node = atomic_load_explicit(&lock->holder, memory_order_relaxed);
+    unsigned w = atomic_fetch_and_explicit(&lock->rin, ~WRITER_BITS, memory_order_release) & WRITER_BITS;
+    atomic_store_explicit(&lock->gate[w & PHASE_ID], false, memory_order_release);
+    queue_leave(lock, node);
+    return 0;
+}
+
+int rwlock_up_unlock(RWLock *lock) {
+    queue_leave(lock, atomic_load_explicit(&lock->holder, memory_order_relaxed));
+    return 0;
+}
+
+int rwlock_try_rd_lock(RWLock *lock) {
+    unsigned r = atomic_load_explicit(&lock->rin, memory_order_relaxed);
+    while ((r & WRITER_BITS) == 0) {
+        if (atomic_compare_exchange_weak_explicit(&lock->rin, &r, r + READER_INC,
+                                                  memory_order_acquire, memory_order_relaxed))
+            return 0;
+    }
+    return EBUSY;
+}
+
+int rwlock_try_wr_lock(RWLock *lock) {
+    if (atomic_load_explicit(&lock->tail, memory_order_relaxed))
+        return EBUSY;
+    QNode *node = node_get();
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    QNode *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&lock->tail, &expected, node,
+                                                 memory_order_acq_rel, memory_order_relaxed)) {
+        node_put(node);
+        return EBUSY;
+    }
+
+    // Enter only if no reader is counted in: none can wait for our phase then.
+    // Readers of the previous phase with this id are gone, so the gate
+    // can be closed (for readers which see our bits) beforehand.
+    unsigned readers = atomic_load_explicit(&lock->rout, memory_order_acquire);
+    unsigned w = WRITER_PRESENT | lock->phase;
+    atomic_store_explicit(&lock->gate[w & PHASE_ID], true, memory_order_relaxed);
+    if (atomic_compare_exchange_strong_explicit(&lock->rin, &readers, readers | w,
+                                                memory_order_acq_rel, memory_order_relaxed)) {
+        lock->phase ^= PHASE_ID;
+        atomic_store_explicit(&lock->holder, node, memory_order_relaxed);
+        return 0;
+    }
+    atomic_store_explicit(&lock->gate[w & PHASE_ID], false, memory_order_relaxed);
+    queue_leave(lock, node);
+    return EBUSY;
+}
+
+int rwlock_try_up_lock(RWLock *lock) {
+    if (atomic_load_explicit(&lock->tail, memory_order_relaxed))
+        return EBUSY;
+    QNode *node = node_get();
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    QNode *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&lock->tail, &expected, node,
+                                                 memory_order_acq_rel, memory_order_relaxed)) {
+        node_put(node);
+        return EBUSY;
+    }
+    atomic_store_explicit(&lock->holder, node, memory_order_relaxed);
+    return 0;
+}
+
+int rwlock_timed_rd_lock(RWLock *lock, const struct timespec *deadline) {
+    unsigned spins = 0;
+    while (rwlock_try_rd_lock(lock) != 0) {
+        if (deadline_passed(deadline)) return ETIMEDOUT;
+        spin_wait(&spins);
+    }
+    return 0;
+}
+
+int rwlock_timed_wr_lock(RWLock *lock, const struct timespec *deadline) {
+    unsigned spins = 0;
+    while (rwlock_try_wr_lock(lock) != 0) {
+        if (deadline_passed(deadline)) return ETIMEDOUT;
+        spin_wait(&spins);
+    }
+    return 0;
+}
+
+int rwlock_timed_up_lock(RWLock *lock, const struct timespec *deadline) {
+    unsigned spins = 0;
+    while (rwlock_try_up_lock(lock) != 0) {
+        if (deadline_passed(deadline)) return ETIMEDOUT;
+        spin_wait(&spins);
+    }
+    return 0;
+}
+
+int rwlock_destroy(RWLock *lock) {
+    (void) lock;
+    return 0;
+}
+
+int rwlock_free(RWLock *lock) {
+    free(lock);
+    return 0;
+}
+
+size_t rwlock_size(void) {
+    return sizeof(RWLock);
+}
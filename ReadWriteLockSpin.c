@@ -0,0 +1,113 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include "ReadWriteLock.h"
+#include "SpinWait.h"
+#include "err.h"
+
+/**
+ * Plain test-and-test-and-set spinlock.
+ *
+ * Readers are not distinguished from writers:
+ * both take the lock exclusively (and so do upgradable readers,
+ * which have nothing to do to upgrade then).
+ * It is the baseline the other implementations are compared with.
+ */
+struct RWLock {
+    atomic_bool locked;
+};
+
+RWLock *rwlock_new() {
+    RWLock *r = malloc(sizeof(RWLock));
+    if (!r) syserr("memory alloc failed!");
+    return rwlock_init(r);
+}
+
+RWLock *rwlock_init(void *mem) {
+    RWLock *r = mem;
+    atomic_init(&r->locked, false);
+    return r;
+}
+
+int rwlock_wr_lock(RWLock *lock) {
+    unsigned spins = 0;
+    while (atomic_exchange_explicit(&lock->locked, true, memory_order_acquire)) {
+        while (atomic_load_explicit(&lock->locked, memory_order_relaxed)) {
+            spin_wait(&spins);
+        }
+    }
+    return 0;
+}
+
+int rwlock_wr_unlock(RWLock *lock) {
+    atomic_store_explicit(&lock->locked, false, memory_order_release);
+    return 0;
+}
+
+int rwlock_rd_lock(RWLock *lock) {
+    return rwlock_wr_lock(lock);
+}
+
+int rwlock_rd_unlock(RWLock *lock) {
+    return rwlock_wr_unlock(lock);
+}
+
+int rwlock_try_wr_lock(RWLock *lock) {
+    if (atomic_load_explicit(&lock->locked, memory_order_relaxed)
+        || atomic_exchange_explicit(&lock->locked, true, memory_order_acquire))
+        return EBUSY;
+    return 0;
+}
+
+int rwlock_try_rd_lock(RWLock *lock) {
+    return rwlock_try_wr_lock(lock);
+}
+
+int rwlock_timed_wr_lock(RWLock *lock, const struct timespec *deadline) {
+    unsigned spins = 0;
+    while (rwlock_try_wr_lock(lock) != 0) {
+        if (deadline_passed(deadline)) return ETIMEDOUT;
+        spin_wait(&spins);
+    }
+    return 0;
+}
+
+int rwlock_timed_rd_lock(RWLock *lock, const struct timespec *deadline) {
+    return rwlock_timed_wr_lock(lock, deadline);
+}
+
+int rwlock_up_lock(RWLock *lock) {
+    return rwlock_wr_lock(lock);
+}
+
+int rwlock_up_unlock(RWLock *lock) {
+    return rwlock_wr_unlock(lock);
+}
+
+int rwlock_try_up_lock(RWLock *lock) {
+    return rwlock_try_wr_lock(lock);
+}
+
+int rwlock_timed_up_lock(RWLock *lock, const struct timespec *deadline) {
+    return rwlock_timed_wr_lock(lock, deadline);
+}
+
+int rwlock_upgrade(RWLock *lock) {
+    (void) lock;
+    return 0;
+}
+
+int rwlock_destroy(RWLock *lock) {
+    (void) lock;
+    return 0;
+}
+
+int rwlock_free(RWLock *lock) {
+    free(lock);
+    return 0;
+}
+
+size_t rwlock_size(void) {
+    return sizeof(RWLock);
+}
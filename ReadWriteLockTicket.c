@@ -0,0 +1,204 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "ReadWriteLock.h"
+#include "SpinWait.h"
+#include "err.h"
+
+/**
+ * Phase-fair ticket read-write lock
+ * (PF-T, Brandenburg and Anderson).
+ *
+ * Writers are served in FIFO order of their tickets
+ * (`win` / `wout`). Readers count themselves in `rin`
+ * and out in `rout`, in units of READER_INC.
+ * The two low bits of `rin` tell readers whether a writer
+ * is present (WRITER_PRESENT) and in which phase (PHASE_ID).
+ *
+ * A reader arriving while a writer is present waits only
+ * until the phase bits change, that is, until that writer leaves.
+ * A writer waits only for readers which arrived before it.
+ * Thus reader and writer phases alternate, and a reader
+ * waits for at most one writer phase.
+ *
+ * Once counted in `rin` a reader cannot withdraw, and a writer
+ * which has set its phase bits cannot step back either: readers
+ * blocked by the previous writer might miss its phase altogether.
+ * So the try and timed variants never queue: a reader enters
+ * with a compare-and-swap only when no writer is present, a writer
+ * only when the lock is completely free. The timed ones retry
+ * that until the deadline. They are not phase-fair.
+ *
+ * An upgradable reader is a writer which has been served its ticket
+ * but has not set its phase bits yet: readers are not held back,
+ * writers are. Upgrading is the rest of rwlock_wr_lock(),
+ * giving the lock up is passing the ticket on.
+ * Such a ticket has no phase, so phase ids are not taken from
+ * ticket parity but from `phase`, flipped by each writer phase:
+ * readers still blocked by the previous phase must see a new id.
+ */
+
+#define READER_INC 0x100u
+#define WRITER_BITS 0x3u
+#define WRITER_PRESENT 0x2u
+#define PHASE_ID 0x1u
+
+struct RWLock {
+    _Alignas(64) atomic_uint rin;
+    _Alignas(64) atomic_uint rout;
+    _Alignas(64) atomic_uint win;
+    _Alignas(64) atomic_uint wout;
+    unsigned phase; // id of the next writer phase, owned by the ticket being served
+};
+
+RWLock *rwlock_new() {
+    RWLock *r = aligned_alloc(RWLOCK_ALIGN, sizeof(RWLock));
+    if (!r) syserr("memory alloc failed!");
+    return rwlock_init(r);
+}
+
+RWLock *rwlock_init(void *mem) {
+    RWLock *r = mem;
+    atomic_init(&r->rin, 0);
+    atomic_init(&r->rout, 0);
+    atomic_init(&r->win, 0);
+    atomic_init(&r->wout, 0);
+    r->phase = 0;
+    return r;
+}
+
+int rwlock_rd_lock(RWLock *lock) {
+    unsigned w = atomic_fetch_add_explicit(&lock->rin, READER_INC, memory_order_acquire) & WRITER_BITS;
+    unsigned spins = 0;
+    while (w != 0 && w == (atomic_load_explicit(&lock->rin, memory_order_acquire) & WRITER_BITS)) {
+        spin_wait(&spins);
+    }
+    return 0;
+}
+
+int rwlock_rd_unlock(RWLock *lock) {
+    atomic_fetch_add_explicit(&lock->rout, READER_INC, memory_order_release);
+    return 0;
+}
+
+int rwlock_up_lock(RWLock *lock) {
+    unsigned ticket = atomic_fetch_add_explicit(&lock->win, 1, memory_order_relaxed);
+    unsigned spins = 0;
+    while (atomic_load_explicit(&lock->wout, memory_order_acquire) != ticket) {
+        spin_wait(&spins);
+    }
+    return 0;
+}
+
+int rwlock_upgrade(RWLock *lock) {
+    unsigned w = WRITER_PRESENT | lock->phase;
+    lock->phase ^= PHASE_ID;
+    unsigned readers = atomic_fetch_add_explicit(&lock->rin, w, memory_order_acquire);
+    unsigned spins = 0;
+    while (atomic_load_explicit(&lock->rout, memory_order_acquire) != readers) {
+        spin_wait(&spins);
+    }
+    return 0;
+}
+
+int rwlock_up_unlock(RWLock *lock) {
+    atomic_fetch_add_explicit(&lock->wout, 1, memory_order_release);
+    return 0;
+}
+
+int rwlock_wr_lock(RWLock *lock) {
+    rwlock_up_lock(lock);
+    return rwlock_upgrade(lock);
+}
+
+int rwlock_wr_unlock(RWLock *lock) {
+    atomic_fetch_and_explicit(&lock->rin, ~WRITER_BITS, memory_order_release);
+    atomic_fetch_add_explicit(&lock->wout, 1, memory_order_release);
+    return 0;
+}
+
+int rwlock_try_rd_lock(RWLock *lock) {
+    unsigned r = atomic_load_explicit(&lock->rin, memory_order_relaxed);
+    while ((r & WRITER_BITS) == 0) {
+        if (atomic_compare_exchange_weak_explicit(&lock->rin, &r, r + READER_INC,
+                                                  memory_order_acquire, memory_order_relaxed))
+            return 0;
+    }
+    return EBUSY;
+}
+
+int rwlock_try_wr_lock(RWLock *lock) {
+    // Acquire pairs with the release in rwlock_wr_unlock(), so that
+    // readers which arrived during the previous writer's phase are seen below,
+    // and with the one in rwlock_rd_unlock(), as for a waiting writer.
+    unsigned ticket = atomic_load_explicit(&lock->wout, memory_order_acquire);
+    unsigned readers = atomic_load_explicit(&lock->rout, memory_order_acquire);
+    if (atomic_load_explicit(&lock->rin, memory_order_relaxed) != readers)
+        return EBUSY;
+    // Take a ticket only if it is served right away.
+    if (!atomic_compare_exchange_strong_explicit(&lock->win, &ticket, ticket + 1,
+                                                 memory_order_acquire, memory_order_relaxed))
+        return EBUSY;
+
+    // Enter only if no reader arrived in the meantime.
+    unsigned w = WRITER_PRESENT | lock->phase;
+    if (atomic_compare_exchange_strong_explicit(&lock->rin, &readers, readers | w,
+                                                memory_order_acquire, memory_order_relaxed)) {
+        lock->phase ^= PHASE_ID;
+        return 0;
+    }
+    // Nobody can be blocked by our phase bits yet, so skipping the ticket
+    // does not break the alternation of phases.
+    atomic_fetch_add_explicit(&lock->wout, 1, memory_order_release);
+    return EBUSY;
+}
+
+int rwlock_try_up_lock(RWLock *lock) {
+    // Take a ticket only if it is served right away.
+    unsigned ticket = atomic_load_explicit(&lock->wout, memory_order_acquire);
+    if (!atomic_compare_exchange_strong_explicit(&lock->win, &ticket, ticket + 1,
+                                                 memory_order_acquire, memory_order_relaxed))
+        return EBUSY;
+    return 0;
+}
+
+int rwlock_timed_rd_lock(RWLock *lock, const struct timespec *deadline) {
+    unsigned spins = 0;
+    while (rwlock_try_rd_lock(lock) != 0) {
+        if (deadline_passed(deadline)) return ETIMEDOUT;
+        spin_wait(&spins);
+    }
+    return 0;
+}
+
+int rwlock_timed_wr_lock(RWLock *lock, const struct timespec *deadline) {
+    unsigned spins = 0;
+    while (rwlock_try_wr_lock(lock) != 0) {
+        if (deadline_passed(deadline)) return ETIMEDOUT;
+        spin_wait(&spins);
+    }
+    return 0;
+}
+
+int rwlock_timed_up_lock(RWLock *lock, const struct timespec *deadline) {
+    unsigned spins = 0;
+    while (rwlock_try_up_lock(lock) != 0) {
+        if (deadline_passed(deadline)) return ETIMEDOUT;
+        spin_wait(&spins);
+    }
+    return 0;
+}
+
+int rwlock_destroy(RWLock *lock) {
+    (void) lock;
+    return 0;
+}
+
+int rwlock_free(RWLock *lock) {
+    free(lock);
+    return 0;
+}
+
+size_t rwlock_size(void) {
+    return sizeof(RWLock);
+}
@@ -0,0 +1,916 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "SharedTree.h"
+#include "SpinWait.h"
+#include "path_utils.h"
+#include "err.h"
+
+/*
+ * Layout:
+ * The region starts with a Header, followed by blocks of a simple allocator
+ * (power-of-two size classes, each with a free list, and a bump pointer).
+ * Everything refers to blocks by Offset from the start of the region.
+ * A Node holds its lock and the offset of its child index, an open-addressing
+ * hash table of (name, child) entries, whose capacity is stored with it,
+ * so that a grown table replaces the old one with a single store.
+ *
+ * Locking:
+ * Traversals lock nodes hand over hand, exactly like Tree.c,
+ * with a read-write lock in each Node: `readers` has one bit per slot
+ * (i.e. handle) read-locking the node, and `writer` names the slot
+ * write-locking it. A reader sets its bit and backs off if there is a writer;
+ * a writer claims `writer` and waits for the bits to clear.
+ * Since every holder is known by its slot, the locks of a dead process
+ * can be released without knowing how far it got.
+ *
+ * Recovery:
+ * Before locking a node, a handle records it in its Slot (`held`),
+ * and forgets it only after unlocking it, so `held` always covers the locks
+ * it holds. Changes of the tree are described in the Slot (`intent`)
+ * once all nodes they touch are write-locked, applied in an order
+ * where each prefix of stores is either harmless or visible to the
+ * idempotent intent_apply, and only then is the intent cleared and garbage freed.
+ * Each Slot has a robust process-shared mutex, `owner`, locked by the thread
+ * owning the handle for as long as it is open, so that trying to lock it
+ * tells for sure whether that thread is gone (EOWNERDEAD), unlike a pid,
+ * which may be recycled, even by the checking process itself.
+ * A handle waiting for a lock, or opening, checks for slots of dead owners:
+ * it applies their intent again, then releases their locks, latest first
+ * (an earlier one may be what keeps the node of a later one alive),
+ * and frees the slot. Only what a dead process allocated but did not link yet,
+ * or unlinked but did not free yet, leaks.
+ * The allocator and the slot table are guarded by robust process-shared mutexes;
+ * their critical sections change state with a single store each,
+ * so they are consistent when a holder dies.
+ */
+
+#define REGION_MAGIC 0x5348415245445452ull // "SHAREDTR"
+#define MAX_HANDLES 64
+#define MAX_HELD 8 // Locks held at once by one handle: at most 5, in shared_tree_move.
+#define N_SIZE_CLASSES 48
+#define MIN_BLOCK_CLASS 4 // 16 bytes.
+#define MIN_INDEX_CAPACITY 8
+#define TOMBSTONE 1 // Name of an entry removed from an index; 0 marks an empty one.
+#define HELD_WRITE 1 // Low bit of a `held` node offset, set for a write lock.
+#define REAP_EVERY 1024 // Rounds of waiting for a lock between checks for dead holders.
+#define ATTACH_TIMEOUT_MS 1000 // Wait for the creator to initialize the region.
+
+// Orders the stores of a multi-store update as written, so that a process
+// dying at any point leaves a prefix of them. Other processes only read them
+// after its death, so it only has to restrain the compiler.
+#define PUBLISH() atomic_signal_fence(memory_order_seq_cst)
+
+typedef uint64_t Offset; // From the start of the region, 0 for none.
+
+typedef struct Entry Entry;
+
+struct Entry {
+    Offset name; // NUL-terminated, 0 for an empty entry, TOMBSTONE for a removed one.
+    Offset child;
+    uint64_t hash;
+};
+
+typedef struct Index Index;
+
+struct Index {
+    uint64_t capacity; // Power of two.
+    Entry entries[];
+};
+
+typedef struct Node Node;
+
+struct Node {
+    _Atomic uint64_t readers; // Bit i set while slot i read-locks the node.
+    _Atomic uint32_t writer; // 1 + slot write-locking the node, 0 if none.
+    uint32_t size; // Live entries of `index`.
+    uint64_t used; // Live and removed entries of `index`.
+    Offset index; // 0 for a node which never had children.
+};
+
+typedef enum IntentType {
+    INTENT_NONE,
+    INTENT_CREATE, // Link `child` as `target_name` in `target_parent`.
+    INTENT_REMOVE, // Unlink `child`, `source_name` in `source_parent`.
+    INTENT_MOVE, // Both, for the same `child`.
+} IntentType;
+
+typedef struct Intent Intent;
+
+struct Intent {
+    uint32_t type;
+    Offset source_parent, source_name;
+    Offset target_parent, target_name;
+    Offset child;
+};
+
+typedef struct Held Held;
+
+struct Held {
+    Offset node; // With HELD_WRITE for a write lock, 0 for a free record.
+    uint64_t order;
+};
+
+// `held` and `intent` are only accessed by the handle owning the slot,
+// or by the one recovering it after the owner's death.
+typedef struct Slot Slot;
+
+struct Slot {
+    bool taken; // Guarded by `slots_mutex`.
+    pthread_mutex_t owner; // Locked by the thread owning the slot, while it is taken.
+    uint64_t next_order;
+    Held held[MAX_HELD];
+    Intent intent;
+};
+
+typedef struct Header Header;
+
+struct Header {
+    _Atomic uint64_t magic; // REGION_MAGIC once initialized.
+    uint64_t size;
+    pthread_mutex_t alloc_mutex;
+    pthread_mutex_t slots_mutex;
+    Offset brk;
+    Offset free_blocks[N_SIZE_CLASSES];
+    Offset root;
+    Slot slots[MAX_HANDLES];
+};
+
+#define MIN_REGION_SIZE (sizeof(Header) + 4096)
+
+struct SharedTree {
+    Header *header;
+    size_t slot;
+};
+
+#define AT(tree, offset) ((void *) ((char *) (tree)->header + (offset)))
+
+static Slot *own_slot(SharedTree *t) {
+    return &t->header->slots[t->slot];
+}
+
+static void mutex_lock(pthread_mutex_t *mutex) {
+    int err = pthread_mutex_lock(mutex);
+    // The owner died in a critical section, which is fine, see above.
+    if (err == EOWNERDEAD) err = pthread_mutex_consistent(mutex);
+    if (err) fatal("pthread_mutex_lock failed: %d", err);
+}
+
+static void mutex_init(pthread_mutex_t *mutex) {
+    pthread_mutexattr_t attr;
+    if (pthread_mutexattr_init(&attr) != 0
+        || pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0
+        || pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0
+        || pthread_mutex_init(mutex, &attr) != 0)
+        fatal("cannot initialize a process-shared mutex");
+    pthread_mutexattr_destroy(&attr);
+}
+
+// --------------------------- Allocator ---------------------------
+
+static unsigned size_class(size_t size) {
+    unsigned c = MIN_BLOCK_CLASS;
+    while (((size_t) 1 << c) < size) ++c;
+    return c;
+}
+
+// Returns a block of at least `size` bytes, or 0 if the region is full.
+static Offset block_alloc(SharedTree *t, size_t size) {
+    Header *h = t->header;
+    unsigned c = size_class(size);
+    if (c >= N_SIZE_CLASSES) return 0;
+    Offset block = 0;
+    mutex_lock(&h->alloc_mutex);
+    if (h->free_blocks[c]) {
+        block = h->free_blocks[c];
+        h->free_blocks[c] = *(Offset *) AT(t, block);
+    } else if (h->brk + ((size_t) 1 << c) <= h->size) {
+        block = h->brk;
+        h->brk += (size_t) 1 << c;
+    }
+    pthread_mutex_unlock(&h->alloc_mutex);
+    return block;
+}
+
+static void block_free(SharedTree *t, Offset block, size_t size) {
+    Header *h = t->header;
+    unsigned c = size_class(size);
+    mutex_lock(&h->alloc_mutex);
+    *(Offset *) AT(t, block) = h->free_blocks[c];
+    PUBLISH();
+    h->free_blocks[c] = block;
+    pthread_mutex_unlock(&h->alloc_mutex);
+}
+
+static Offset name_new(SharedTree *t, const char *name) {
+    size_t len = strlen(name) + 1;
+    Offset offset = block_alloc(t, len);
+    if (offset) memcpy(AT(t, offset), name, len);
+    return offset;
+}
+
+static void name_free(SharedTree *t, Offset name) {
+    block_free(t, name, strlen(AT(t, name)) + 1);
+}
+
+static Offset node_new(SharedTree *t) {
+    Offset offset = block_alloc(t, sizeof(Node));
+    if (offset) memset(AT(t, offset), 0, sizeof(Node));
+    return offset;
+}
+
+static size_t index_bytes(size_t capacity) {
+    return sizeof(Index) + capacity * sizeof(Entry);
+}
+
+// Frees a node without children, with its index.
+static void node_free(SharedTree *t, Offset offset) {
+    Node *node = AT(t, offset);
+    if (node->index) {
+        Index *index = AT(t, node->index);
+        block_free(t, node->index, index_bytes(index->capacity));
+    }
+    block_free(t, offset, sizeof(Node));
+}
+
+// --------------------------- Child index ---------------------------
+
+static uint64_t name_hash(const char *name) {
+    uint64_t hash = 14695981039346656037ull; // FNV-1a.
+    for (const char *p = name; *p; ++p) {
+        hash ^= (unsigned char) *p;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool entry_live(const Entry *e) {
+    return e->name > TOMBSTONE;
+}
+
+// Returns the entry of child `name` of `node`, or NULL.
+static Entry *index_find(SharedTree *t, Node *node, const char *name, uint64_t hash) {
+    if (!node->index) return NULL;
+    Index *index = AT(t, node->index);
+    size_t mask = index->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        Entry *e = &index->entries[i];
+        if (e->name == 0) return NULL;
+        if (entry_live(e) && e->hash == hash && strcmp(AT(t, e->name), name) == 0) return e;
+    }
+}
+
+// Stores an entry without checking for a duplicate. The index must have room.
+static void index_put(Index *index, Offset name, uint64_t hash, Offset child) {
+    size_t mask = index->capacity - 1;
+    size_t i = hash & mask;
+    while (entry_live(&index->entries[i])) i = (i + 1) & mask;
+    Entry *e = &index->entries[i];
+    e->hash = hash;
+    e->child = child;
+    PUBLISH();
+    e->name = name;
+}
+
+// Makes room for one more entry of `node`, by building a bigger
+// (or just cleaned of removed entries) index if needed.
+// Returns 0, or ENOSPC if the region is full.
+static int index_reserve(SharedTree *t, Node *node) {
+    Index *old = node->index ? AT(t, node->index) : NULL;
+    // Keep at least a quarter of entries empty, to end probing.
+    if (old && (node->used + 1) * 4 <= old->capacity * 3) return 0;
+
+    size_t capacity = MIN_INDEX_CAPACITY;
+    while ((node->size + 1) * 2 > capacity) capacity *= 2;
+    Offset offset = block_alloc(t, index_bytes(capacity));
+    if (!offset) return ENOSPC;
+    Index *index = AT(t, offset);
+    memset(index, 0, index_bytes(capacity));
+    index->capacity = capacity;
+    if (old) {
+        for (size_t i = 0; i < old->capacity; ++i) {
+            Entry *e = &old->entries[i];
+            if (entry_live(e)) index_put(index, e->name, e->hash, e->child);
+        }
+    }
+
+    Offset old_offset = node->index;
+    PUBLISH();
+    node->index = offset;
+    PUBLISH();
+    node->used = node->size;
+    if (old) block_free(t, old_offset, index_bytes(old->capacity));
+    return 0;
+}
+
+static void index_insert(SharedTree *t, Node *node, Offset name, uint64_t hash, Offset child) {
+    index_put(AT(t, node->index), name, hash, child);
+    PUBLISH();
+    node->size++;
+    node->used++;
+}
+
+static void index_erase(Node *node, Entry *e) {
+    e->name = TOMBSTONE;
+    PUBLISH();
+    node->size--;
+}
+
+// Recomputes counters of an index, which may lag behind its entries
+// after the death of a writer.
+static void index_recount(SharedTree *t, Node *node) {
+    node->size = 0;
+    node->used = 0;
+    if (!node->index) return;
+    Index *index = AT(t, node->index);
+    for (size_t i = 0; i < index->capacity; ++i) {
+        if (entry_live(&index->entries[i])) node->size++;
+        if (index->entries[i].name) node->used++;
+    }
+}
+
+// --------------------------- Locks ---------------------------
+
+static void held_add(Slot *s, Offset node, bool write) {
+    for (size_t i = 0; i < MAX_HELD; ++i) {
+        if (s->held[i].node == 0) {
+            s->held[i].order = s->next_order++;
+            PUBLISH();
+            s->held[i].node = node | (write ? HELD_WRITE : 0);
+            PUBLISH();
+            return;
+        }
+    }
+    fatal("too many shared tree locks held");
+}
+
+static void held_remove(Slot *s, Offset node, bool write) {
+    PUBLISH();
+    for (size_t i = 0; i < MAX_HELD; ++i) {
+        if (s->held[i].node == (node | (write ? HELD_WRITE : 0))) {
+            s->held[i].node = 0;
+            return;
+        }
+    }
+    assert(false);
+}
+
+static void release_rd(SharedTree *t, Offset node, size_t slot) {
+    atomic_fetch_and(&((Node *) AT(t, node))->readers, ~((uint64_t) 1 << slot));
+}
+
+static void release_wr(SharedTree *t, Offset node, size_t slot) {
+    uint32_t writer = slot + 1;
+    atomic_compare_exchange_strong(&((Node *) AT(t, node))->writer, &writer, 0);
+}
+
+static void reap_dead(SharedTree *t);
+
+// One round of waiting for a lock, checking for dead holders once in a while.
+static void lock_wait(SharedTree *t, unsigned *spins) {
+    spin_wait(spins);
+    if (*spins % REAP_EVERY == 0) reap_dead(t);
+}
+
+static void lock_rd(SharedTree *t, Offset offset) {
+    Node *node = AT(t, offset);
+    uint64_t bit = (uint64_t) 1 << t->slot;
+    unsigned spins = 0;
+    held_add(own_slot(t), offset, false);
+    for (;;) {
+        atomic_fetch_or(&node->readers, bit);
+        if (atomic_load(&node->writer) == 0) return;
+        atomic_fetch_and(&node->readers, ~bit);
+        while (atomic_load(&node->writer) != 0) lock_wait(t, &spins);
+    }
+}
+
+static void unlock_rd(SharedTree *t, Offset offset) {
+    release_rd(t, offset, t->slot);
+    held_remove(own_slot(t), offset, false);
+}
+
+static void lock_wr(SharedTree *t, Offset offset) {
+    Node *node = AT(t, offset);
+    uint32_t expected = 0;
+    unsigned spins = 0;
+    held_add(own_slot(t), offset, true);
+    while (!atomic_compare_exchange_weak(&node->writer, &expected, t->slot + 1)) {
+        expected = 0;
+        lock_wait(t, &spins);
+    }
+    while (atomic_load(&node->readers) != 0) lock_wait(t, &spins);
+}
+
+static void unlock_wr(SharedTree *t, Offset offset) {
+    release_wr(t, offset, t->slot);
+    held_remove(own_slot(t), offset, true);
+}
+
+static void node_lock(SharedTree *t, Offset offset, bool write) {
+    if (write) lock_wr(t, offset);
+    else lock_rd(t, offset);
+}
+
+// --------------------------- Intents ---------------------------
+
+// Applies the change described by `in`, whose nodes are write-locked
+// by the slot, as far as it has not been applied yet.
+// Returns 0, or ENOSPC if the target index could not grow; nothing is changed then.
+static int intent_apply(SharedTree *t, const Intent *in) {
+    if (in->type == INTENT_CREATE || in->type == INTENT_MOVE) {
+        Node *target = AT(t, in->target_parent);
+        const char *name = AT(t, in->target_name);
+        uint64_t hash = name_hash(name);
+        if (!index_find(t, target, name, hash)) {
+            if (index_reserve(t, target) != 0) return ENOSPC;
+            index_insert(t, target, in->target_name, hash, in->child);
+        }
+    }
+    if (in->type == INTENT_REMOVE || in->type == INTENT_MOVE) {
+        Node *source = AT(t, in->source_parent);
+        const char *name = AT(t, in->source_name);
+        Entry *e = index_find(t, source, name, name_hash(name));
+        if (e && e->child == in->child) index_erase(source, e);
+    }
+    return 0;
+}
+
+// Clears the intent of `s`, which has been applied (or failed with `err`),
+// and frees what it left unreachable.
+static void intent_finish(SharedTree *t, Slot *s, int err) {
+    Intent in = s->intent;
+    PUBLISH();
+    s->intent.type = INTENT_NONE;
+    PUBLISH();
+    switch (in.type) {
+        case INTENT_CREATE:
+            if (err) {
+                node_free(t, in.child);
+                name_free(t, in.target_name);
+            }
+            break;
+        case INTENT_REMOVE:
+            // The removed node was write-locked by the slot.
+            held_remove(s, in.child, true);
+            node_free(t, in.child);
+            name_free(t, in.source_name);
+            break;
+        case INTENT_MOVE:
+            name_free(t, err ? in.target_name : in.source_name);
+            break;
+    }
+}
+
+static int intent_run(SharedTree *t, const Intent *in) {
+    Slot *s = own_slot(t);
+    Intent pending = *in;
+    pending.type = INTENT_NONE;
+    s->intent = pending;
+    PUBLISH();
+    s->intent.type = in->type;
+    PUBLISH();
+    int err = intent_apply(t, in);
+    intent_finish(t, s, err);
+    return err;
+}
+
+// --------------------------- Slots ---------------------------
+
+// Finishes what the dead owner of slot `i` was doing and releases its locks.
+static void slot_recover(SharedTree *t, size_t i) {
+    Slot *s = &t->header->slots[i];
+    if (s->intent.type != INTENT_NONE) {
+        Intent *in = &s->intent;
+        if (in->target_parent) index_recount(t, AT(t, in->target_parent));
+        if (in->source_parent) index_recount(t, AT(t, in->source_parent));
+        intent_finish(t, s, intent_apply(t, in));
+    }
+    for (;;) {
+        Held *latest = NULL;
+        for (size_t j = 0; j < MAX_HELD; ++j) {
+            if (s->held[j].node && (!latest || s->held[j].order > latest->order))
+                latest = &s->held[j];
+        }
+        if (!latest) break;
+        Offset node = latest->node & ~(Offset) HELD_WRITE;
+        if (latest->node & HELD_WRITE) release_wr(t, node, i);
+        else release_rd(t, node, i);
+        PUBLISH();
+        latest->node = 0;
+    }
+    s->next_order = 0;
+}
+
+// Recovers slots of dead owners. Needs `slots_mutex`.
+static void reap_dead_locked(SharedTree *t) {
+    for (size_t i = 0; i < MAX_HANDLES; ++i) {
+        Slot *s = &t->header->slots[i];
+        if (!s->taken) continue;
+        int err = pthread_mutex_trylock(&s->owner);
+        // Held by its owner (EDEADLK: that is us, through another handle).
+        if (err == EBUSY || err == EDEADLK) continue;
+        // Otherwise the owner is gone: EOWNERDEAD, or 0 if it was never locked.
+        if (err == EOWNERDEAD) err = pthread_mutex_consistent(&s->owner);
+        if (err) fatal("pthread_mutex_trylock failed: %d", err);
+        slot_recover(t, i);
+        pthread_mutex_unlock(&s->owner);
+        s->taken = false;
+    }
+}
+
+static void reap_dead(SharedTree *t) {
+    mutex_lock(&t->header->slots_mutex);
+    reap_dead_locked(t);
+    pthread_mutex_unlock(&t->header->slots_mutex);
+}
+
+static int slot_claim(SharedTree *t) {
+    Header *h = t->header;
+    int err = EAGAIN;
+    mutex_lock(&h->slots_mutex);
+    reap_dead_locked(t);
+    for (size_t i = 0; i < MAX_HANDLES; ++i) {
+        Slot *s = &h->slots[i];
+        if (!s->taken) {
+            memset(s->held, 0, sizeof(s->held));
+            s->next_order = 0;
+            s->intent.type = INTENT_NONE;
+            mutex_lock(&s->owner);
+            s->taken = true;
+            t->slot = i;
+            err = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&h->slots_mutex);
+    return err;
+}
+
+// --------------------------- Region ---------------------------
+
+static void sleep_ms(long ms) {
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+// Waits for the creator of the object to set its size.
+static int region_wait_size(int fd, size_t *size) {
+    for (int ms = 0; ms < ATTACH_TIMEOUT_MS; ++ms) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) return errno;
+        if (st.st_size >= (off_t) MIN_REGION_SIZE) {
+            *size = st.st_size;
+            return 0;
+        }
+        sleep_ms(1);
+    }
+    return ETIMEDOUT;
+}
+
+static int region_wait_ready(SharedTree *t) {
+    for (int ms = 0; ms < ATTACH_TIMEOUT_MS; ++ms) {
+        if (atomic_load_explicit(&t->header->magic, memory_order_acquire) == REGION_MAGIC)
+            return 0;
+        sleep_ms(1);
+    }
+    return ETIMEDOUT;
+}
+
+static void region_init(SharedTree *t, size_t size) {
+    Header *h = t->header; // Zeroed by ftruncate.
+    mutex_init(&h->alloc_mutex);
+    mutex_init(&h->slots_mutex);
+    for (size_t i = 0; i < MAX_HANDLES; ++i) mutex_init(&h->slots[i].owner);
+    h->size = size;
+    h->brk = (sizeof(Header) + 15) & ~(size_t) 15;
+    h->root = node_new(t);
+    atomic_store_explicit(&h->magic, REGION_MAGIC, memory_order_release);
+}
+
+SharedTree *shared_tree_open(const char *name, size_t size) {
+    assert(name);
+    bool created = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = false;
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    if (fd < 0) return NULL;
+
+    int err = 0;
+    if (!created) err = region_wait_size(fd, &size);
+    else if (size < MIN_REGION_SIZE) err = EINVAL;
+    else if (ftruncate(fd, size) != 0) err = errno;
+    void *base = MAP_FAILED;
+    if (!err) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) err = errno;
+    }
+    close(fd);
+
+    SharedTree *t = NULL;
+    if (!err) {
+        t = malloc(sizeof(SharedTree));
+        if (!t) syserr("memory alloc failed!");
+        t->header = base;
+        if (created) region_init(t, size);
+        else err = region_wait_ready(t);
+        if (!err) err = slot_claim(t);
+    }
+    if (err) {
+        if (base != MAP_FAILED) munmap(base, size);
+        if (created) shm_unlink(name);
+        free(t);
+        errno = err;
+        return NULL;
+    }
+    return t;
+}
+
+void shared_tree_close(SharedTree *t) {
+    assert(t);
+    Slot *s = own_slot(t);
+    mutex_lock(&t->header->slots_mutex);
+    pthread_mutex_unlock(&s->owner);
+    s->taken = false;
+    pthread_mutex_unlock(&t->header->slots_mutex);
+    munmap(t->header, t->header->size);
+    free(t);
+}
+
+int shared_tree_unlink(const char *name) {
+    return shm_unlink(name) == 0 ? 0 : errno;
+}
+
+// --------------------------- Operations ---------------------------
+
+// Finds node at `path` and locks it (for writing if `write`).
+// Each ancestor is read-locked until its child is locked.
+// Tree traversal lock type: READ.
+static int find_lock(SharedTree *t, const char *path, bool write, Offset *out) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    Offset node = t->header->root;
+    const char *subpath = split_path(path, name);
+    node_lock(t, node, write && !subpath);
+    while (subpath) {
+        Entry *e = index_find(t, AT(t, node), name, name_hash(name));
+        if (!e) {
+            unlock_rd(t, node);
+            return ENOENT;
+        }
+        Offset child = e->child;
+        subpath = split_path(subpath, name);
+        node_lock(t, child, write && !subpath);
+        unlock_rd(t, node);
+        node = child;
+    }
+    *out = node;
+    return 0;
+}
+
+// Finds node at `path` relative to write-locked `root` and write-locks it.
+// Tree traversal lock type: WRITE.
+static int find_wrlock_below(SharedTree *t, Offset root, const char *path, bool unlock_root,
+                             Offset *out) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    const char *subpath = path;
+    Offset node = root;
+    while ((subpath = split_path(subpath, name))) {
+        Entry *e = index_find(t, AT(t, node), name, name_hash(name));
+        if (!e) {
+            if (unlock_root || node != root) unlock_wr(t, node);
+            return ENOENT;
+        }
+        Offset child = e->child;
+        lock_wr(t, child);
+        if (unlock_root || node != root) unlock_wr(t, node);
+        node = child;
+    }
+    *out = node;
+    return 0;
+}
+
+// Write-locks the common ancestor of `path1` and `path2`,
+// then both of them, as dir_find_wr_lock2 in Tree.c.
+static int find_wrlock2(SharedTree *t, char *path1, char *path2, Offset *out1, Offset *out2) {
+    char *common_path = make_common_path(path1, path2);
+    Offset common;
+    int err = find_lock(t, common_path, true, &common);
+    free(common_path);
+    if (err) return err;
+
+    if (strcmp(path1, path2) == 0) {
+        *out1 = common;
+        *out2 = common;
+        return 0;
+    }
+
+    char *subpath1 = path1;
+    char *subpath2 = path2;
+    split_common_path(&subpath1, &subpath2);
+
+    if (is_subpath(path1, path2)) {
+        *out2 = common;
+        err = find_wrlock_below(t, common, subpath1, false, out1);
+        if (err) unlock_wr(t, common);
+    } else if (is_subpath(path2, path1)) {
+        *out1 = common;
+        err = find_wrlock_below(t, common, subpath2, false, out2);
+        if (err) unlock_wr(t, common);
+    } else {
+        err = find_wrlock_below(t, common, subpath2, false, out2);
+        if (err) {
+            unlock_wr(t, common);
+            return err;
+        }
+        err = find_wrlock_below(t, common, subpath1, true, out1);
+        if (err) unlock_wr(t, *out2);
+    }
+    return err;
+}
+
+static int compare_names(const void *p1, const void *p2) {
+    return strcmp(*(const char **) p1, *(const char **) p2);
+}
+
+char *shared_tree_list(SharedTree *t, const char *path) {
+    assert(t);
+    if (!is_path_valid(path)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    Offset offset;
+    int err = find_lock(t, path, false, &offset);
+    if (err) {
+        errno = err;
+        return NULL;
+    }
+
+    Node *node = AT(t, offset);
+    const char **names = malloc((node->size + 1) * sizeof(char *));
+    if (!names) syserr("memory alloc failed!");
+    size_t n_names = 0;
+    size_t len = 0;
+    if (node->index) {
+        Index *index = AT(t, node->index);
+        for (size_t i = 0; i < index->capacity; ++i) {
+            if (entry_live(&index->entries[i])) {
+                names[n_names] = AT(t, index->entries[i].name);
+                len += strlen(names[n_names++]) + 1;
+            }
+        }
+    }
+    qsort(names, n_names, sizeof(char *), compare_names);
+
+    char *result = malloc(len + 1);
+    if (!result) syserr("memory alloc failed!");
+    char *position = result;
+    for (size_t i = 0; i < n_names; ++i) {
+        if (i > 0) *position++ = ',';
+        size_t name_len = strlen(names[i]);
+        memcpy(position, names[i], name_len);
+        position += name_len;
+    }
+    *position = '\0';
+    unlock_rd(t, offset);
+    free(names);
+    return result;
+}
+
+int shared_tree_visit(SharedTree *t, const char *path, shared_tree_visit_fn callback, void *arg) {
+    assert(t);
+    if (!is_path_valid(path)) return EINVAL;
+    Offset offset;
+    int err = find_lock(t, path, false, &offset);
+    if (err) return err;
+
+    Node *node = AT(t, offset);
+    if (callback && node->index) {
+        Index *index = AT(t, node->index);
+        for (size_t i = 0; i < index->capacity && !err; ++i) {
+            if (entry_live(&index->entries[i]))
+                err = callback(AT(t, index->entries[i].name), arg);
+        }
+    }
+    unlock_rd(t, offset);
+    return err;
+}
+
+// Finds the parent of the new directory and write-locks it,
+// then links a new node into it.
+// Tree traversal lock type: READ.
+int shared_tree_create(SharedTree *t, const char *path) {
+    assert(t);
+    if (!is_path_valid(path)) return EINVAL;
+    if (strcmp(path, "/") == 0) return EEXIST;
+
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    char *parent_path = make_path_to_parent(path, name);
+    Offset parent;
+    int err = find_lock(t, parent_path, true, &parent);
+    free(parent_path);
+    if (err) return err;
+
+    if (index_find(t, AT(t, parent), name, name_hash(name))) {
+        err = EEXIST;
+    } else {
+        Intent in = {.type = INTENT_CREATE, .target_parent = parent};
+        in.child = node_new(t);
+        in.target_name = name_new(t, name);
+        if (in.child && in.target_name) {
+            err = intent_run(t, &in);
+        } else {
+            if (in.child) node_free(t, in.child);
+            if (in.target_name) name_free(t, in.target_name);
+            err = ENOSPC;
+        }
+    }
+    unlock_wr(t, parent);
+    return err;
+}
+
+// Finds the parent of the directory and write-locks it,
+// then write-locks the directory and unlinks it.
+// Tree traversal lock type: READ.
+int shared_tree_remove(SharedTree *t, const char *path) {
+    assert(t);
+    if (!is_path_valid(path)) return EINVAL;
+    if (strcmp(path, "/") == 0) return EBUSY;
+
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    char *parent_path = make_path_to_parent(path, name);
+    Offset parent;
+    int err = find_lock(t, parent_path, true, &parent);
+    free(parent_path);
+    if (err) return err;
+
+    Entry *e = index_find(t, AT(t, parent), name, name_hash(name));
+    if (!e) {
+        err = ENOENT;
+    } else {
+        Intent in = {.type = INTENT_REMOVE, .source_parent = parent,
+                     .source_name = e->name, .child = e->child};
+        lock_wr(t, in.child);
+        if (((Node *) AT(t, in.child))->size > 0) {
+            unlock_wr(t, in.child);
+            err = ENOTEMPTY;
+        } else {
+            // Unlocks and frees the child.
+            err = intent_run(t, &in);
+        }
+    }
+    unlock_wr(t, parent);
+    return err;
+}
+
+// Write-locks both parents (see find_wrlock2) and the moved directory,
+// then relinks it.
+int shared_tree_move(SharedTree *t, const char *source, const char *target) {
+    assert(t && source && target);
+    if (!is_path_valid(source) || !is_path_valid(target)) return EINVAL;
+    if (strcmp(source, "/") == 0) return EBUSY;
+    if (strcmp(target, "/") == 0) return EEXIST;
+    if (is_subpath(target, source)) return EMOVE;
+
+    char source_name[MAX_FOLDER_NAME_LENGTH + 1];
+    char target_name[MAX_FOLDER_NAME_LENGTH + 1];
+    char *source_parent_path = make_path_to_parent(source, source_name);
+    char *target_parent_path = make_path_to_parent(target, target_name);
+    Offset source_parent, target_parent;
+    int err = find_wrlock2(t, source_parent_path, target_parent_path,
+                           &source_parent, &target_parent);
+    free(source_parent_path);
+    free(target_parent_path);
+    if (err) return err;
+
+    bool same = source_parent == target_parent && strcmp(source_name, target_name) == 0;
+    Entry *e = index_find(t, AT(t, source_parent), source_name, name_hash(source_name));
+    if (!e)
+        err = ENOENT;
+    else if (!same && index_find(t, AT(t, target_parent), target_name, name_hash(target_name)))
+        err = EEXIST;
+
+    if (!err && !same) {
+        Intent in = {.type = INTENT_MOVE,
+                     .source_parent = source_parent, .source_name = e->name,
+                     .target_parent = target_parent, .child = e->child};
+        lock_wr(t, in.child);
+        in.target_name = name_new(t, target_name);
+        err = in.target_name ? intent_run(t, &in) : ENOSPC;
+        unlock_wr(t, in.child);
+    }
+    unlock_wr(t, target_parent);
+    if (source_parent != target_parent) unlock_wr(t, source_parent);
+    return err;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <stddef.h>
+
+// Tree living in a POSIX shared memory object, so that processes on one host
+// can share it: all nodes, child indexes, names and locks are inside the
+// region and refer to each other by offsets, as every process maps it
+// at a different address. Operations work like those of Tree.h and lock
+// the same way, with locks usable across processes.
+//
+// Each handle takes one of 64 slots in the region. A process that dies
+// with operations in progress (e.g. killed) is detected by another one
+// waiting for a lock it held, or opening a handle: its last operation is
+// completed or rolled back and its locks are released.
+//
+// A handle belongs to the thread which opened it: only that thread may use
+// and close it, and it counts as dead once that thread ends. In particular,
+// it must not be used by a child after fork.
+typedef struct SharedTree SharedTree;
+
+// Open the tree in shared memory object `name` (e.g. "/tree"), creating one
+// of `size` bytes with an empty tree if it does not exist (`size` is ignored
+// otherwise). Returns NULL and sets errno on failure: EINVAL if `size` is too
+// small, EAGAIN if all slots are taken, or that of shm_open or mmap.
+SharedTree* shared_tree_open(const char* name, size_t size);
+
+// Close the handle. The tree stays until shared_tree_unlink.
+void shared_tree_close(SharedTree* tree);
+
+// Remove shared memory object `name`; processes having it open can still use it.
+// Returns 0 or errno.
+int shared_tree_unlink(const char* name);
+
+// As tree_list, tree_create, tree_remove and tree_move;
+// creating and moving also return ENOSPC when the region is full.
+char* shared_tree_list(SharedTree* tree, const char* path);
+
+int shared_tree_create(SharedTree* tree, const char* path);
+
+int shared_tree_remove(SharedTree* tree, const char* path);
+
+int shared_tree_move(SharedTree* tree, const char* source, const char* target);
+
+// Called by shared_tree_visit for each child, in no particular order.
+// `name` points into the shared region and is only valid during the call.
+// A non-zero return value stops the visit and is returned by shared_tree_visit.
+typedef int (*shared_tree_visit_fn)(const char* name, void* arg);
+
+// Call `callback` (unless NULL, which just looks the directory up) for each
+// child of the directory at `path`, without copying, while it is read-locked.
+// Returns 0, EINVAL, ENOENT, or the callback's non-zero result.
+int shared_tree_visit(SharedTree* tree, const char* path, shared_tree_visit_fn callback,
+                      void* arg);
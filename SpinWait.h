@@ -0,0 +1,28 @@
+#pragma once
+#include <sched.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Number of busy-wait rounds before a spinning thread starts yielding the CPU.
+#define SPIN_YIELD_THRESHOLD 128
+
+// One round of busy waiting. `spins` counts rounds of the current wait
+// and should start at 0. Yields the CPU once the wait gets long,
+// so spinning stays usable with more threads than cores.
+static inline void spin_wait(unsigned *spins) {
+    if (++*spins < SPIN_YIELD_THRESHOLD) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        sched_yield();
+    }
+}
+
+// Whether the absolute CLOCK_MONOTONIC `deadline` has passed.
+static inline bool deadline_passed(const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline->tv_sec
+           || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
@@ -0,0 +1,217 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "Trace.h"
+#include "err.h"
+
+/**
+ * Per-thread trace rings.
+ *
+ * A ring is written only by its thread. Each slot is guarded by
+ * its own sequence number, like a seqlock: odd while the slot is
+ * being written, 2 * (index + 1) once event `index` is in it.
+ * The dumper copies a slot and keeps the copy only if the sequence
+ * number was the expected one before and after copying.
+ *
+ * Rings are linked into a global list when their thread records
+ * its first event and are never freed, so events of threads
+ * which have exited can still be dumped.
+ *
+ * Timestamps are raw TSC ticks (CLOCK_MONOTONIC nanoseconds where
+ * there is no TSC), converted to microseconds by the dumper using
+ * the tick rate measured between the first event and the dump.
+ */
+
+typedef struct TraceSlot TraceSlot;
+
+struct TraceSlot {
+    atomic_size_t seq;
+    atomic_uint_fast64_t ticks;
+    _Atomic(const char *) name;
+    _Atomic(const void *) object;
+    atomic_char phase;
+};
+
+typedef struct TraceRing TraceRing;
+
+struct TraceRing {
+    atomic_size_t head; // number of events recorded so far
+    unsigned tid;
+    TraceRing *next;
+    TraceSlot slots[TRACE_RING_EVENTS];
+};
+
+static _Atomic(TraceRing *) rings;
+static atomic_uint n_rings;
+static _Thread_local TraceRing *ring;
+
+static pthread_once_t clock_once = PTHREAD_ONCE_INIT;
+static uint64_t start_ticks;
+static uint64_t start_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline uint64_t now_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+static void clock_init(void) {
+    start_ns = now_ns();
+    start_ticks = now_ticks();
+}
+
+static TraceRing *ring_new(void) {
+    pthread_once(&clock_once, clock_init);
+    TraceRing *r = malloc(sizeof(TraceRing));
+    if (!r) syserr("memory alloc failed!");
+
+    atomic_init(&r->head, 0);
+    for (size_t i = 0; i < TRACE_RING_EVENTS; ++i) {
+        atomic_init(&r->slots[i].seq, 0);
+    }
+    r->tid = atomic_fetch_add(&n_rings, 1) + 1;
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r)) {}
+    return r;
+}
+
+void trace_event(char phase, const char *name, const void *object) {
+    TraceRing *r = ring;
+    if (!r) r = ring = ring_new();
+
+    size_t index = atomic_load_explicit(&r->head, memory_order_relaxed);
+    TraceSlot *slot = &r->slots[index % TRACE_RING_EVENTS];
+    atomic_store_explicit(&slot->seq, 2 * index + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&slot->ticks, now_ticks(), memory_order_relaxed);
+    atomic_store_explicit(&slot->name, name, memory_order_relaxed);
+    atomic_store_explicit(&slot->object, object, memory_order_relaxed);
+    atomic_store_explicit(&slot->phase, phase, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, 2 * index + 2, memory_order_release);
+    atomic_store_explicit(&r->head, index + 1, memory_order_release);
+}
+
+// ----------------------------------------------
+
+typedef struct DumpEvent DumpEvent;
+
+struct DumpEvent {
+    uint64_t ticks;
+    const char *name;
+    const void *object;
+    char phase;
+    unsigned tid;
+};
+
+// Copies event `index` of the ring, if it has not been overwritten.
+static bool slot_copy(TraceRing *r, size_t index, DumpEvent *out) {
+    TraceSlot *slot = &r->slots[index % TRACE_RING_EVENTS];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq != 2 * index + 2) return false;
+    out->ticks = atomic_load_explicit(&slot->ticks, memory_order_relaxed);
+    out->name = atomic_load_explicit(&slot->name, memory_order_relaxed);
+    out->object = atomic_load_explicit(&slot->object, memory_order_relaxed);
+    out->phase = atomic_load_explicit(&slot->phase, memory_order_relaxed);
+    out->tid = r->tid;
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq;
+}
+
+static int compare_handoffs(const void *p1, const void *p2) {
+    const DumpEvent *e1 = p1, *e2 = p2;
+    if (e1->object != e2->object) return (uintptr_t) e1->object < (uintptr_t) e2->object ? -1 : 1;
+    return (e1->ticks > e2->ticks) - (e1->ticks < e2->ticks);
+}
+
+static bool is_release(const DumpEvent *e) {
+    return e->phase == TRACE_PHASE_INSTANT && strcmp(e->name, TRACE_LOCK_RELEASE) == 0;
+}
+
+static bool is_wait_end(const DumpEvent *e) {
+    return e->phase == TRACE_PHASE_END && strcmp(e->name, TRACE_LOCK_WAIT) == 0;
+}
+
+// Microseconds since the first event of the process.
+static double to_us(uint64_t ticks, double ticks_per_us) {
+    return (double) (int64_t) (ticks - start_ticks) / ticks_per_us;
+}
+
+static void write_flow(FILE *out, char phase, size_t id, double ts, unsigned tid) {
+    fprintf(out, ",\n{\"name\":\"handoff\",\"cat\":\"lock\",\"ph\":\"%c\",\"id\":%zu,"
+                 "\"ts\":%.3f,\"pid\":1,\"tid\":%u%s}",
+            phase, id, ts, tid, phase == 'f' ? ",\"bp\":\"e\"" : "");
+}
+
+int trace_dump(FILE *out) {
+    pthread_once(&clock_once, clock_init);
+    uint64_t end_ns = now_ns();
+    uint64_t end_ticks = now_ticks();
+    double ticks_per_us = end_ns > start_ns
+                          ? (double) (end_ticks - start_ticks) * 1000.0 / (end_ns - start_ns) : 1000.0;
+    if (ticks_per_us <= 0) ticks_per_us = 1000.0;
+
+    size_t cap = (size_t) atomic_load(&n_rings) * TRACE_RING_EVENTS;
+    DumpEvent *events = malloc((cap + 1) * sizeof(DumpEvent));
+    if (!events) syserr("memory alloc failed!");
+    size_t n = 0;
+    // Events of threads which start tracing meanwhile may not fit; they are left out.
+    for (TraceRing *r = atomic_load(&rings); r; r = r->next) {
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        size_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        for (size_t i = first; i < head && n < cap; ++i) {
+            if (slot_copy(r, i, &events[n])) ++n;
+        }
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (size_t i = 0; i < n; ++i) {
+        DumpEvent *e = &events[i];
+        fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u",
+                i > 0 ? "," : "", e->name, e->phase, to_us(e->ticks, ticks_per_us), e->tid);
+        if (e->phase == TRACE_PHASE_INSTANT) fprintf(out, ",\"s\":\"t\"");
+        if (e->object) fprintf(out, ",\"args\":{\"object\":\"%p\"}", e->object);
+        fputc('}', out);
+    }
+
+    // Links each lock wait to the release which ended it: the latest
+    // release of the same lock before the wait ended, unless it was the waiter's own.
+    size_t n_handoffs = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (is_release(&events[i]) || is_wait_end(&events[i])) events[n_handoffs++] = events[i];
+    }
+    qsort(events, n_handoffs, sizeof(DumpEvent), compare_handoffs);
+    const DumpEvent *release = NULL;
+    size_t flow_id = 0;
+    for (size_t i = 0; i < n_handoffs; ++i) {
+        const DumpEvent *e = &events[i];
+        if (release && release->object != e->object) release = NULL;
+        if (is_release(e)) {
+            release = e;
+        } else if (release && release->tid != e->tid) {
+            ++flow_id;
+            write_flow(out, 's', flow_id, to_us(release->ticks, ticks_per_us), release->tid);
+            write_flow(out, 'f', flow_id, to_us(e->ticks, ticks_per_us), e->tid);
+        }
+    }
+    fprintf(out, "\n]}\n");
+    free(events);
+
+    if (fflush(out) != 0 || ferror(out)) return errno ? errno : EIO;
+    return 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <stdio.h>
+
+/*
+ * Tracepoints, compiled in only with TREE_TRACE defined
+ * (cmake -DTREE_TRACE=ON); otherwise the macros below expand to nothing.
+ *
+ * Every thread records its events into its own ring buffer
+ * of TRACE_RING_EVENTS events, stamped with the TSC,
+ * without any locks or system calls. When the ring is full,
+ * the oldest events are overwritten.
+ * trace_dump() writes all rings out as Chrome trace JSON,
+ * to be opened in Perfetto (ui.perfetto.dev) or chrome://tracing.
+ *
+ * `name` must be a string literal (only the pointer is recorded).
+ * `object` identifies what the event is about, e.g. a lock; may be NULL.
+ */
+
+#ifndef TRACE_RING_EVENTS
+#define TRACE_RING_EVENTS (1 << 16)
+#endif
+
+#define TRACE_PHASE_BEGIN 'B'
+#define TRACE_PHASE_END 'E'
+#define TRACE_PHASE_INSTANT 'i'
+
+// Names of lock events. Each TRACE_LOCK_WAIT span which follows a TRACE_LOCK_RELEASE
+// of the same lock by another thread is linked to it by trace_dump
+// (as a flow arrow), which shows chains of lock handoffs.
+#define TRACE_LOCK_WAIT "lock wait"
+#define TRACE_LOCK_RELEASE "lock release"
+
+#ifdef TREE_TRACE
+#define TRACE_BEGIN(name, object) trace_event(TRACE_PHASE_BEGIN, name, object)
+#define TRACE_END(name, object) trace_event(TRACE_PHASE_END, name, object)
+#define TRACE_INSTANT(name, object) trace_event(TRACE_PHASE_INSTANT, name, object)
+#else
+#define TRACE_BEGIN(name, object) ((void) 0)
+#define TRACE_END(name, object) ((void) 0)
+#define TRACE_INSTANT(name, object) ((void) 0)
+#endif
+
+// Records an event of the calling thread.
+void trace_event(char phase, const char *name, const void *object);
+
+// Writes events recorded so far by all threads (also those which have exited)
+// as Chrome trace JSON. May run concurrently with tracing threads:
+// events overwritten while being copied are left out.
+// Returns 0, or errno of a failed write.
+int trace_dump(FILE *out);
@@ -3,9 +3,21 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include "path_utils.h"
 #include "HashMap.h"
+#include "NameTable.h"
 #include "ReadWriteLock.h"
+#include "TreeLocking.h"
+#include "Watch.h"
+#include "Trace.h"
 #include "Tree.h"
 #include "err.h"
 
@@ -33,6 +45,15 @@
  * write-locks the node (still write-locking it's parent),
  * no other threads are waiting on the node's lock,
  * or working on the node.
+ *
+ * Deadlines:
+ * Traversal functions take an optional deadline
+ * (absolute CLOCK_MONOTONIC time, NULL means no deadline).
+ * Every wait is then bounded by it, and a thread running out
+ * of time releases all locks it holds and returns ETIMEDOUT.
+ * Where a thread would wait while write-locking the node's parent
+ * (which stalls everybody behind the parent), it only tries the lock,
+ * and when it is busy, releases everything, backs off and restarts.
  */
 
 /*
@@ -40,10 +61,28 @@
  */
 typedef struct Directory Directory;
 
+typedef struct DirSlab DirSlab;
+
 struct Directory {
     RWLock *lock;
     HashMap *subdirs;
     Directory *parent;
+    DirSlab *slab; // memory of the directory, if it was made by dir_new_at
+    atomic_size_t n_descendants; // number of directories strictly below
+    atomic_size_t height; // max depth of the subtree below (0 for a leaf)
+};
+
+/*
+ * Slab of directories.
+ *
+ * A bulk load makes its directories in slabs of consecutive ones
+ * (of about BULK_SLAB_BYTES): each one together with its lock
+ * and its child index (with room for its children, see hmap_new_at).
+ * A slab counts its directories not freed yet,
+ * and is freed itself with the last one of them.
+ */
+struct DirSlab {
+    atomic_size_t n_live;
 };
 
 Directory *dir_new(Directory *parent) {
@@ -57,56 +96,307 @@ Directory *dir_new(Directory *parent) {
     if (!d->lock) syserr("memory alloc failed!");
 
     d->parent = parent;
+    d->slab = NULL;
+    atomic_init(&d->n_descendants, 0);
+    atomic_init(&d->height, 0);
+    return d;
+}
+
+static size_t align_up(size_t bytes, size_t align) {
+    return (bytes + align - 1) & ~(align - 1);
+}
+
+// Memory of a directory made by dir_new_at holds its lock first,
+// then the directory, then its child index. Returns the offset of the index.
+static size_t dir_at_subdirs(void) {
+    return align_up(rwlock_size(), _Alignof(max_align_t)) + align_up(sizeof(Directory), _Alignof(max_align_t));
+}
+
+// Returns the number of bytes dir_new_at needs for a directory
+// with `n_subdirs` children, a multiple of RWLOCK_ALIGN.
+size_t dir_footprint(size_t n_subdirs) {
+    return align_up(dir_at_subdirs() + hmap_footprint(n_subdirs), RWLOCK_ALIGN);
+}
+
+// Makes a directory, whose child index fits `n_subdirs` children,
+// in the dir_footprint(n_subdirs) bytes at `mem` (aligned to RWLOCK_ALIGN),
+// which belong to `slab`.
+Directory *dir_new_at(void *mem, DirSlab *slab, Directory *parent, size_t n_subdirs) {
+    char *bytes = mem;
+    Directory *d = (Directory *) (bytes + align_up(rwlock_size(), _Alignof(max_align_t)));
+    d->lock = rwlock_init(mem);
+    d->subdirs = hmap_new_at(bytes + dir_at_subdirs(), n_subdirs);
+    d->parent = parent;
+    d->slab = slab;
+    atomic_init(&d->n_descendants, 0);
+    atomic_init(&d->height, 0);
     return d;
 }
 
+// Directories of one slab freed in a row, counted out of it at once
+// (so that threads freeing a tree don't all update one counter).
+typedef struct SlabRun SlabRun;
+
+struct SlabRun {
+    DirSlab *slab;
+    size_t n_freed;
+};
+
+// Counts the run out of its slab, freeing the slab with its last directory.
+static void slab_run_end(SlabRun *run) {
+    if (run->slab && atomic_fetch_sub(&run->slab->n_live, run->n_freed) == run->n_freed) {
+        free(run->slab);
+    }
+    run->slab = NULL;
+    run->n_freed = 0;
+}
+
+// Frees `d` alone; its children must have been taken care of.
+// A directory of a slab is only added to `run`.
+static void dir_free_node(Directory *d, SlabRun *run) {
+    if (!d->slab) {
+        rwlock_free(d->lock);
+        hmap_free(d->subdirs);
+        free(d);
+        return;
+    }
+    rwlock_destroy(d->lock);
+    hmap_free(d->subdirs);
+    if (run->slab != d->slab) {
+        slab_run_end(run);
+        run->slab = d->slab;
+    }
+    run->n_freed++;
+}
+
+// Pushes children of `d` onto `stack` of `n` out of `*cap` entries
+// (grown as needed), frees `d` alone, releasing the names of
+// its children, and returns the new stack size.
+static size_t dir_free_one(Directory *d, Directory ***stack, size_t n, size_t *cap, SlabRun *run) {
+    if (n + hmap_size(d->subdirs) > *cap) {
+        *cap = 2 * (n + hmap_size(d->subdirs));
+        *stack = realloc(*stack, *cap * sizeof(Directory *));
+        if (!*stack) syserr("memory alloc failed!");
+    }
+    NameId subdir_name;
+    Directory *subdir;
+    HashMapIterator it = hmap_iterator(d->subdirs);
+    while (hmap_next(d->subdirs, &it, &subdir_name, (void **) &subdir)) {
+        (*stack)[n++] = subdir;
+        name_release(subdir_name);
+    }
+    dir_free_node(d, run);
+    return n;
+}
+
+// Frees `d` and its whole subtree, without recursion,
+// so that deep chains don't overflow the stack.
+// The name `d` had in its parent is the caller's to release.
 void dir_free(Directory *d) {
     assert(d);
-    const char *subdir_name;
+    SlabRun run = {NULL, 0};
+    if (hmap_size(d->subdirs) == 0) { // Removed directories are leaves.
+        dir_free_node(d, &run);
+        slab_run_end(&run);
+        return;
+    }
+    size_t cap = 64, n = 1;
+    Directory **stack = malloc(cap * sizeof(Directory *));
+    if (!stack) syserr("memory alloc failed!");
+    stack[0] = d;
+    while (n > 0) {
+        n = dir_free_one(stack[n - 1], &stack, n - 1, &cap, &run);
+    }
+    slab_run_end(&run);
+    free(stack);
+}
+
+/*
+ * Subtree statistics.
+ *
+ * Every directory keeps the number of its descendants
+ * and the height of its subtree. Both are updated along
+ * the ancestor chain by the thread that changes the tree,
+ * while it write-locks the changed directory's parent.
+ * Ancestors are not locked: while the parent is write-locked,
+ * none of its ancestors can be moved or removed,
+ * so the chain of `parent` pointers is stable.
+ * Counters are plain relaxed atomics, they do not order anything.
+ *
+ * Heights only grow along the chain (atomic max).
+ * When the tallest subtree of a directory disappears,
+ * the height has to be recomputed from the children,
+ * which requires their maps to be stable.
+ * The write-locked parent is recomputed right away,
+ * its ancestors afterwards by dir_repair_heights(),
+ * which read-locks the path.
+ * If a directory is moved before its repair happens,
+ * dir_subtree_locked() recomputes it while the moved subtree is locked.
+ */
+
+// Adds `delta` to descendant counts of `d` and all its ancestors.
+void dir_add_descendants(Directory *d, size_t delta) {
+    for (; d->parent; d = d->parent) {
+        atomic_fetch_add_explicit(&d->n_descendants, delta, memory_order_relaxed);
+    }
+}
+
+// Accounts for a subtree of height `height` attached to `d`.
+void dir_raise_height(Directory *d, size_t height) {
+    for (; d->parent; d = d->parent) {
+        ++height;
+        size_t cur = atomic_load(&d->height);
+        while (cur < height && !atomic_compare_exchange_weak(&d->height, &cur, height)) {}
+    }
+}
+
+// Returns height of `d` computed from its children.
+// `d` must be locked.
+size_t dir_scan_height(Directory *d) {
+    size_t height = 0;
+    NameId subdir_name;
     Directory *subdir;
     HashMapIterator it = hmap_iterator(d->subdirs);
     while (hmap_next(d->subdirs, &it, &subdir_name, (void **) &subdir)) {
-        dir_free(subdir);
+        size_t h = atomic_load(&subdir->height) + 1;
+        if (h > height) height = h;
     }
+    return height;
+}
 
-    rwlock_free(d->lock);
-    hmap_free(d->subdirs);
-    free(d);
+// Recomputes height of `d` and returns whether it changed.
+// `d` must be locked.
+//
+// Children may still grow concurrently (growing does not lock `d`).
+// Such a thread raises `d` after raising the child,
+// so storing and then re-scanning until the result is stable
+// never loses a concurrent raise.
+bool dir_repair_height(Directory *d) {
+    size_t old = atomic_load(&d->height);
+    size_t height = dir_scan_height(d);
+    while (true) {
+        atomic_store(&d->height, height);
+        size_t rescan = dir_scan_height(d);
+        if (rescan == height) break;
+        height = rescan;
+    }
+    return height != old;
 }
 
-// Write-locks root's subtree.
-int dir_wr_lock(Directory *root) {
-    assert(root != NULL);
-    rwlock_wr_lock(root->lock);
-    const char *subdir_name;
-    Directory *subdir;
-    HashMapIterator it = hmap_iterator(root->subdirs);
-    while (hmap_next(root->subdirs, &it, &subdir_name, (void **) &subdir)) {
-        dir_wr_lock(subdir);
+// Recomputes heights of the ancestors of directory at `path`, bottom-up,
+// after the directory's own height has decreased.
+// Tree traversal lock type: READ (all ancestors are kept locked).
+void dir_repair_heights(Directory *root, const char *path) {
+    assert(root != NULL && is_path_valid(path));
+    Directory *locked[MAX_PATH_LENGTH / 2 + 1];
+    size_t n_locked = 0;
+
+    NameId child_name;
+    const char *subpath = path;
+    Directory *d = root;
+    rwlock_rd_lock(d->lock);
+    locked[n_locked++] = d;
+    while ((subpath = split_path_id(subpath, &child_name)) && strcmp(subpath, "/") != 0) {
+        d = hmap_get(d->subdirs, child_name);
+        if (!d) break;
+        rwlock_rd_lock(d->lock);
+        locked[n_locked++] = d;
+    }
+
+    // If the path was removed or moved in the meantime,
+    // its remaining prefix is repaired anyway.
+    // The removing or moving thread takes care of the rest.
+    size_t i = n_locked;
+    while (i > 0 && dir_repair_height(locked[i - 1])) {
+        --i;
+    }
+    while (n_locked > 0) {
+        rwlock_rd_unlock(locked[--n_locked]->lock);
     }
-    return 0;
 }
 
-// Write-unlocks root's subtree.
-int dir_wr_unlock(Directory *root) {
-    assert(root != NULL);
-    const char *subdir_name;
-    Directory *subdir;
-    HashMapIterator it = hmap_iterator(root->subdirs);
-    while (hmap_next(root->subdirs, &it, &subdir_name, (void **) &subdir)) {
-        dir_wr_unlock(subdir);
+// Read-locks `lock`, waiting at most until `deadline` (if not NULL).
+int lock_rd_until(RWLock *lock, const struct timespec *deadline) {
+    return deadline ? rwlock_timed_rd_lock(lock, deadline) : rwlock_rd_lock(lock);
+}
+
+// Write-locks `lock`, waiting at most until `deadline` (if not NULL).
+int lock_wr_until(RWLock *lock, const struct timespec *deadline) {
+    return deadline ? rwlock_timed_wr_lock(lock, deadline) : rwlock_wr_lock(lock);
+}
+
+// Upgradable-read-locks `lock`, waiting at most until `deadline` (if not NULL).
+int lock_up_until(RWLock *lock, const struct timespec *deadline) {
+    return deadline ? rwlock_timed_up_lock(lock, deadline) : rwlock_up_lock(lock);
+}
+
+// Directories for the locking protocol of TreeLocking.h.
+
+static void *dir_child(void *d, NameId name) {
+    return hmap_get(((Directory *) d)->subdirs, name);
+}
+
+static int dir_lock(void *d, TreeLockMode mode, const struct timespec *deadline) {
+    RWLock *lock = ((Directory *) d)->lock;
+    switch (mode) {
+        case TREE_LOCK_READ:
+            return lock_rd_until(lock, deadline);
+        case TREE_LOCK_UPGRADABLE:
+            return lock_up_until(lock, deadline);
+        default:
+            return lock_wr_until(lock, deadline);
+    }
+}
+
+static void dir_unlock(void *d, TreeLockMode mode) {
+    RWLock *lock = ((Directory *) d)->lock;
+    switch (mode) {
+        case TREE_LOCK_READ:
+            rwlock_rd_unlock(lock);
+            break;
+        case TREE_LOCK_UPGRADABLE:
+            rwlock_up_unlock(lock);
+            break;
+        default:
+            rwlock_wr_unlock(lock);
+    }
+}
+
+static int dir_for_each_child(void *d, int (*fn)(void *child, void *arg), void *arg) {
+    HashMap *subdirs = ((Directory *) d)->subdirs;
+    NameId subdir_name;
+    void *subdir;
+    HashMapIterator it = hmap_iterator(subdirs);
+    while (hmap_next(subdirs, &it, &subdir_name, &subdir)) {
+        int err = fn(subdir, arg);
+        if (err) return err;
     }
-    rwlock_wr_unlock(root->lock);
     return 0;
 }
 
+// Recomputes the height of `d` once its subtree is write-locked: as that is
+// stable then, this settles height repairs still pending inside it.
+static void dir_subtree_locked(void *d) {
+    atomic_store(&((Directory *) d)->height, dir_scan_height(d));
+}
+
+static const TreeLockOps DIR_LOCK_OPS = {
+    .child = dir_child,
+    .lock = dir_lock,
+    .unlock = dir_unlock,
+    .for_each_child = dir_for_each_child,
+    .subtree_locked = dir_subtree_locked,
+};
+
 char *dir_list(Directory *d) {
     assert(d != NULL);
     return make_map_contents_string(d->subdirs);
 }
 
-int dir_create(Directory *d, char *subdir_name) {
-    assert(d && subdir_name);
+// Creates subdirectory of write-locked `d`, whose entry
+// takes over the caller's reference to `subdir_name`.
+int dir_create(Directory *d, NameId subdir_name) {
+    assert(d && subdir_name != NAME_NONE);
     Directory *subdir = NULL;
     subdir = dir_new(d);
     if (!subdir) return -1;
@@ -115,34 +405,85 @@ int dir_create(Directory *d, char *subdir_name) {
         dir_free(subdir);
         return -1;
     }
+    dir_add_descendants(d, 1);
+    dir_raise_height(d, 0);
     return 0;
 }
 
-// Write-locks the whole subtree of moved directory,
-// then moves it.
+// Moves `moved` from source_parent to target_parent
+// and updates statistics. Both parents and `moved` must be write-locked.
+// The new entry takes over the caller's reference to target_dir_name,
+// the one to source_dir_name is handed back to the caller.
+// Returns whether source_parent's height decreased.
+bool dir_relink(Directory *source_parent, Directory *target_parent,
+                NameId source_dir_name, NameId target_dir_name, Directory *moved) {
+    hmap_remove(source_parent->subdirs, source_dir_name);
+    hmap_insert(target_parent->subdirs, target_dir_name, moved);
+    moved->parent = target_parent;
+    if (source_parent == target_parent) return false;
+
+    size_t n_moved = atomic_load_explicit(&moved->n_descendants, memory_order_relaxed) + 1;
+    size_t moved_height = atomic_load(&moved->height);
+    dir_add_descendants(source_parent, -n_moved);
+    dir_add_descendants(target_parent, n_moved);
+    dir_raise_height(target_parent, moved_height);
+    return dir_repair_height(source_parent);
+}
+
+// Removes empty subdirectory from write-locked `d`
+// (without freeing it or releasing its name) and updates statistics.
+// Returns whether d's height decreased.
+bool dir_unlink(Directory *d, NameId subdir_name) {
+    hmap_remove(d->subdirs, subdir_name);
+    dir_add_descendants(d, -1);
+    return dir_repair_height(d);
+}
+
+// Looks both names up, write-locks the whole subtree
+// of moved directory, then moves it, interning the target name.
+// Sets `*shrunk` if source_parent's height decreased
+// and its ancestors need dir_repair_heights().
+// The move is published to `watches` before the parents are released.
+// With a deadline, the subtree is only tried: if it is busy,
+// both parents are released and ETIMEDOUT returned.
 int dir_move(Directory *source_parent, Directory *target_parent,
-             const char *source_dir_name, const char *target_dir_name) {
+             const char *source_component, const char *target_component, bool *shrunk,
+             WatchList *watches, const char *source, const char *target,
+             const struct timespec *deadline) {
     // assert that source_parent AND target_parent are write-locked.
 
     int err = 0;
+    *shrunk = false;
     Directory *moved = NULL;
+    // Exact, as long as the parents are locked.
+    NameId source_dir_name = name_find(source_component, strlen(source_component));
+    NameId target_dir_name = name_find(target_component, strlen(target_component));
     moved = hmap_get(source_parent->subdirs, source_dir_name);
     if (!moved) err = ENOENT;
     if (!err
-        && !((source_parent == target_parent) && strcmp(source_dir_name, target_dir_name) == 0)
+        && !((source_parent == target_parent) && source_dir_name == target_dir_name)
         && hmap_get(target_parent->subdirs, target_dir_name))
         err = EEXIST;
 
     if (!err) {
-        dir_wr_lock(moved);
-        hmap_remove(source_parent->subdirs, source_dir_name);
-        hmap_insert(target_parent->subdirs, target_dir_name, moved);
-        moved->parent = target_parent;
+        TRACE_BEGIN("tree_lock_subtree", moved);
+        err = tree_lock_subtree(&DIR_LOCK_OPS, moved, deadline ? &TREE_NO_WAIT : NULL);
+        TRACE_END("tree_lock_subtree", moved);
+    }
+
+    if (!err) {
+        target_dir_name = name_intern(target_component, strlen(target_component));
+        TRACE_BEGIN("dir_relink", moved);
+        *shrunk = dir_relink(source_parent, target_parent,
+                             source_dir_name, target_dir_name, moved);
+        TRACE_END("dir_relink", moved);
+        watch_publish(watches, TREE_EVENT_MOVE, source, target);
         rwlock_wr_unlock(target_parent->lock);
         if (source_parent != target_parent) {
             rwlock_wr_unlock(source_parent->lock);
         }
-        dir_wr_unlock(moved);
+        tree_unlock_subtree(&DIR_LOCK_OPS, moved);
+        name_release(source_dir_name);
     } else {
         rwlock_wr_unlock(source_parent->lock);
         if (source_parent != target_parent) {
@@ -154,16 +495,19 @@ int dir_move(Directory *source_parent, Directory *target_parent,
 
 // Finds directory and read-locks it's parent.
 // Tree traversal lock type: READ.
-int dir_find_rdlock_parent(Directory **out, Directory *root, const char *path) {
+int dir_find_rdlock_parent(Directory **out, Directory *root, const char *path,
+                           const struct timespec *deadline) {
     assert(root != NULL && is_path_valid(path));
-    char child_name[MAX_FOLDER_NAME_LENGTH + 1];
+    NameId child_name;
     const char *subpath = path;
     Directory *parent = root->parent;
-    rwlock_rd_lock(parent->lock);
+    int err = lock_rd_until(parent->lock, deadline);
+    if (err) return err;
     Directory *child = root;
-    while ((subpath = split_path(subpath, child_name))) {
-        rwlock_rd_lock(child->lock);
+    while ((subpath = split_path_id(subpath, &child_name))) {
+        err = lock_rd_until(child->lock, deadline);
         rwlock_rd_unlock(parent->lock);
+        if (err) return err;
 
         parent = child;
         child = hmap_get(parent->subdirs, child_name);
@@ -176,101 +520,25 @@ int dir_find_rdlock_parent(Directory **out, Directory *root, const char *path) {
     return 0;
 }
 
-// Finds directory and write-locks it.
-// Tree traversal lock type: WRITE.
-int dir_find_wrlock(Directory **out, Directory *root, const char *path, bool unlock_root) {
-    assert(root != NULL && is_path_valid(path));
-    // assert that root is wrlocked. // TODO:
-    if (strcmp("/", path) == 0) {
-        *out = root;
-        return 0;
-    }
-
-    char child_name[MAX_FOLDER_NAME_LENGTH + 1];
-    const char *subpath = path;
-    Directory *parent = root;
-    Directory *child = NULL;
-    while ((subpath = split_path(subpath, child_name))) {
-        child = hmap_get(parent->subdirs, child_name);
-        if (!child) {
-            if (unlock_root || parent != root) rwlock_wr_unlock(parent->lock);
-            return ENOENT;
-        }
-        rwlock_wr_lock(child->lock);
-        if (unlock_root || parent != root) rwlock_wr_unlock(parent->lock);
-        parent = child;
-    }
-    *out = child;
-    return 0;
-}
-
-// Finds last common ancestor and read-locks it's parent.
+// Finds directory at `path` and locks it in `mode`, see tree_lock_path().
 // Tree traversal lock type: READ.
-int dir_find_common(Directory **out, Directory *root, const char *path1, const char *path2) {
-    assert(root != NULL && is_path_valid(path1) && is_path_valid(path2));
-    char *common_path = make_common_path(path1, path2);
-    if (!common_path) syserr("memory alloc failed!");
-
-    int err = dir_find_rdlock_parent(out, root, common_path);
-    free(common_path);
+static int dir_lock_path(Directory **out, Directory *root, const char *path, TreeLockMode mode,
+                         const struct timespec *deadline) {
+    void *found = NULL;
+    int err = tree_lock_path(&DIR_LOCK_OPS, root, path, strlen(path), mode, deadline, &found);
+    *out = found;
     return err;
 }
 
-// Finds and write-locks out1 & out2's common ancestor,
-// (tree traversal lock type: READ)
-// then finds and write-locks out1 & out2,
-// (Tree traversal lock type: WRITE.)
-//
-// If the ancestor is not *out1 or *out2, it is unlocked
-// after locking the *out2 node
-// and before locking the *out1 node
+// Finds and write-locks directories at `path1` and `path2`, see tree_lock2().
 int dir_find_wr_lock2(Directory **out1, Directory **out2, Directory *root,
-                      char *path1, char *path2) {
+                      const char *path1, const char *path2, const struct timespec *deadline) {
     assert(root && path1 && path2);
-    int err;
-    Directory *common = NULL;
-    err = dir_find_common(&common, root, path1, path2);
-    if (err) return err;
-
-    rwlock_wr_lock(common->lock);
-    rwlock_rd_unlock(common->parent->lock);
-
-    if (strcmp(path1, path2) == 0) {
-        *out1 = common;
-        *out2 = common;
-        return err;
-    }
-
-    char *subpath1 = path1;
-    char *subpath2 = path2;
-    split_common_path(&subpath1, &subpath2);
-
-    if (is_subpath(path1, path2)) {
-        *out2 = common;
-        err = dir_find_wrlock(out1, common, subpath1, false);
-        if (err) {
-            rwlock_wr_unlock(common->lock);
-            return err;
-        }
-    } else if (is_subpath(path2, path1)) {
-        *out1 = common;
-        err = dir_find_wrlock(out2, common, subpath2, false);
-        if (err) {
-            rwlock_wr_unlock(common->lock);
-            return err;
-        }
-    } else {
-        err = dir_find_wrlock(out2, common, subpath2, false);
-        if (err) {
-            rwlock_wr_unlock(common->lock);
-            return err;
-        }
-        err = dir_find_wrlock(out1, common, subpath1, true);
-        if (err) {
-            rwlock_wr_unlock((*out2)->lock);
-            return err;
-        }
-    }
+    void *found1 = NULL, *found2 = NULL;
+    int err = tree_lock2(&DIR_LOCK_OPS, root, path1, strlen(path1), path2, strlen(path2),
+                         deadline, &found1, &found2);
+    *out1 = found1;
+    *out2 = found2;
     return err;
 }
 
@@ -278,6 +546,7 @@ int dir_find_wr_lock2(Directory **out1, Directory **out2, Directory *root,
 
 struct Tree {
     Directory *root;
+    WatchList *watches;
 };
 
 Tree *tree_new() {
@@ -289,6 +558,8 @@ Tree *tree_new() {
 
     t->root = dir_new(dummy);
     if (!t->root) syserr("memory alloc failed!");
+
+    t->watches = watch_list_new();
     return t;
 }
 
@@ -296,94 +567,133 @@ Tree *tree_new() {
 // Tree traversal lock type: READ.
 int tree_find(Directory **out, Tree *tree, const char *path) {
     assert(tree != NULL && is_path_valid(path));
-    return dir_find_rdlock_parent(out, tree->root, path);
+    return dir_find_rdlock_parent(out, tree->root, path, NULL);
 }
 
 // Creates new directory.
 // Let V be the directory that will become parent
 // of newly created directory.
-// First, V's parent is found.
+// First, V is found and upgradable-read-locked.
 // (Tree traversal lock type: READ.)
-// Then, V is write-locked and it's parent is released.
-// Then the new directory is created.
-int tree_create(Tree *tree, const char *path) {
+// If the new directory doesn't exist yet, V's lock is upgraded
+// and the directory is created. So a failing create never
+// holds readers of V back, and never interns its name. The deadline bounds the wait for
+// the upgradable lock; the upgrade only waits for readers
+// already in V, which never wait for this thread.
+int tree_create_timed(Tree *tree, const char *path, const struct timespec *deadline) {
     assert(tree != NULL);
     if (!is_path_valid(path)) return EINVAL;
     if (strcmp(path, "/") == 0) return EEXIST;
 
     int err;
-    char subdir_name[MAX_FOLDER_NAME_LENGTH + 1];
-    char *parent_path = make_path_to_parent(path, subdir_name);
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    char *parent_path = make_path_to_parent(path, component);
     Directory *parent = NULL;
 
-    err = tree_find(&parent, tree, parent_path);
+    err = dir_lock_path(&parent, tree->root, parent_path, TREE_LOCK_UPGRADABLE, deadline);
     if (err) {
         free(parent_path);
         return err;
     }
 
-    rwlock_wr_lock(parent->lock);
-    rwlock_rd_unlock(parent->parent->lock);
-
+    // Exact, as long as the parent is locked.
+    NameId subdir_name = name_find(component, strlen(component));
     if (hmap_get(parent->subdirs, subdir_name)) {
         // subdir already exists
-        err = EEXIST;
-    } else {
-        err = dir_create(parent, subdir_name);
+        rwlock_up_unlock(parent->lock);
+        free(parent_path);
+        return EEXIST;
     }
+
+    rwlock_upgrade(parent->lock);
+    subdir_name = name_intern(component, strlen(component));
+    err = dir_create(parent, subdir_name);
+    if (!err) watch_publish(tree->watches, TREE_EVENT_CREATE, path, NULL);
+    else name_release(subdir_name);
     rwlock_wr_unlock(parent->lock);
     free(parent_path);
     return err;
 }
 
+int tree_create(Tree *tree, const char *path) {
+    return tree_create_timed(tree, path, NULL);
+}
+
 // Return content of directory at given path.
 // Tree traversal lock type: READ.
-char *tree_list(Tree *tree, const char *path) {
+char *tree_list_timed(Tree *tree, const char *path, const struct timespec *deadline) {
     assert(tree != NULL);
-    if (!is_path_valid(path)) return NULL;
+    if (!is_path_valid(path)) {
+        errno = EINVAL;
+        return NULL;
+    }
 
     Directory *d = NULL;
-    int err = tree_find(&d, tree, path);
-    if (err) return NULL;
+    int err = dir_lock_path(&d, tree->root, path, TREE_LOCK_READ, deadline);
+    if (err) {
+        errno = err;
+        return NULL;
+    }
 
-    rwlock_rd_lock(d->lock);
-    rwlock_rd_unlock(d->parent->lock);
     char *res = dir_list(d);
     rwlock_rd_unlock(d->lock);
     return res;
 }
 
-// Finds parent of the to-be-removed directory,
-// write-locks it and write-locks the to-be-removed directory.
+char *tree_list(Tree *tree, const char *path) {
+    return tree_list_timed(tree, path, NULL);
+}
+
+// Finds parent of the to-be-removed directory and
+// upgradable-read-locks it. If the directory exists,
+// the parent's lock is upgraded (so a remove of a missing
+// directory never holds readers back, as in tree_create_timed())
+// and the to-be-removed directory is write-locked.
+// It can't be locked before the upgrade: a writer may be
+// waiting for it with the parent read-locked.
 // Then the directory is removed.
-int tree_remove(Tree *tree, const char *path) {
+// The latter wait blocks everybody behind the parent,
+// so with a deadline it is only tried, and the whole
+// operation restarted after a backoff if it fails.
+int tree_remove_timed(Tree *tree, const char *path, const struct timespec *deadline) {
     assert(tree != NULL);
     if (!is_path_valid(path)) return EINVAL;
     if (strcmp(path, "/") == 0) return EBUSY;
 
     int err;
-    char subdir_name[MAX_FOLDER_NAME_LENGTH + 1];
-    char *parent_path = make_path_to_parent(path, subdir_name);
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    char *parent_path = make_path_to_parent(path, component);
+    NameId subdir_name;
     Directory *parent = NULL;
+    Directory *dir = NULL;
+    long delay_ns = 0;
 
-    err = tree_find(&parent, tree, parent_path);
+retry:
+    err = dir_lock_path(&parent, tree->root, parent_path, TREE_LOCK_UPGRADABLE, deadline);
     if (err) {
         free(parent_path);
         return err;
     }
 
-    rwlock_wr_lock(parent->lock);
-    rwlock_rd_unlock(parent->parent->lock);
-
-    Directory *dir = hmap_get(parent->subdirs, subdir_name);
+    subdir_name = name_find(component, strlen(component));
+    dir = hmap_get(parent->subdirs, subdir_name);
     if (!dir) {
         // to-be-removed subdir does not exist
-        rwlock_wr_unlock(parent->lock);
+        rwlock_up_unlock(parent->lock);
         free(parent_path);
         return ENOENT;
     }
 
-    rwlock_wr_lock(dir->lock); // TODO
+    rwlock_upgrade(parent->lock);
+    if (!deadline) {
+        rwlock_wr_lock(dir->lock);
+    } else if (rwlock_try_wr_lock(dir->lock) != 0) {
+        rwlock_wr_unlock(parent->lock);
+        err = tree_backoff(&delay_ns, deadline);
+        if (!err) goto retry;
+        free(parent_path);
+        return err;
+    }
     if (hmap_size(dir->subdirs) > 0) {
         // to-be-removed subdir is not empty
         rwlock_wr_unlock(parent->lock);
@@ -392,18 +702,28 @@ int tree_remove(Tree *tree, const char *path) {
         return ENOTEMPTY;
     }
 
-    hmap_remove(parent->subdirs, subdir_name);
+    bool shrunk = dir_unlink(parent, subdir_name);
+    watch_publish(tree->watches, TREE_EVENT_REMOVE, path, NULL);
     rwlock_wr_unlock(parent->lock);
     rwlock_wr_unlock(dir->lock);
     dir_free(dir);
+    name_release(subdir_name);
+    if (shrunk) dir_repair_heights(tree->root, parent_path);
     free(parent_path);
     return 0;
 }
 
-// To prevent deadlocks: @see dir_find_wr_lock2() comment.
+int tree_remove(Tree *tree, const char *path) {
+    return tree_remove_timed(tree, path, NULL);
+}
+
+// Both parents are locked by dir_find_wr_lock2(), see tree_lock2().
 // Then, whole subtree of moved directory is write-locked
 // and it is moved to the new location.
-int tree_move(Tree *tree, const char *source, const char *target) {
+// With a deadline, a busy subtree makes the operation
+// restart after a backoff, like in tree_remove_timed().
+int tree_move_timed(Tree *tree, const char *source, const char *target,
+                    const struct timespec *deadline) {
     assert(tree && source && target);
     if (!is_path_valid(source) || !is_path_valid(target)) return EINVAL;
     if (strcmp(source, "/") == 0) return EBUSY;
@@ -411,32 +731,1549 @@ int tree_move(Tree *tree, const char *source, const char *target) {
     if (is_subpath(target, source)) return EMOVE;
 
     int err;
-    char source_dir_name[MAX_FOLDER_NAME_LENGTH + 1];
-    char target_dir_name[MAX_FOLDER_NAME_LENGTH + 1];
-    char *source_parent_path = make_path_to_parent(source, source_dir_name);
-    char *target_parent_path = make_path_to_parent(target, target_dir_name);
+    char source_component[MAX_FOLDER_NAME_LENGTH + 1];
+    char target_component[MAX_FOLDER_NAME_LENGTH + 1];
+    char *source_parent_path = make_path_to_parent(source, source_component);
+    char *target_parent_path = make_path_to_parent(target, target_component);
     Directory *source_parent = NULL;
     Directory *target_parent = NULL;
+    bool shrunk = false;
+    long delay_ns = 0;
 
-    err = dir_find_wr_lock2(&source_parent, &target_parent, tree->root,
-                            source_parent_path, target_parent_path);
-    if (err) {
-        free(source_parent_path);
-        free(target_parent_path);
-        return err;
-    }
+    TRACE_BEGIN("tree_move", NULL);
+    do {
+        TRACE_BEGIN("dir_find_wr_lock2", NULL);
+        err = dir_find_wr_lock2(&source_parent, &target_parent, tree->root,
+                                source_parent_path, target_parent_path, deadline);
+        TRACE_END("dir_find_wr_lock2", NULL);
+        if (err) break;
 
-    err = dir_move(source_parent, target_parent,
-                   source_dir_name, target_dir_name);
+        err = dir_move(source_parent, target_parent,
+                       source_component, target_component, &shrunk,
+                       tree->watches, source, target, deadline);
+    } while (err == ETIMEDOUT && tree_backoff(&delay_ns, deadline) == 0);
+    if (shrunk) {
+        TRACE_BEGIN("dir_repair_heights", NULL);
+        dir_repair_heights(tree->root, source_parent_path);
+        TRACE_END("dir_repair_heights", NULL);
+    }
+    TRACE_END("tree_move", NULL);
 
     free(source_parent_path);
     free(target_parent_path);
     return err;
 }
 
+int tree_move(Tree *tree, const char *source, const char *target) {
+    return tree_move_timed(tree, source, target, NULL);
+}
+
+// Returns statistics of directory at given path.
+// Tree traversal lock type: READ.
+int tree_stat(Tree *tree, const char *path, TreeStat *stat) {
+    assert(tree && stat);
+    if (!is_path_valid(path)) return EINVAL;
+
+    Directory *d = NULL;
+    int err = tree_find(&d, tree, path);
+    if (err) return err;
+
+    // Holding the parent's lock is enough to keep `d` alive.
+    stat->n_descendants = atomic_load_explicit(&d->n_descendants, memory_order_relaxed);
+    stat->max_depth = atomic_load(&d->height);
+    rwlock_rd_unlock(d->parent->lock);
+    return 0;
+}
+
+/*
+ * Memory accounting and compaction.
+ *
+ * Both visit the subtree one directory at a time:
+ * each directory is found from the root again, locked only
+ * while it is processed, and paths of its children are copied
+ * before it is released (like in tree_glob). So they never hold
+ * more than two locks, and directories created, removed or moved
+ * concurrently may or may not be visited.
+ */
+
+// Returns NULL-terminated array of paths of children of `d` at `path`.
+// `d` must be read-locked. Children with paths too long
+// to be looked up (see is_path_valid) are skipped.
+char **dir_child_paths(Directory *d, const char *path) {
+    char **paths = malloc((hmap_size(d->subdirs) + 1) * sizeof(char *));
+    if (!paths) syserr("memory alloc failed!");
+
+    size_t path_len = strlen(path);
+    size_t n = 0;
+    NameId subdir_name;
+    Directory *subdir;
+    HashMapIterator it = hmap_iterator(d->subdirs);
+    while (hmap_next(d->subdirs, &it, &subdir_name, (void **) &subdir)) {
+        size_t len = name_len(subdir_name);
+        if (path_len + len + 1 > MAX_PATH_LENGTH) continue;
+        char *child_path = malloc(path_len + len + 2);
+        if (!child_path) syserr("memory alloc failed!");
+        memcpy(child_path, path, path_len);
+        memcpy(child_path + path_len, name_str(subdir_name), len);
+        child_path[path_len + len] = '/';
+        child_path[path_len + len + 1] = '\0';
+        paths[n++] = child_path;
+    }
+    paths[n] = NULL;
+    return paths;
+}
+
+static void memory_visit(Tree *tree, const char *path, TreeMemory *mem) {
+    Directory *d = NULL;
+    if (tree_find(&d, tree, path)) return; // Removed concurrently.
+    rwlock_rd_lock(d->lock);
+    rwlock_rd_unlock(d->parent->lock);
+
+    mem->n_directories++;
+    mem->node_bytes += sizeof(Directory);
+    mem->map_bytes += hmap_memory(d->subdirs);
+    mem->lock_bytes += rwlock_size();
+    char **children = dir_child_paths(d, path);
+    rwlock_rd_unlock(d->lock);
+
+    for (char **child = children; *child; ++child) {
+        memory_visit(tree, *child, mem);
+        free(*child);
+    }
+    free(children);
+}
+
+// Sums up memory used by the subtree at given path.
+int tree_memory(Tree *tree, const char *path, TreeMemory *mem) {
+    assert(tree && mem);
+    if (!is_path_valid(path)) return EINVAL;
+
+    memset(mem, 0, sizeof(TreeMemory));
+    memory_visit(tree, path, mem);
+    if (mem->n_directories == 0) return ENOENT;
+    mem->total_bytes = mem->node_bytes + mem->map_bytes + mem->lock_bytes;
+    return 0;
+}
+
+// Replaces the child index of directory at `path` with its compact copy.
+// The copy is made while the directory is only read-locked;
+// the write lock is taken just to swap the indexes, and only if
+// the index has not changed in the meantime.
+// Then does the same for its subtree. Returns number of bytes saved.
+static size_t compact_visit(Tree *tree, const char *path) {
+    Directory *d = NULL;
+    if (tree_find(&d, tree, path)) return 0; // Removed concurrently.
+    // The parent stays read-locked, so `d` can't be removed or moved.
+    rwlock_rd_lock(d->lock);
+    HashMap *copy = hmap_compact(d->subdirs);
+    size_t modifications = hmap_modifications(d->subdirs);
+    char **children = dir_child_paths(d, path);
+    rwlock_rd_unlock(d->lock);
+
+    size_t saved = 0;
+    if (copy) {
+        HashMap *old = copy;
+        rwlock_wr_lock(d->lock);
+        if (hmap_modifications(d->subdirs) == modifications) {
+            old = d->subdirs;
+            d->subdirs = copy;
+            size_t before = hmap_memory(old), after = hmap_memory(copy);
+            if (before > after) saved = before - after;
+        }
+        rwlock_wr_unlock(d->lock);
+        hmap_free(old);
+    }
+    rwlock_rd_unlock(d->parent->lock);
+
+    for (char **child = children; *child; ++child) {
+        saved += compact_visit(tree, *child);
+        free(*child);
+    }
+    free(children);
+    return saved;
+}
+
+// Compacts child indexes of all directories, one at a time,
+// then returns free memory to the operating system where possible.
+size_t tree_compact(Tree *tree) {
+    assert(tree != NULL);
+    size_t saved = compact_visit(tree, "/");
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    return saved;
+}
+
+// Subscribes to changes of directory at given path
+// (and its whole subtree, if `recursive`).
+// The watch follows the path, not the directory: it does not
+// need the directory to exist and is not affected by its moves.
+TreeWatch *tree_watch(Tree *tree, const char *path, bool recursive) {
+    assert(tree != NULL);
+    if (!is_path_valid(path)) return NULL;
+    return watch_add(tree->watches, path, recursive, WATCH_CAPACITY);
+}
+
+size_t tree_watch_read(TreeWatch *watch, TreeEvent *events, size_t max_events) {
+    assert(watch && events);
+    return watch_read(watch, events, max_events);
+}
+
+void tree_unwatch(Tree *tree, TreeWatch *watch) {
+    assert(tree && watch);
+    watch_remove(tree->watches, watch);
+}
+
 void tree_free(Tree *tree) {
     assert(tree != NULL);
+    watch_list_free(tree->watches);
     dir_free(tree->root->parent);
     dir_free(tree->root);
     free(tree);
 }
+
+/*
+ * Parallel teardown.
+ *
+ * The tree is cut into subtrees of about n / (FREE_TASKS_PER_THREAD * n_threads)
+ * directories (n being the size of the tree, known from the statistics):
+ * directories with larger subtrees are freed up front, by the calling thread,
+ * and the subtrees hanging below them become tasks, which the threads take
+ * one by one and free with dir_free. Nothing is locked, as nobody else
+ * may use the tree anymore.
+ */
+
+#define FREE_TASKS_PER_THREAD 4
+
+typedef struct FreeTasks FreeTasks;
+
+struct FreeTasks {
+    Directory **tasks;
+    size_t n_tasks;
+    atomic_size_t next_task;
+};
+
+static void *free_worker(void *arg) {
+    FreeTasks *f = arg;
+    size_t task;
+    while ((task = atomic_fetch_add(&f->next_task, 1)) < f->n_tasks) {
+        dir_free(f->tasks[task]);
+    }
+    return NULL;
+}
+
+void tree_free_parallel(Tree *tree, size_t n_threads) {
+    assert(tree != NULL);
+    size_t n = atomic_load_explicit(&tree->root->n_descendants, memory_order_relaxed) + 1;
+    size_t task_size = n / (FREE_TASKS_PER_THREAD * (n_threads ? n_threads : 1));
+    if (n_threads <= 1 || task_size == 0) {
+        tree_free(tree);
+        return;
+    }
+
+    watch_list_free(tree->watches);
+    dir_free(tree->root->parent);
+
+    FreeTasks f = {.tasks = NULL, .n_tasks = 0};
+    SlabRun run = {NULL, 0};
+    size_t cap_tasks = 0, cap = 64, n_big = 1;
+    Directory **big = malloc(cap * sizeof(Directory *));
+    if (!big) syserr("memory alloc failed!");
+    big[0] = tree->root;
+    while (n_big > 0) {
+        Directory *d = big[--n_big];
+        if (atomic_load_explicit(&d->n_descendants, memory_order_relaxed) + 1 <= task_size) {
+            if (f.n_tasks == cap_tasks) {
+                cap_tasks = cap_tasks ? 2 * cap_tasks : 64;
+                f.tasks = realloc(f.tasks, cap_tasks * sizeof(Directory *));
+                if (!f.tasks) syserr("memory alloc failed!");
+            }
+            f.tasks[f.n_tasks++] = d;
+        } else {
+            n_big = dir_free_one(d, &big, n_big, &cap, &run);
+        }
+    }
+    slab_run_end(&run);
+    free(big);
+
+    atomic_init(&f.next_task, 0);
+    if (n_threads > f.n_tasks) n_threads = f.n_tasks;
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+    if (!threads) syserr("memory alloc failed!");
+    for (size_t i = 0; i < n_threads; ++i) {
+        if (pthread_create(&threads[i], NULL, free_worker, &f) != 0) syserr("pthread_create failed");
+    }
+    for (size_t i = 0; i < n_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(f.tasks);
+    free(tree);
+}
+
+void tree_free_at_exit(Tree *tree) {
+    assert(tree != NULL);
+    watch_list_free(tree->watches);
+    free(tree);
+}
+
+// ----------------------------------------------
+
+/*
+ * Glob search.
+ *
+ * The pattern is compiled into a list of components and matched
+ * like an NFA: each visited directory carries the set of pattern
+ * positions that are still alive for it ("states").
+ * Position `n_comps` means the whole pattern has been consumed,
+ * so the directory itself is a match.
+ * A directory whose children produce no alive states is not entered,
+ * which prunes non-matching branches early.
+ *
+ * Only one directory is read-locked while it is being expanded
+ * (apart from the usual hand-over-hand step leading to it).
+ * Matching children are copied out, the lock is released, and each
+ * child is found again from the root before it is expanded.
+ * Thus, the glob never pins a whole path of ancestors,
+ * at the cost of an O(depth) lookup per entered directory.
+ * Directories removed in the meantime are silently skipped.
+ *
+ * Children are visited in sorted order and '/' sorts before
+ * any folder name character, so matches are produced
+ * in lexicographic order of their paths.
+ */
+
+typedef struct Glob Glob;
+
+struct Glob {
+    Tree *tree;
+    size_t n_comps;
+    char **comps; // Pattern components (without '/').
+    NameId *comp_ids; // Ids of literal components, NAME_NONE if not interned yet, maybe stale.
+    tree_glob_fn callback;
+    void *arg;
+    atomic_bool *stop; // Set when the search should be abandoned.
+};
+
+typedef struct GlobNode GlobNode;
+
+// Directory (given by its path) yet to be visited.
+struct GlobNode {
+    char *path;
+    bool *states; // n_comps + 1 alive pattern positions.
+};
+
+static bool glob_is_recursive(Glob *g, size_t i) {
+    return i < g->n_comps && strcmp(g->comps[i], "**") == 0;
+}
+
+static bool glob_is_literal(Glob *g, size_t i) {
+    return !strchr(g->comps[i], '*') && !strchr(g->comps[i], '?');
+}
+
+// Marks position `i` alive, together with positions
+// reachable from it through "**" matching zero folders.
+static void glob_add_state(Glob *g, bool *states, size_t i) {
+    while (!states[i]) {
+        states[i] = true;
+        if (!glob_is_recursive(g, i)) break;
+        ++i;
+    }
+}
+
+static bool *glob_new_states(Glob *g) {
+    bool *states = calloc(g->n_comps + 1, sizeof(bool));
+    if (!states) syserr("memory alloc failed!");
+    return states;
+}
+
+// Returns states of child `name` of a directory in `states`,
+// or NULL if the child cannot lead to any match.
+static bool *glob_step(Glob *g, const bool *states, const char *name) {
+    bool *next = NULL;
+    for (size_t i = 0; i < g->n_comps; ++i) {
+        if (!states[i]) continue;
+        size_t to;
+        if (glob_is_recursive(g, i)) to = i;
+        else if (match_component(g->comps[i], name)) to = i + 1;
+        else continue;
+
+        if (!next) next = glob_new_states(g);
+        glob_add_state(g, next, to);
+    }
+    return next;
+}
+
+static int compare_names(const void *p1, const void *p2) {
+    return strcmp(*(const char **) p1, *(const char **) p2);
+}
+
+// Collects children of `d` (with path `path`) which can still match,
+// in sorted order. `d` must be read-locked. Children with paths
+// too long to be looked up are skipped.
+// Returns number of collected children.
+static size_t glob_children(Glob *g, Directory *d, const char *path,
+                            const bool *states, GlobNode **out) {
+    bool only_literals = true;
+    size_t n_literals = 0;
+    for (size_t i = 0; i < g->n_comps; ++i) {
+        if (!states[i]) continue;
+        if (glob_is_literal(g, i)) ++n_literals;
+        else only_literals = false;
+    }
+
+    // With literal components only, look the names up directly
+    // instead of scanning the whole directory.
+    const char **names;
+    if (only_literals) {
+        names = calloc(n_literals + 1, sizeof(char *));
+        if (!names) syserr("memory alloc failed!");
+        size_t n = 0;
+        for (size_t i = 0; i < g->n_comps; ++i) {
+            if (!states[i]) continue;
+            NameId id = g->comp_ids[i];
+            if (id == NAME_NONE) id = name_find(g->comps[i], strlen(g->comps[i]));
+            if (hmap_get(d->subdirs, id)) names[n++] = g->comps[i];
+        }
+        qsort(names, n, sizeof(char *), compare_names);
+        names[n] = NULL;
+    } else {
+        names = make_map_contents_array(d->subdirs);
+        if (!names) syserr("memory alloc failed!");
+    }
+
+    size_t n_names = 0;
+    while (names[n_names]) ++n_names;
+    GlobNode *children = malloc((n_names + 1) * sizeof(GlobNode));
+    if (!children) syserr("memory alloc failed!");
+
+    size_t path_len = strlen(path);
+    size_t n = 0;
+    for (size_t i = 0; i < n_names; ++i) {
+        if (i > 0 && strcmp(names[i - 1], names[i]) == 0) continue;
+        size_t name_len = strlen(names[i]);
+        // Too long to be looked up, as in dir_child_paths().
+        if (path_len + name_len + 1 > MAX_PATH_LENGTH) continue;
+        bool *next = glob_step(g, states, names[i]);
+        if (!next) continue;
+
+        char *child_path = malloc(path_len + name_len + 2);
+        if (!child_path) syserr("memory alloc failed!");
+        memcpy(child_path, path, path_len);
+        memcpy(child_path + path_len, names[i], name_len);
+        child_path[path_len + name_len] = '/';
+        child_path[path_len + name_len + 1] = '\0';
+
+        children[n].path = child_path;
+        children[n].states = next;
+        ++n;
+    }
+    free(names);
+    *out = children;
+    return n;
+}
+
+// Read-locks directory at `node->path`, collects its matching children
+// and releases it. Sets `*matched` if the directory itself matches.
+// Returns -1 if the directory no longer exists.
+static ssize_t glob_expand(Glob *g, const GlobNode *node, bool *matched, GlobNode **out) {
+    Directory *d = NULL;
+    if (tree_find(&d, g->tree, node->path)) return -1;
+    rwlock_rd_lock(d->lock);
+    rwlock_rd_unlock(d->parent->lock);
+
+    size_t n = glob_children(g, d, node->path, node->states, out);
+    rwlock_rd_unlock(d->lock);
+    *matched = node->states[g->n_comps];
+    return n;
+}
+
+static void glob_node_free(GlobNode *node) {
+    free(node->path);
+    free(node->states);
+}
+
+// Visits subtree at `node` depth-first, reporting matches in order.
+static int glob_visit(Glob *g, const GlobNode *node) {
+    if (g->stop && atomic_load(g->stop)) return 0;
+
+    GlobNode *children = NULL;
+    bool matched = false;
+    ssize_t n = glob_expand(g, node, &matched, &children);
+    if (n < 0) return 0; // Removed concurrently.
+
+    int ret = matched ? g->callback(node->path, g->arg) : 0;
+    for (ssize_t i = 0; i < n; ++i) {
+        if (!ret) ret = glob_visit(g, &children[i]);
+        glob_node_free(&children[i]);
+    }
+    free(children);
+    return ret;
+}
+
+static bool glob_init(Glob *g, Tree *tree, const char *pattern,
+                      tree_glob_fn callback, void *arg) {
+    if (!is_pattern_valid(pattern)) return false;
+
+    g->tree = tree;
+    g->callback = callback;
+    g->arg = arg;
+    g->stop = NULL;
+    g->n_comps = 0;
+    for (const char *p = pattern + 1; *p; ++p) {
+        if (*p == '/') ++g->n_comps;
+    }
+    g->comps = malloc((g->n_comps + 1) * sizeof(char *));
+    g->comp_ids = malloc((g->n_comps + 1) * sizeof(NameId));
+    if (!g->comps || !g->comp_ids) syserr("memory alloc failed!");
+
+    char comp[MAX_FOLDER_NAME_LENGTH + 1];
+    const char *subpattern = pattern;
+    size_t n = 0;
+    while ((subpattern = split_path(subpattern, comp))) {
+        // Consecutive "**" are equivalent to a single one.
+        if (strcmp(comp, "**") == 0 && n > 0 && strcmp(g->comps[n - 1], "**") == 0) continue;
+        g->comps[n] = strdup(comp);
+        if (!g->comps[n]) syserr("memory alloc failed!");
+        g->comp_ids[n] = glob_is_literal(g, n) ? name_find(comp, strlen(comp)) : NAME_NONE;
+        ++n;
+    }
+    g->n_comps = n;
+    return true;
+}
+
+static void glob_destroy(Glob *g) {
+    for (size_t i = 0; i < g->n_comps; ++i) {
+        free(g->comps[i]);
+    }
+    free(g->comps);
+    free(g->comp_ids);
+}
+
+static GlobNode glob_root(Glob *g) {
+    GlobNode root;
+    root.path = strdup("/");
+    if (!root.path) syserr("memory alloc failed!");
+    root.states = glob_new_states(g);
+    glob_add_state(g, root.states, 0);
+    return root;
+}
+
+int tree_glob(Tree *tree, const char *pattern, tree_glob_fn callback, void *arg) {
+    assert(tree && pattern && callback);
+    Glob g;
+    if (!glob_init(&g, tree, pattern, callback, arg)) return EINVAL;
+
+    GlobNode root = glob_root(&g);
+    int ret = glob_visit(&g, &root);
+    glob_node_free(&root);
+    glob_destroy(&g);
+    return ret;
+}
+
+/*
+ * Parallel glob.
+ *
+ * The calling thread expands the pattern breadth-first
+ * until there are enough subtrees to keep all workers busy.
+ * The resulting frontier is a preorder sequence of tasks:
+ * either a single match to report, or a whole subtree to search.
+ * Workers claim subtree tasks in order and buffer their matches.
+ * The calling thread reports the tasks' matches in frontier order
+ * as soon as each task is finished, so the output stays sorted
+ * and only matches of not-yet-reported subtrees are kept in memory.
+ */
+
+typedef struct GlobTask GlobTask;
+
+struct GlobTask {
+    GlobNode node;
+    bool subtree; // Search whole subtree, or just report node.path.
+    bool done;
+    char **matches;
+    size_t n_matches;
+    size_t cap_matches;
+};
+
+typedef struct GlobPool GlobPool;
+
+struct GlobPool {
+    Glob *glob;
+    GlobTask *tasks;
+    size_t n_tasks;
+    size_t next_task;
+    atomic_bool stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t task_done;
+};
+
+static int glob_task_collect(const char *path, void *arg) {
+    GlobTask *task = arg;
+    if (task->n_matches == task->cap_matches) {
+        task->cap_matches = task->cap_matches ? 2 * task->cap_matches : 16;
+        task->matches = realloc(task->matches, task->cap_matches * sizeof(char *));
+        if (!task->matches) syserr("memory alloc failed!");
+    }
+    task->matches[task->n_matches] = strdup(path);
+    if (!task->matches[task->n_matches]) syserr("memory alloc failed!");
+    ++task->n_matches;
+    return 0;
+}
+
+static void *glob_worker(void *arg) {
+    GlobPool *pool = arg;
+    Glob g = *pool->glob;
+    g.callback = glob_task_collect;
+    g.stop = &pool->stop;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->next_task < pool->n_tasks) {
+        GlobTask *task = &pool->tasks[pool->next_task++];
+        if (!task->subtree) continue;
+        pthread_mutex_unlock(&pool->mutex);
+
+        g.arg = task;
+        glob_visit(&g, &task->node);
+
+        pthread_mutex_lock(&pool->mutex);
+        task->done = true;
+        pthread_cond_broadcast(&pool->task_done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static void glob_task_free(GlobTask *task) {
+    glob_node_free(&task->node);
+    for (size_t i = 0; i < task->n_matches; ++i) {
+        free(task->matches[i]);
+    }
+    free(task->matches);
+}
+
+// Replaces every subtree task of the frontier with its expansion.
+// Returns the new number of subtree tasks.
+static size_t glob_expand_frontier(Glob *g, GlobTask **tasks, size_t *n_tasks) {
+    size_t cap = *n_tasks;
+    size_t n = 0;
+    size_t n_subtrees = 0;
+    GlobTask *next = malloc(cap * sizeof(GlobTask));
+    if (!next) syserr("memory alloc failed!");
+
+    for (size_t i = 0; i < *n_tasks; ++i) {
+        GlobTask *task = &(*tasks)[i];
+        GlobNode *children = NULL;
+        bool matched = false;
+        ssize_t n_children = task->subtree ? glob_expand(g, &task->node, &matched, &children) : 0;
+        if (n_children < 0) {
+            glob_task_free(task);
+            continue;
+        }
+
+        size_t needed = n + 1 + n_children;
+        if (needed > cap) {
+            cap = 2 * needed;
+            next = realloc(next, cap * sizeof(GlobTask));
+            if (!next) syserr("memory alloc failed!");
+        }
+
+        if (!task->subtree || matched) {
+            next[n] = *task;
+            next[n].subtree = false;
+            ++n;
+        } else {
+            glob_task_free(task);
+        }
+        for (ssize_t j = 0; j < n_children; ++j) {
+            memset(&next[n], 0, sizeof(GlobTask));
+            next[n].node = children[j];
+            next[n].subtree = true;
+            ++n;
+            ++n_subtrees;
+        }
+        free(children);
+    }
+    free(*tasks);
+    *tasks = next;
+    *n_tasks = n;
+    return n_subtrees;
+}
+
+int tree_glob_parallel(Tree *tree, const char *pattern, tree_glob_fn callback, void *arg,
+                       size_t n_threads) {
+    assert(tree && pattern && callback);
+    if (n_threads <= 1) return tree_glob(tree, pattern, callback, arg);
+
+    Glob g;
+    if (!glob_init(&g, tree, pattern, callback, arg)) return EINVAL;
+
+    GlobPool pool;
+    pool.glob = &g;
+    pool.n_tasks = 1;
+    pool.next_task = 0;
+    atomic_init(&pool.stop, false);
+    pool.tasks = calloc(1, sizeof(GlobTask));
+    if (!pool.tasks) syserr("memory alloc failed!");
+    pool.tasks[0].node = glob_root(&g);
+    pool.tasks[0].subtree = true;
+
+    size_t n_subtrees = 1;
+    while (n_subtrees > 0 && n_subtrees < n_threads) {
+        n_subtrees = glob_expand_frontier(&g, &pool.tasks, &pool.n_tasks);
+    }
+
+    if (pthread_mutex_init(&pool.mutex, 0) != 0) syserr("mutex init failed");
+    if (pthread_cond_init(&pool.task_done, 0) != 0) syserr("cond init failed");
+
+    if (n_threads > n_subtrees) n_threads = n_subtrees;
+    pthread_t *threads = malloc((n_threads + 1) * sizeof(pthread_t));
+    if (!threads) syserr("memory alloc failed!");
+    for (size_t i = 0; i < n_threads; ++i) {
+        if (pthread_create(&threads[i], NULL, glob_worker, &pool) != 0) syserr("pthread_create failed");
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < pool.n_tasks && !ret; ++i) {
+        GlobTask *task = &pool.tasks[i];
+        if (!task->subtree) {
+            ret = callback(task->node.path, arg);
+            continue;
+        }
+        pthread_mutex_lock(&pool.mutex);
+        while (!task->done) {
+            pthread_cond_wait(&pool.task_done, &pool.mutex);
+        }
+        pthread_mutex_unlock(&pool.mutex);
+        for (size_t j = 0; j < task->n_matches && !ret; ++j) {
+            ret = callback(task->matches[j], arg);
+        }
+    }
+    atomic_store(&pool.stop, true);
+
+    for (size_t i = 0; i < n_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    for (size_t i = 0; i < pool.n_tasks; ++i) {
+        glob_task_free(&pool.tasks[i]);
+    }
+    free(pool.tasks);
+    pthread_cond_destroy(&pool.task_done);
+    pthread_mutex_destroy(&pool.mutex);
+    glob_destroy(&g);
+    return ret;
+}
+
+// ----------------------------------------------
+
+/*
+ * Transactions.
+ *
+ * A transaction applies a list of operations atomically.
+ * Every directory the operations touch is write-locked first
+ * (each one exactly once), then the operations are applied
+ * one by one. If any of them fails, the already applied ones
+ * are undone in reverse order before anything is released,
+ * so other threads never observe intermediate states.
+ *
+ * Locks are taken top-down:
+ * the common ancestor of all paths is found and write-locked,
+ * (tree traversal lock type: READ)
+ * then the paths below it are locked depth-first, in sorted order.
+ * (Tree traversal lock type: WRITE.)
+ * A directory where the paths branch is kept locked
+ * until all its branches are locked, and released afterwards
+ * unless an operation needs it.
+ * Moved directories are locked with their whole subtrees,
+ * just like in dir_move().
+ *
+ * A path which does not exist yet (because an earlier
+ * operation of the transaction creates or moves it there)
+ * is covered by its deepest existing directory:
+ * while that one is locked, nothing below it can be reached
+ * by other threads.
+ *
+ * While applying, paths are resolved through the "view":
+ * locked directories with their current paths.
+ * Walking down from a view directory only visits directories
+ * locked or created by the transaction.
+ */
+
+typedef struct TxnLock TxnLock;
+
+// Path which has to be locked.
+struct TxnLock {
+    char *path;
+    bool subtree; // Lock the whole subtree.
+};
+
+typedef struct TxnView TxnView;
+
+struct TxnView {
+    char *path;
+    Directory *dir;
+};
+
+typedef struct TxnUndo TxnUndo;
+
+// Applied operation, with everything needed to undo it.
+struct TxnUndo {
+    const TreeTxnOp *op;
+    Directory *parent; // Parent of op->path.
+    Directory *target_parent; // Parent of op->target.
+    Directory *dir; // Removed or moved directory.
+    NameId name; // Removes and moves hold on to it until the end.
+    NameId target_name; // Interned by moves.
+};
+
+typedef struct Txn Txn;
+
+struct Txn {
+    Tree *tree;
+    Directory **held; // Write-locked directories.
+    size_t n_held;
+    size_t cap_held;
+    TxnView *view;
+    size_t n_view;
+    size_t cap_view;
+    TxnUndo *undo; // One per applied operation.
+    size_t n_undo;
+    const char **detached; // Paths whose parents have become lower.
+    size_t n_detached;
+    size_t cap_detached;
+};
+
+// Makes room for one more element of a dynamic array.
+static void *txn_grow(void *array, size_t n, size_t *cap, size_t elem_size) {
+    if (n < *cap) return array;
+    *cap = *cap ? 2 * *cap : 8;
+    array = realloc(array, *cap * elem_size);
+    if (!array) syserr("memory alloc failed!");
+    return array;
+}
+
+static void txn_hold(Txn *txn, Directory *d) {
+    txn->held = txn_grow(txn->held, txn->n_held, &txn->cap_held, sizeof(Directory *));
+    txn->held[txn->n_held++] = d;
+}
+
+static void txn_release(Txn *txn, Directory *d) {
+    size_t i = txn->n_held;
+    while (txn->held[--i] != d) {}
+    txn->held[i] = txn->held[--txn->n_held];
+    rwlock_wr_unlock(d->lock);
+}
+
+static void txn_view_add(Txn *txn, const char *path, size_t path_len, Directory *d) {
+    txn->view = txn_grow(txn->view, txn->n_view, &txn->cap_view, sizeof(TxnView));
+    char *copy = strndup(path, path_len);
+    if (!copy) syserr("memory alloc failed!");
+    txn->view[txn->n_view].path = copy;
+    txn->view[txn->n_view].dir = d;
+    ++txn->n_view;
+}
+
+static void txn_detached(Txn *txn, const char *path) {
+    txn->detached = txn_grow(txn->detached, txn->n_detached, &txn->cap_detached, sizeof(char *));
+    txn->detached[txn->n_detached++] = path;
+}
+
+// Write-locks whole subtree below write-locked `d`.
+// Like tree_lock_subtree() with DIR_LOCK_OPS, settles pending height repairs on the way.
+static void txn_lock_subtree(Txn *txn, Directory *d) {
+    NameId subdir_name;
+    Directory *subdir;
+    HashMapIterator it = hmap_iterator(d->subdirs);
+    while (hmap_next(d->subdirs, &it, &subdir_name, (void **) &subdir)) {
+        rwlock_wr_lock(subdir->lock);
+        txn_hold(txn, subdir);
+        txn_lock_subtree(txn, subdir);
+    }
+    atomic_store(&d->height, dir_scan_height(d));
+}
+
+// Locks `locks` (sorted, all of them subpaths of `d_path`)
+// below write-locked directory `d` at `d_path`.
+// `d` stays locked only if some operation needs it.
+static void txn_lock_below(Txn *txn, Directory *d, const char *d_path,
+                           TxnLock *locks, size_t n_locks) {
+    size_t d_len = strlen(d_path);
+    bool keep = false;
+    size_t i = 0;
+    if (n_locks > 0 && strcmp(locks[0].path, d_path) == 0) {
+        keep = true;
+        if (locks[0].subtree) {
+            // Everything below is covered.
+            txn_lock_subtree(txn, d);
+            txn_view_add(txn, d_path, d_len, d);
+            return;
+        }
+        i = 1;
+    }
+
+    while (i < n_locks) {
+        // Group paths going through the same child of `d`.
+        const char *first = locks[i].path + d_len;
+        size_t name_len = strchr(first, '/') - first;
+        size_t j = i + 1;
+        while (j < n_locks && strncmp(locks[j].path + d_len, first, name_len + 1) == 0) {
+            ++j;
+        }
+
+        // Descend to the directory where the group branches.
+        char *common = make_common_path(locks[i].path, locks[j - 1].path);
+        NameId name;
+        const char *subpath = common + d_len - 1;
+        size_t g_len = d_len;
+        Directory *g = d;
+        while ((subpath = split_path_id(subpath, &name))) {
+            Directory *child = hmap_get(g->subdirs, name);
+            if (!child) break;
+            rwlock_wr_lock(child->lock);
+            txn_hold(txn, child);
+            if (g != d) txn_release(txn, g);
+            g = child;
+            g_len = subpath - common + 1;
+        }
+
+        if (!subpath) {
+            txn_lock_below(txn, g, common, locks + i, j - i);
+        } else if (g == d) {
+            // The group does not exist yet, `d` covers it.
+            keep = true;
+        } else {
+            txn_view_add(txn, common, g_len, g);
+        }
+        free(common);
+        i = j;
+    }
+
+    if (keep) txn_view_add(txn, d_path, d_len, d);
+    else txn_release(txn, d);
+}
+
+static int compare_txn_locks(const void *p1, const void *p2) {
+    return strcmp(((const TxnLock *) p1)->path, ((const TxnLock *) p2)->path);
+}
+
+static void txn_plan(TxnLock **locks, size_t *n_locks, size_t *cap_locks,
+                     char *path, bool subtree) {
+    if (!path) return; // Parent of "/", the operation will fail.
+    *locks = txn_grow(*locks, *n_locks, cap_locks, sizeof(TxnLock));
+    (*locks)[*n_locks].path = path;
+    (*locks)[*n_locks].subtree = subtree;
+    ++*n_locks;
+}
+
+static char *txn_strdup(const char *path) {
+    char *copy = strdup(path);
+    if (!copy) syserr("memory alloc failed!");
+    return copy;
+}
+
+// Write-locks everything the operations need.
+static void txn_lock(Txn *txn, const TreeTxnOp *ops, size_t n_ops) {
+    TxnLock *locks = NULL;
+    size_t n_locks = 0;
+    size_t cap_locks = 0;
+    for (size_t i = 0; i < n_ops; ++i) {
+        const TreeTxnOp *op = &ops[i];
+        txn_plan(&locks, &n_locks, &cap_locks, make_path_to_parent(op->path, NULL), false);
+        if (op->type == TREE_TXN_REMOVE && strcmp(op->path, "/") != 0) {
+            txn_plan(&locks, &n_locks, &cap_locks, txn_strdup(op->path), false);
+        } else if (op->type == TREE_TXN_MOVE) {
+            txn_plan(&locks, &n_locks, &cap_locks, make_path_to_parent(op->target, NULL), false);
+            if (strcmp(op->path, "/") != 0) {
+                txn_plan(&locks, &n_locks, &cap_locks, txn_strdup(op->path), true);
+            }
+        }
+    }
+    if (n_locks == 0) return;
+
+    // Merge duplicates.
+    qsort(locks, n_locks, sizeof(TxnLock), compare_txn_locks);
+    size_t n = 1;
+    for (size_t i = 1; i < n_locks; ++i) {
+        if (strcmp(locks[n - 1].path, locks[i].path) == 0) {
+            locks[n - 1].subtree |= locks[i].subtree;
+            free(locks[i].path);
+        } else {
+            locks[n++] = locks[i];
+        }
+    }
+    n_locks = n;
+
+    // Sorted paths: the first and the last one have the common ancestor of all.
+    char *common_path = make_common_path(locks[0].path, locks[n_locks - 1].path);
+    Directory *common = NULL;
+    while (tree_find(&common, txn->tree, common_path) == ENOENT) {
+        char *parent_path = make_path_to_parent(common_path, NULL);
+        free(common_path);
+        common_path = parent_path;
+    }
+    rwlock_wr_lock(common->lock);
+    rwlock_rd_unlock(common->parent->lock);
+    txn_hold(txn, common);
+    txn_lock_below(txn, common, common_path, locks, n_locks);
+
+    free(common_path);
+    for (size_t i = 0; i < n_locks; ++i) {
+        free(locks[i].path);
+    }
+    free(locks);
+}
+
+// Finds directory at `path`, as seen by the transaction.
+static Directory *txn_resolve(Txn *txn, const char *path) {
+    TxnView *best = NULL;
+    size_t best_len = 0;
+    for (size_t i = 0; i < txn->n_view; ++i) {
+        size_t len = strlen(txn->view[i].path);
+        if (len > best_len && strncmp(txn->view[i].path, path, len) == 0) {
+            best = &txn->view[i];
+            best_len = len;
+        }
+    }
+    if (!best) return NULL;
+
+    NameId name;
+    const char *subpath = path + best_len - 1;
+    Directory *d = best->dir;
+    while (d && (subpath = split_path_id(subpath, &name))) {
+        d = hmap_get(d->subdirs, name);
+    }
+    return d;
+}
+
+// Updates the view after directory at `source` is moved to `target`
+// (or removed, if `target` is NULL).
+static void txn_view_move(Txn *txn, const char *source, const char *target) {
+    size_t source_len = strlen(source);
+    for (size_t i = 0; i < txn->n_view; ++i) {
+        char *path = txn->view[i].path;
+        if (strncmp(path, source, source_len) != 0) continue;
+        if (target) {
+            size_t target_len = strlen(target);
+            char *moved = malloc(target_len + strlen(path + source_len) + 1);
+            if (!moved) syserr("memory alloc failed!");
+            strcpy(moved, target);
+            strcpy(moved + target_len, path + source_len);
+            txn->view[i].path = moved;
+        } else {
+            txn->view[i] = txn->view[--txn->n_view];
+            --i;
+        }
+        free(path);
+    }
+}
+
+static int txn_create(Txn *txn, TxnUndo *undo) {
+    const char *path = undo->op->path;
+    if (strcmp(path, "/") == 0) return EEXIST;
+
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    char *parent_path = make_path_to_parent(path, name);
+    undo->parent = txn_resolve(txn, parent_path);
+    free(parent_path);
+    if (!undo->parent) return ENOENT;
+    if (hmap_get(undo->parent->subdirs, name_find(name, strlen(name)))) return EEXIST;
+    undo->name = name_intern(name, strlen(name));
+    int err = dir_create(undo->parent, undo->name);
+    if (err) name_release(undo->name);
+    return err;
+}
+
+static int txn_remove(Txn *txn, TxnUndo *undo) {
+    const char *path = undo->op->path;
+    if (strcmp(path, "/") == 0) return EBUSY;
+
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    char *parent_path = make_path_to_parent(path, name);
+    undo->parent = txn_resolve(txn, parent_path);
+    free(parent_path);
+    if (!undo->parent) return ENOENT;
+
+    undo->name = name_find(name, strlen(name));
+    undo->dir = hmap_get(undo->parent->subdirs, undo->name);
+    if (!undo->dir) return ENOENT;
+    if (hmap_size(undo->dir->subdirs) > 0) return ENOTEMPTY;
+
+    if (dir_unlink(undo->parent, undo->name)) txn_detached(txn, path);
+    txn_view_move(txn, path, NULL);
+    return 0;
+}
+
+static int txn_move(Txn *txn, TxnUndo *undo) {
+    const char *source = undo->op->path;
+    const char *target = undo->op->target;
+    if (strcmp(source, "/") == 0) return EBUSY;
+    if (strcmp(target, "/") == 0) return EEXIST;
+    if (is_subpath(target, source)) return EMOVE;
+
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+    char target_name[MAX_FOLDER_NAME_LENGTH + 1];
+    char *source_parent_path = make_path_to_parent(source, name);
+    char *target_parent_path = make_path_to_parent(target, target_name);
+    undo->parent = txn_resolve(txn, source_parent_path);
+    undo->target_parent = txn_resolve(txn, target_parent_path);
+    free(source_parent_path);
+    free(target_parent_path);
+    if (!undo->parent || !undo->target_parent) return ENOENT;
+
+    undo->name = name_find(name, strlen(name));
+    undo->target_name = name_find(target_name, strlen(target_name));
+    undo->dir = hmap_get(undo->parent->subdirs, undo->name);
+    if (!undo->dir) return ENOENT;
+    if (!(undo->parent == undo->target_parent && undo->name == undo->target_name)
+        && hmap_get(undo->target_parent->subdirs, undo->target_name))
+        return EEXIST;
+
+    undo->target_name = name_intern(target_name, strlen(target_name));
+    if (dir_relink(undo->parent, undo->target_parent, undo->name, undo->target_name, undo->dir)) {
+        txn_detached(txn, source);
+    }
+    txn_view_move(txn, source, target);
+    return 0;
+}
+
+static void txn_undo(Txn *txn, TxnUndo *undo) {
+    switch (undo->op->type) {
+        case TREE_TXN_CREATE: {
+            Directory *created = hmap_get(undo->parent->subdirs, undo->name);
+            if (dir_unlink(undo->parent, undo->name)) txn_detached(txn, undo->op->path);
+            dir_free(created);
+            name_release(undo->name);
+            break;
+        }
+        case TREE_TXN_REMOVE:
+            hmap_insert(undo->parent->subdirs, undo->name, undo->dir);
+            dir_add_descendants(undo->parent, 1);
+            dir_raise_height(undo->parent, 0);
+            break;
+        case TREE_TXN_MOVE:
+            if (dir_relink(undo->target_parent, undo->parent,
+                           undo->target_name, undo->name, undo->dir)) {
+                txn_detached(txn, undo->op->target);
+            }
+            name_release(undo->target_name);
+            break;
+    }
+}
+
+static int txn_apply(Txn *txn, TxnUndo *undo) {
+    switch (undo->op->type) {
+        case TREE_TXN_CREATE:
+            return txn_create(txn, undo);
+        case TREE_TXN_REMOVE:
+            return txn_remove(txn, undo);
+        case TREE_TXN_MOVE:
+            return txn_move(txn, undo);
+    }
+    return EINVAL;
+}
+
+static void txn_publish(Txn *txn) {
+    for (size_t i = 0; i < txn->n_undo; ++i) {
+        const TreeTxnOp *op = txn->undo[i].op;
+        switch (op->type) {
+            case TREE_TXN_CREATE:
+                watch_publish(txn->tree->watches, TREE_EVENT_CREATE, op->path, NULL);
+                break;
+            case TREE_TXN_REMOVE:
+                watch_publish(txn->tree->watches, TREE_EVENT_REMOVE, op->path, NULL);
+                break;
+            case TREE_TXN_MOVE:
+                watch_publish(txn->tree->watches, TREE_EVENT_MOVE, op->path, op->target);
+                break;
+        }
+    }
+}
+
+// Applies all operations atomically, in order.
+// Either all of them succeed, or none is applied:
+// the error of the first failing operation is returned
+// and its index is stored in `*failed_op`.
+int tree_txn(Tree *tree, const TreeTxnOp *ops, size_t n_ops, size_t *failed_op) {
+    assert(tree && (ops || n_ops == 0));
+    for (size_t i = 0; i < n_ops; ++i) {
+        if (!is_path_valid(ops[i].path)
+            || (ops[i].type == TREE_TXN_MOVE && !is_path_valid(ops[i].target))) {
+            if (failed_op) *failed_op = i;
+            return EINVAL;
+        }
+    }
+
+    Txn txn;
+    memset(&txn, 0, sizeof(Txn));
+    txn.tree = tree;
+    txn.undo = calloc(n_ops + 1, sizeof(TxnUndo));
+    if (!txn.undo) syserr("memory alloc failed!");
+
+    txn_lock(&txn, ops, n_ops);
+
+    int err = 0;
+    for (size_t i = 0; i < n_ops && !err; ++i) {
+        TxnUndo *undo = &txn.undo[txn.n_undo];
+        undo->op = &ops[i];
+        err = txn_apply(&txn, undo);
+        if (err) {
+            if (failed_op) *failed_op = i;
+        } else {
+            ++txn.n_undo;
+        }
+    }
+
+    if (err) {
+        while (txn.n_undo > 0) {
+            txn_undo(&txn, &txn.undo[--txn.n_undo]);
+        }
+    } else {
+        txn_publish(&txn);
+    }
+
+    while (txn.n_held > 0) {
+        rwlock_wr_unlock(txn.held[--txn.n_held]->lock);
+    }
+    // Removed directories were locked until now. Names left behind
+    // by removes and moves are kept until then too, for undoing them.
+    for (size_t i = 0; i < txn.n_undo; ++i) {
+        if (txn.undo[i].op->type == TREE_TXN_REMOVE) dir_free(txn.undo[i].dir);
+        if (txn.undo[i].op->type != TREE_TXN_CREATE) name_release(txn.undo[i].name);
+    }
+    for (size_t i = 0; i < txn.n_detached; ++i) {
+        // The parent itself was repaired while locked.
+        char *parent_path = make_path_to_parent(txn.detached[i], NULL);
+        dir_repair_heights(tree->root, parent_path);
+        free(parent_path);
+    }
+
+    for (size_t i = 0; i < txn.n_view; ++i) {
+        free(txn.view[i].path);
+    }
+    free(txn.view);
+    free(txn.held);
+    free(txn.detached);
+    free(txn.undo);
+    return err;
+}
+
+// ----------------------------------------------
+
+/*
+ * Bulk load.
+ *
+ * The sorted stream is read into an array first. Since '/' sorts
+ * before any folder name character, it lists the new subtree in preorder:
+ * every directory is directly followed by its whole subtree,
+ * and its parent is the nearest directory before it whose path
+ * is a prefix of its own. One pass with a stack of ancestors finds
+ * the parents, the ends of subtrees and the fan-outs,
+ * one pass backwards the heights.
+ *
+ * The new directories can't be reached by other threads before they are
+ * published, so they are built without any locks, in slabs (see DirSlab)
+ * small enough to be taken from memory malloc has already got,
+ * each with its child index sized to its fan-out.
+ * The largest subtrees small enough to give
+ * each thread BULK_TASKS_PER_THREAD of them (or more) are tasks built by
+ * the workers; the directories above them are allocated by the calling
+ * thread beforehand and linked together with the roots of the tasks afterwards.
+ *
+ * Finally the target directory is write-locked, still empty,
+ * and its child index is replaced with the new one by one pointer store.
+ */
+
+#define BULK_TASKS_PER_THREAD 4
+#define BULK_NO_PARENT SIZE_MAX
+#define BULK_SLAB_BYTES (64 << 10)
+
+typedef struct BulkNode BulkNode;
+
+struct BulkNode {
+    size_t path; // Offset of the path in BulkLoad.paths.
+    size_t path_len;
+    size_t name_start; // Offset of the last component in the path.
+    size_t parent; // Index of the parent, BULK_NO_PARENT for children of the target.
+    size_t end; // Index past the subtree.
+    size_t n_children;
+    size_t height;
+    DirSlab *slab;
+    size_t offset; // Of the memory of the directory in the slab.
+    Directory *dir;
+};
+
+typedef struct BulkLoad BulkLoad;
+
+struct BulkLoad {
+    char *paths; // All paths, with terminating nulls.
+    BulkNode *nodes;
+    size_t n_nodes;
+    size_t n_top; // Children of the target.
+    size_t *tasks; // Roots of subtrees built by workers.
+    size_t n_tasks;
+    atomic_size_t next_task;
+};
+
+static const char *bulk_path(BulkLoad *load, size_t i) {
+    return load->paths + load->nodes[i].path;
+}
+
+// Returns whether the `len` bytes at `name` are a valid folder name followed by '/'.
+static bool is_name_valid(const char *name, size_t len) {
+    if (len < 2 || len - 1 > MAX_FOLDER_NAME_LENGTH || name[len - 1] != '/') return false;
+    for (size_t i = 0; i < len - 1; ++i) {
+        if (name[i] < 'a' || name[i] > 'z') return false;
+    }
+    return true;
+}
+
+// Reads the stream and finds the structure of the new subtree
+// under the directory at `path`. Returns 0, EINVAL or ENOENT.
+static int bulk_read(BulkLoad *load, const char *path, tree_path_iter next, void *arg) {
+    size_t path_len = strlen(path);
+    size_t cap = 0, paths_bytes = 0, paths_cap = 0;
+    size_t *stack = NULL;
+    size_t depth = 0;
+    memset(load, 0, sizeof(BulkLoad));
+
+    int err = 0;
+    const char *p;
+    while ((p = next(arg))) {
+        size_t len = strlen(p);
+        if (len <= path_len || len > MAX_PATH_LENGTH) {
+            err = EINVAL;
+            break;
+        }
+        if (load->n_nodes == cap) {
+            cap = cap ? 2 * cap : 1024;
+            load->nodes = realloc(load->nodes, cap * sizeof(BulkNode));
+            stack = realloc(stack, cap * sizeof(size_t));
+            if (!load->nodes || !stack) syserr("memory alloc failed!");
+        }
+        if (paths_bytes + len + 1 > paths_cap) {
+            paths_cap = 2 * (paths_bytes + len + 1);
+            load->paths = realloc(load->paths, paths_cap);
+            if (!load->paths) syserr("memory alloc failed!");
+        }
+
+        // Listed directories on the stack are prefixes of the previous path,
+        // so those of them not longer than the common prefix are prefixes of `p`.
+        size_t i = load->n_nodes;
+        const char *prev = i > 0 ? bulk_path(load, i - 1) : path;
+        size_t common = 0;
+        while (prev[common] && prev[common] == p[common]) {
+            ++common;
+        }
+        if (common < path_len || (i > 0 && (unsigned char) p[common] <= (unsigned char) prev[common])) {
+            err = EINVAL; // Not below the target, or not after the previous path.
+            break;
+        }
+        while (depth > 0 && load->nodes[stack[depth - 1]].path_len > common) {
+            load->nodes[stack[--depth]].end = i;
+        }
+        BulkNode *node = &load->nodes[i];
+        node->parent = depth > 0 ? stack[depth - 1] : BULK_NO_PARENT;
+        node->name_start = depth > 0 ? load->nodes[node->parent].path_len : path_len;
+        // The prefix up to `name_start` is valid, so only the last component is checked.
+        if (!is_name_valid(p + node->name_start, len - node->name_start)) {
+            err = is_path_valid(p) ? ENOENT : EINVAL; // ENOENT: the parent is neither the target nor listed.
+            break;
+        }
+        node->path = paths_bytes;
+        node->path_len = len;
+        memcpy(load->paths + paths_bytes, p, len + 1);
+        paths_bytes += len + 1;
+        node->n_children = 0;
+        node->height = 0;
+        node->dir = NULL;
+
+        if (node->parent == BULK_NO_PARENT) {
+            load->n_top++;
+        } else {
+            load->nodes[node->parent].n_children++;
+        }
+        stack[depth++] = i;
+        load->n_nodes++;
+    }
+    while (depth > 0) {
+        load->nodes[stack[--depth]].end = load->n_nodes;
+    }
+    free(stack);
+    if (err) {
+        free(load->paths);
+        free(load->nodes);
+        return err;
+    }
+
+    for (size_t i = load->n_nodes; i-- > 0;) {
+        BulkNode *node = &load->nodes[i];
+        if (node->parent == BULK_NO_PARENT) continue;
+        BulkNode *parent = &load->nodes[node->parent];
+        if (node->height + 1 > parent->height) parent->height = node->height + 1;
+    }
+    return 0;
+}
+
+// Allocates slabs for the directories of all nodes.
+static void bulk_new_slabs(BulkLoad *load) {
+    size_t header = align_up(sizeof(DirSlab), RWLOCK_ALIGN);
+    size_t first = 0, bytes = header;
+    for (size_t i = 0; i <= load->n_nodes; ++i) {
+        size_t size = i < load->n_nodes ? dir_footprint(load->nodes[i].n_children) : 0;
+        if (bytes > header && (i == load->n_nodes || bytes + size > BULK_SLAB_BYTES)) {
+            DirSlab *slab = aligned_alloc(RWLOCK_ALIGN, bytes);
+            if (!slab) syserr("memory alloc failed!");
+            atomic_init(&slab->n_live, i - first);
+            for (; first < i; ++first) {
+                load->nodes[first].slab = slab;
+            }
+            bytes = header;
+        }
+        if (i < load->n_nodes) {
+            load->nodes[i].offset = bytes;
+            bytes += size;
+        }
+    }
+}
+
+// Makes the directory of node `i`; its parent, if any, must exist.
+static void bulk_new_dir(BulkLoad *load, size_t i) {
+    BulkNode *node = &load->nodes[i];
+    Directory *parent = node->parent == BULK_NO_PARENT ? NULL : load->nodes[node->parent].dir;
+    node->dir = dir_new_at((char *) node->slab + node->offset, node->slab, parent, node->n_children);
+    atomic_init(&node->dir->n_descendants, node->end - i - 1);
+    atomic_init(&node->dir->height, node->height);
+}
+
+// Inserts the directory of node `i` into the child index of its parent,
+// or into `top` for children of the target.
+static void bulk_link(BulkLoad *load, size_t i, HashMap *top) {
+    BulkNode *node = &load->nodes[i];
+    HashMap *map = node->parent == BULK_NO_PARENT ? top : load->nodes[node->parent].dir->subdirs;
+    NameId name = name_intern(bulk_path(load, i) + node->name_start,
+                              node->path_len - node->name_start - 1);
+    if (!hmap_insert(map, name, node->dir)) syserr("memory alloc failed!");
+}
+
+// Builds the subtrees of tasks, except for linking their roots.
+static void *bulk_worker(void *arg) {
+    BulkLoad *load = arg;
+    size_t task;
+    while ((task = atomic_fetch_add(&load->next_task, 1)) < load->n_tasks) {
+        size_t root = load->tasks[task];
+        bulk_new_dir(load, root);
+        for (size_t i = root + 1; i < load->nodes[root].end; ++i) {
+            bulk_new_dir(load, i);
+            bulk_link(load, i, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Builds the whole new subtree and returns the child index of its root.
+static HashMap *bulk_build(BulkLoad *load, size_t n_threads) {
+    size_t n = load->n_nodes;
+    size_t task_size = n / (BULK_TASKS_PER_THREAD * (n_threads ? n_threads : 1));
+    if (task_size == 0) task_size = 1;
+
+    bulk_new_slabs(load);
+    load->tasks = malloc((n + 1) * sizeof(size_t));
+    if (!load->tasks) syserr("memory alloc failed!");
+    atomic_init(&load->next_task, 0);
+    for (size_t i = 0; i < n;) {
+        if (load->nodes[i].end - i <= task_size) {
+            load->tasks[load->n_tasks++] = i;
+            i = load->nodes[i].end;
+        } else {
+            bulk_new_dir(load, i);
+            ++i;
+        }
+    }
+
+    if (n_threads > load->n_tasks) n_threads = load->n_tasks;
+    if (n_threads <= 1) {
+        bulk_worker(load);
+    } else {
+        pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+        if (!threads) syserr("memory alloc failed!");
+        for (size_t i = 0; i < n_threads; ++i) {
+            if (pthread_create(&threads[i], NULL, bulk_worker, load) != 0) syserr("pthread_create failed");
+        }
+        for (size_t i = 0; i < n_threads; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+    }
+
+    HashMap *top = hmap_new_sized(load->n_top);
+    if (!top) syserr("memory alloc failed!");
+    for (size_t i = 0; i < n;) {
+        bulk_link(load, i, top);
+        i = load->nodes[i].end - i <= task_size ? load->nodes[i].end : i + 1;
+    }
+    free(load->tasks);
+    return top;
+}
+
+// Loads a sorted stream of paths into the empty directory at `path`.
+int tree_bulk_load(Tree *tree, const char *path, tree_path_iter next, void *arg, size_t n_threads) {
+    assert(tree && next);
+    if (!is_path_valid(path)) return EINVAL;
+
+    // Fail early, before the stream is read.
+    TreeStat stat;
+    int err = tree_stat(tree, path, &stat);
+    if (err) return err;
+    if (stat.n_descendants > 0) return ENOTEMPTY;
+
+    BulkLoad load;
+    err = bulk_read(&load, path, next, arg);
+    if (err) return err;
+    HashMap *top = bulk_build(&load, n_threads);
+
+    Directory *d = NULL;
+    err = tree_find(&d, tree, path);
+    if (!err) {
+        rwlock_wr_lock(d->lock);
+        rwlock_rd_unlock(d->parent->lock);
+        if (hmap_size(d->subdirs) > 0) {
+            err = ENOTEMPTY;
+            rwlock_wr_unlock(d->lock);
+        }
+    }
+
+    NameId subdir_name;
+    Directory *subdir;
+    HashMapIterator it = hmap_iterator(top);
+    if (err) {
+        while (hmap_next(top, &it, &subdir_name, (void **) &subdir)) {
+            dir_free(subdir);
+            name_release(subdir_name);
+        }
+        hmap_free(top);
+    } else {
+        size_t height = 0;
+        while (hmap_next(top, &it, &subdir_name, (void **) &subdir)) {
+            subdir->parent = d;
+            size_t h = atomic_load_explicit(&subdir->height, memory_order_relaxed) + 1;
+            if (h > height) height = h;
+        }
+        HashMap *old = d->subdirs;
+        d->subdirs = top;
+        if (load.n_nodes > 0) {
+            dir_add_descendants(d, load.n_nodes);
+            dir_raise_height(d, height - 1);
+        }
+        // Events are published one by one only if somebody watches them.
+        if (watch_covers(tree->watches, path)) {
+            for (size_t i = 0; i < load.n_nodes; ++i) {
+                watch_publish(tree->watches, TREE_EVENT_CREATE, bulk_path(&load, i), NULL);
+            }
+        }
+        rwlock_wr_unlock(d->lock);
+        hmap_free(old);
+    }
+    free(load.paths);
+    free(load.nodes);
+    return err;
+}
@@ -1,11 +1,23 @@
 #pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
 
 typedef struct Tree Tree; // Let "Tree" mean the same as "struct Tree".
 
 Tree* tree_new();
 
+// Free the tree and all its directories. Nothing else may use it anymore.
 void tree_free(Tree*);
 
+// As tree_free, but frees disjoint subtrees on up to `n_threads` threads.
+void tree_free_parallel(Tree* tree, size_t n_threads);
+
+// Fast teardown, for a tree which lives until the process exits: frees the tree
+// handle and its watches in O(1), leaving the directories' memory to be reclaimed
+// with the address space rather than freeing it one allocation at a time.
+void tree_free_at_exit(Tree* tree);
+
 char* tree_list(Tree* tree, const char* path);
 
 int tree_create(Tree* tree, const char* path);
@@ -13,3 +25,139 @@ int tree_create(Tree* tree, const char* path);
 int tree_remove(Tree* tree, const char* path);
 
 int tree_move(Tree* tree, const char* source, const char* target);
+
+// Variants of the operations above which give up with ETIMEDOUT
+// once `deadline` (absolute CLOCK_MONOTONIC time) has passed;
+// tree_list_timed returns NULL and sets errno instead.
+// No locks are held on return. A NULL deadline means waiting as long as needed.
+// Instead of waiting for the directory being removed, or the subtree
+// being moved, with its parent write-locked, these release all locks,
+// back off and retry.
+char* tree_list_timed(Tree* tree, const char* path, const struct timespec* deadline);
+
+int tree_create_timed(Tree* tree, const char* path, const struct timespec* deadline);
+
+int tree_remove_timed(Tree* tree, const char* path, const struct timespec* deadline);
+
+int tree_move_timed(Tree* tree, const char* source, const char* target,
+                    const struct timespec* deadline);
+
+typedef struct TreeStat TreeStat;
+
+struct TreeStat {
+    size_t n_descendants; // Number of directories strictly below.
+    size_t max_depth; // Depth of the deepest descendant, 0 for an empty directory.
+};
+
+// Fill `stat` with statistics of directory at `path` in O(depth).
+// Returns 0, EINVAL or ENOENT.
+int tree_stat(Tree* tree, const char* path, TreeStat* stat);
+
+typedef struct TreeMemory TreeMemory;
+
+struct TreeMemory {
+    size_t n_directories;
+    size_t node_bytes; // Directory structures.
+    size_t map_bytes; // Child indexes (names are shared by all trees, see name_table_memory).
+    size_t lock_bytes;
+    size_t total_bytes; // Sum of the above.
+};
+
+// Fill `mem` with memory used by the subtree at `path`
+// (allocator overhead is not included).
+// Directories are visited one at a time, so under concurrent changes
+// the result is not a snapshot. Returns 0, EINVAL or ENOENT.
+int tree_memory(Tree* tree, const char* path, TreeMemory* mem);
+
+// Repack child indexes of all directories (which also shrink on their own
+// as entries are removed) into fresh allocations, and return free memory
+// to the operating system. Meant to run in a background thread:
+// readers of a directory are only held up while its index is swapped.
+// Returns the number of bytes saved.
+size_t tree_compact(Tree* tree);
+
+
+// Called by tree_glob for each matching directory, in lexicographic order of paths.
+// `path` is only valid during the call.
+// A non-zero return value stops the search and is returned by tree_glob.
+typedef int (*tree_glob_fn)(const char* path, void* arg);
+
+// Call `callback` for each directory whose path matches `pattern`
+// (see `is_pattern_valid`), e.g. "/users/*/cache/" or "/**/ca*/".
+// Returns 0, EINVAL for an invalid pattern, or the callback's non-zero result.
+int tree_glob(Tree* tree, const char* pattern, tree_glob_fn callback, void* arg);
+
+// Like tree_glob, but searches disjoint subtrees on up to `n_threads` threads.
+// The callback is still called from the calling thread, in the same order.
+int tree_glob_parallel(Tree* tree, const char* pattern, tree_glob_fn callback, void* arg,
+                       size_t n_threads);
+
+typedef enum TreeEventType {
+    TREE_EVENT_CREATE,
+    TREE_EVENT_REMOVE,
+    TREE_EVENT_MOVE,
+    TREE_EVENT_OVERFLOW, // Some events were lost; watched paths should be listed again.
+} TreeEventType;
+
+typedef struct TreeEvent TreeEvent;
+
+struct TreeEvent {
+    TreeEventType type;
+    char* path; // Created or removed directory, or source of a move. NULL for overflow.
+    char* target; // Target of a move, NULL otherwise.
+    size_t count; // Number of identical consecutive events coalesced into this one.
+};
+
+typedef struct TreeWatch TreeWatch;
+
+// Subscribe to creations, removals and moves of the directory at `path`
+// and its children (or all its descendants, if `recursive`),
+// and to moves of its ancestors (from or to their place).
+// Returns NULL if the path is invalid.
+TreeWatch* tree_watch(Tree* tree, const char* path, bool recursive);
+
+// Move up to `max_events` oldest events to `events` without blocking
+// and return their number. Only one thread may read a given watch at a time.
+// The caller owns returned events, see tree_event_clear.
+size_t tree_watch_read(TreeWatch* watch, TreeEvent* events, size_t max_events);
+
+// Free strings owned by the event.
+void tree_event_clear(TreeEvent* event);
+
+// Cancel the subscription and free the watch, with events not read yet.
+void tree_unwatch(Tree* tree, TreeWatch* watch);
+
+typedef enum TreeTxnOpType {
+    TREE_TXN_CREATE,
+    TREE_TXN_REMOVE,
+    TREE_TXN_MOVE,
+} TreeTxnOpType;
+
+typedef struct TreeTxnOp TreeTxnOp;
+
+struct TreeTxnOp {
+    TreeTxnOpType type;
+    const char* path; // Created or removed directory, or source of a move.
+    const char* target; // Target of a move.
+};
+
+// Apply `n_ops` operations atomically, in order: no other thread observes
+// an intermediate state, and either all operations succeed or none is applied.
+// Returns 0, or the error the first failing operation would return
+// from tree_create/tree_remove/tree_move; its index is stored in `*failed_op`.
+int tree_txn(Tree* tree, const TreeTxnOp* ops, size_t n_ops, size_t* failed_op);
+
+// Called by tree_bulk_load for the next path of the stream; returns NULL at its end.
+// The path only needs to stay valid until the next call.
+typedef const char* (*tree_path_iter)(void* arg);
+
+// Create all directories of a stream of paths, strictly increasing (in strcmp order),
+// below the empty directory at `path` (e.g. "/" of a new tree), much faster than
+// one tree_create per path. The parent of each path must be `path` or appear
+// earlier in the stream. The new subtree is built on up to `n_threads` threads
+// and becomes visible to other threads at once, with all its directories.
+// Returns 0, EINVAL for an invalid, out of order or outside path,
+// ENOENT if `path` or the parent of a path does not exist,
+// or ENOTEMPTY if `path` has children; the tree is not changed then.
+int tree_bulk_load(Tree* tree, const char* path, tree_path_iter next, void* arg,
+                   size_t n_threads);
@@ -0,0 +1,441 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "NameTable.h"
+#include "ReadWriteLock.h"
+#include "TreeLocking.h"
+#include "err.h"
+#include "path_utils.h"
+}
+
+/*
+ * Generic tree for C++17, with a payload of type `Payload` stored inline
+ * in every directory (instead of a side table keyed by path), e.g.
+ *
+ *     tree::Tree<Meta> t;
+ *     t.create("/a/", meta_args...);
+ *     tree::Tree<Meta>::ReadHandle h;
+ *     if (t.find("/a/", h) == 0) use(h->field);
+ *
+ * Paths are std::string_views, validated and split in place: no copies,
+ * and each component is looked up once in the intern table (NameTable.h).
+ * As in Tree.c, a name is interned only right before a child is inserted
+ * with it, and released once the child is erased.
+ *
+ * Locking is the protocol of Tree.c, from TreeLocking.h: hand over hand
+ * from the root, the parent being write-locked to create or remove a child,
+ * both parents for a move (found below their lowest common ancestor,
+ * see tree_lock2), and the moved subtree while it is relinked.
+ * Policies have no timed or upgradable locks: those are never asked for
+ * but TREE_NO_WAIT, which only tries, and write locks stand in for
+ * upgradable ones. The lock type is a template parameter:
+ * - RWLockPolicy: the lock backend of the C tree (RWLOCK_BACKEND),
+ * - SharedMutexPolicy: std::shared_mutex,
+ * - NoLockPolicy: no synchronization at all, for trees used by one thread
+ *   at a time, so that locking compiles away.
+ * So is the child index:
+ * - HashIndex: hash map on name ids, for directories with many children,
+ * - SortedIndex: sorted array of name ids, smaller and faster to search
+ *   for the few children of most directories, slower to change with many.
+ *
+ * Errors are reported like by the C API: 0 or an errno value (EMOVE for
+ * moves into the moved subtree). Only allocation failures (and payload
+ * constructors) throw, leaving the tree as it was and nothing locked.
+ *
+ * Tree.h stays a separate implementation, as it also has watches, globs,
+ * transactions, statistics and timed operations; with RWLockPolicy and
+ * HashIndex this template behaves like its basic operations, which lock
+ * through the same TreeLocking.h functions.
+ * Link with the lock backend (for RWLockPolicy), NameTable.c and Epoch.c.
+ */
+
+namespace tree {
+
+// Locks of the C tree, from the backend chosen with RWLOCK_BACKEND.
+class RWLockPolicy {
+public:
+    RWLockPolicy() : lock_(rwlock_new()) {
+        if (!lock_) throw std::bad_alloc();
+    }
+    ~RWLockPolicy() { rwlock_free(lock_); }
+    RWLockPolicy(const RWLockPolicy&) = delete;
+    RWLockPolicy& operator=(const RWLockPolicy&) = delete;
+
+    void lock() { rwlock_wr_lock(lock_); }
+    void unlock() { rwlock_wr_unlock(lock_); }
+    bool try_lock() { return rwlock_try_wr_lock(lock_) == 0; }
+    void lock_shared() { rwlock_rd_lock(lock_); }
+    void unlock_shared() { rwlock_rd_unlock(lock_); }
+    bool try_lock_shared() { return rwlock_try_rd_lock(lock_) == 0; }
+
+private:
+    RWLock* lock_;
+};
+
+using SharedMutexPolicy = std::shared_mutex;
+
+// For trees used by one thread at a time.
+struct NoLockPolicy {
+    void lock() {}
+    void unlock() {}
+    bool try_lock() { return true; }
+    void lock_shared() {}
+    void unlock_shared() {}
+    bool try_lock_shared() { return true; }
+};
+
+// Child index: maps name ids to (not owned) children.
+template <class Node>
+class HashIndex {
+public:
+    Node* find(NameId id) const {
+        auto it = map_.find(id);
+        return it == map_.end() ? nullptr : it->second;
+    }
+    // Returns false if `id` is already there.
+    bool insert(NameId id, Node* node) { return map_.emplace(id, node).second; }
+    // Returns the removed child, or nullptr if `id` was not there.
+    Node* erase(NameId id) {
+        auto it = map_.find(id);
+        if (it == map_.end()) return nullptr;
+        Node* node = it->second;
+        map_.erase(it);
+        return node;
+    }
+    size_t size() const { return map_.size(); }
+    template <class F>
+    void for_each(F&& f) const {
+        for (const auto& [id, node] : map_) f(id, node);
+    }
+
+private:
+    std::unordered_map<NameId, Node*> map_;
+};
+
+template <class Node>
+class SortedIndex {
+public:
+    Node* find(NameId id) const {
+        size_t i = position(id);
+        return i < entries_.size() && entries_[i].first == id ? entries_[i].second : nullptr;
+    }
+    bool insert(NameId id, Node* node) {
+        size_t i = position(id);
+        if (i < entries_.size() && entries_[i].first == id) return false;
+        entries_.emplace(entries_.begin() + i, id, node);
+        return true;
+    }
+    Node* erase(NameId id) {
+        size_t i = position(id);
+        if (i == entries_.size() || entries_[i].first != id) return nullptr;
+        Node* node = entries_[i].second;
+        entries_.erase(entries_.begin() + i);
+        return node;
+    }
+    size_t size() const { return entries_.size(); }
+    template <class F>
+    void for_each(F&& f) const {
+        for (const auto& [id, node] : entries_) f(id, node);
+    }
+
+private:
+    size_t position(NameId id) const {
+        auto it = std::lower_bound(entries_.begin(), entries_.end(), id,
+                                   [](const auto& entry, NameId id) { return entry.first < id; });
+        return it - entries_.begin();
+    }
+
+    std::vector<std::pair<NameId, Node*>> entries_;
+};
+
+struct Empty {};
+
+template <class Payload = Empty, class LockPolicy = RWLockPolicy,
+          template <class> class Index = HashIndex>
+class Tree {
+    struct Node {
+        LockPolicy lock;
+        Index<Node> children;
+        Payload payload;
+
+        template <class... Args>
+        explicit Node(Args&&... args) : payload(std::forward<Args>(args)...) {}
+    };
+
+public:
+    // Directory locked by `find`, read-locked (giving const access to its payload)
+    // or write-locked, until the handle is released, destroyed or moved from.
+    // While it is held, the directory can't be removed or moved.
+    template <bool Write>
+    class Handle {
+    public:
+        using Value = std::conditional_t<Write, Payload, const Payload>;
+
+        Handle() = default;
+        Handle(Handle&& other) noexcept : node_(std::exchange(other.node_, nullptr)) {}
+        Handle& operator=(Handle&& other) noexcept {
+            if (this != &other) {
+                release();
+                node_ = std::exchange(other.node_, nullptr);
+            }
+            return *this;
+        }
+        Handle(const Handle&) = delete;
+        Handle& operator=(const Handle&) = delete;
+        ~Handle() { release(); }
+
+        explicit operator bool() const { return node_ != nullptr; }
+        Value& operator*() const { return node_->payload; }
+        Value* operator->() const { return &node_->payload; }
+        size_t n_children() const { return node_->children.size(); }
+
+        void release() {
+            if (!node_) return;
+            if (Write) node_->lock.unlock();
+            else node_->lock.unlock_shared();
+            node_ = nullptr;
+        }
+
+    private:
+        friend class Tree;
+        explicit Handle(Node* node) : node_(node) {}
+
+        Node* node_ = nullptr;
+    };
+
+    using ReadHandle = Handle<false>;
+    using WriteHandle = Handle<true>;
+
+    // The root gets a payload made of `args`.
+    template <class... Args>
+    explicit Tree(Args&&... args) : root_(new Node(std::forward<Args>(args)...)) {}
+
+    // Nobody may use the tree anymore. Frees it without recursion.
+    ~Tree() {
+        std::vector<Node*> stack{root_};
+        while (!stack.empty()) {
+            Node* node = stack.back();
+            stack.pop_back();
+            node->children.for_each([&](NameId id, Node* child) {
+                stack.push_back(child);
+                name_release(id);
+            });
+            delete node;
+        }
+    }
+
+    Tree(const Tree&) = delete;
+    Tree& operator=(const Tree&) = delete;
+
+    // Set `out` to a handle to the directory at `path`. Returns 0, EINVAL or ENOENT.
+    template <bool Write>
+    int find(std::string_view path, Handle<Write>& out) {
+        if (!is_valid(path)) return EINVAL;
+        Node* node = lock_path(path, Write);
+        if (!node) return ENOENT;
+        out = Handle<Write>(node);
+        return 0;
+    }
+
+    // Set `names` to the sorted names of children of the directory at `path`.
+    // Returns 0, EINVAL or ENOENT.
+    int list(std::string_view path, std::vector<std::string>& names) {
+        names.clear();
+        if (!is_valid(path)) return EINVAL;
+        Node* node = lock_path(path, false);
+        if (!node) return ENOENT;
+        std::shared_lock<LockPolicy> guard(node->lock, std::adopt_lock);
+        names.reserve(node->children.size());
+        node->children.for_each([&](NameId id, Node*) { names.emplace_back(name_str(id), name_len(id)); });
+        guard.unlock();
+        std::sort(names.begin(), names.end());
+        return 0;
+    }
+
+    // Create a directory at `path` with a payload made of `args`
+    // (before its parent is write-locked, and destroyed if it exists already).
+    // Returns 0, EINVAL, EEXIST or ENOENT.
+    template <class... Args>
+    int create(std::string_view path, Args&&... args) {
+        if (!is_valid(path)) return EINVAL;
+        if (path.size() == 1) return EEXIST;
+        std::string_view name;
+        std::string_view parent_path = split_last(path, name);
+        auto node = std::make_unique<Node>(std::forward<Args>(args)...);
+
+        Node* parent = lock_path(parent_path, true);
+        if (!parent) return ENOENT;
+        std::unique_lock<LockPolicy> guard(parent->lock, std::adopt_lock);
+        if (parent->children.find(name_find(name.data(), name.size()))) return EEXIST;
+        link(parent, name, node.get());
+        node.release();
+        return 0;
+    }
+
+    // Remove the empty directory at `path`, destroying its payload.
+    // Returns 0, EINVAL, EBUSY, ENOENT or ENOTEMPTY.
+    int remove(std::string_view path) {
+        if (!is_valid(path)) return EINVAL;
+        if (path.size() == 1) return EBUSY;
+        std::string_view name;
+        std::string_view parent_path = split_last(path, name);
+
+        Node* parent = lock_path(parent_path, true);
+        if (!parent) return ENOENT;
+        NameId id = name_find(name.data(), name.size());
+        Node* node = id == NAME_NONE ? nullptr : parent->children.find(id);
+        if (!node) {
+            parent->lock.unlock();
+            return ENOENT;
+        }
+        node->lock.lock(); // Wait for handles and operations below.
+        if (node->children.size() > 0) {
+            node->lock.unlock();
+            parent->lock.unlock();
+            return ENOTEMPTY;
+        }
+        parent->children.erase(id);
+        parent->lock.unlock();
+        node->lock.unlock();
+        delete node;
+        name_release(id);
+        return 0;
+    }
+
+    // Move the directory at `source` to `target`.
+    // Returns 0, EINVAL, EBUSY, EEXIST, ENOENT or EMOVE.
+    int move(std::string_view source, std::string_view target) {
+        if (!is_valid(source) || !is_valid(target)) return EINVAL;
+        if (source.size() == 1) return EBUSY;
+        if (target.size() == 1) return EEXIST;
+        if (target.size() > source.size() && target.substr(0, source.size()) == source) return EMOVE;
+        std::string_view source_name, target_name;
+        std::string_view source_parent_path = split_last(source, source_name);
+        std::string_view target_parent_path = split_last(target, target_name);
+
+        void* found1 = nullptr;
+        void* found2 = nullptr;
+        int err = tree_lock2(&lock_ops, root_, source_parent_path.data(), source_parent_path.size(),
+                             target_parent_path.data(), target_parent_path.size(), nullptr,
+                             &found1, &found2);
+        if (err) return err;
+        Node* source_parent = static_cast<Node*>(found1);
+        Node* target_parent = static_cast<Node*>(found2);
+        std::unique_lock<LockPolicy> source_guard(source_parent->lock, std::adopt_lock);
+        std::unique_lock<LockPolicy> target_guard;
+        if (target_parent != source_parent) target_guard = std::unique_lock<LockPolicy>(target_parent->lock, std::adopt_lock);
+
+        NameId source_id = name_find(source_name.data(), source_name.size());
+        NameId target_id = name_find(target_name.data(), target_name.size());
+        Node* moved = source_id == NAME_NONE ? nullptr : source_parent->children.find(source_id);
+        if (!moved) return ENOENT;
+        bool in_place = source_parent == target_parent && source_id == target_id;
+        if (!in_place && target_parent->children.find(target_id)) return EEXIST;
+
+        // Wait for handles and operations in the moved subtree.
+        tree_lock_subtree(&lock_ops, moved, nullptr);
+        if (!in_place) {
+            // Inserted first, so that if that throws, nothing is lost.
+            try {
+                link(target_parent, target_name, moved);
+            } catch (...) {
+                tree_unlock_subtree(&lock_ops, moved);
+                throw;
+            }
+            source_parent->children.erase(source_id);
+            name_release(source_id);
+        }
+        tree_unlock_subtree(&lock_ops, moved);
+        return 0;
+    }
+
+private:
+    // Like is_path_valid, without needing a terminating null.
+    static bool is_valid(std::string_view path) {
+        if (path.empty() || path.size() > MAX_PATH_LENGTH || path.front() != '/' || path.back() != '/')
+            return false;
+        for (size_t start = 1; start < path.size();) {
+            size_t end = path.find('/', start);
+            if (end == start || end - start > MAX_FOLDER_NAME_LENGTH) return false;
+            for (size_t i = start; i < end; ++i) {
+                if (path[i] < 'a' || path[i] > 'z') return false;
+            }
+            start = end + 1;
+        }
+        return true;
+    }
+
+    // Like make_path_to_parent, but returns a view into `path`.
+    static std::string_view split_last(std::string_view path, std::string_view& name) {
+        size_t slash = path.rfind('/', path.size() - 2);
+        name = path.substr(slash + 1, path.size() - slash - 2);
+        return path.substr(0, slash + 1);
+    }
+
+    // Nodes for the locking protocol of TreeLocking.h.
+
+    static void* child_of(void* node, NameId id) { return static_cast<Node*>(node)->children.find(id); }
+
+    static int lock_node(void* node, TreeLockMode mode, const struct timespec* deadline) {
+        LockPolicy& lock = static_cast<Node*>(node)->lock;
+        bool write = mode != TREE_LOCK_READ;
+        if (deadline) return (write ? lock.try_lock() : lock.try_lock_shared()) ? 0 : ETIMEDOUT;
+        if (write) lock.lock();
+        else lock.lock_shared();
+        return 0;
+    }
+
+    static void unlock_node(void* node, TreeLockMode mode) {
+        LockPolicy& lock = static_cast<Node*>(node)->lock;
+        if (mode != TREE_LOCK_READ) lock.unlock();
+        else lock.unlock_shared();
+    }
+
+    static int for_each_child(void* node, int (*fn)(void* child, void* arg), void* arg) {
+        int err = 0;
+        static_cast<Node*>(node)->children.for_each([&](NameId, Node* child) {
+            if (!err) err = fn(child, arg);
+        });
+        return err;
+    }
+
+    static constexpr TreeLockOps lock_ops = {child_of, lock_node, unlock_node, for_each_child, nullptr};
+
+    // Locks the directory at valid `path` hand over hand from the root,
+    // in write mode if `write`. Returns nullptr, holding no lock, if it does not exist.
+    Node* lock_path(std::string_view path, bool write) {
+        void* node = nullptr;
+        tree_lock_path(&lock_ops, root_, path.data(), path.size(),
+                       write ? TREE_LOCK_WRITE : TREE_LOCK_READ, nullptr, &node);
+        return static_cast<Node*>(node);
+    }
+
+    // Interns `name` and inserts `child` under it into write-locked `parent`.
+    // If that throws, the name is released.
+    static void link(Node* parent, std::string_view name, Node* child) {
+        NameId id = name_intern(name.data(), name.size());
+        try {
+            parent->children.insert(id, child);
+        } catch (...) {
+            name_release(id);
+            throw;
+        }
+    }
+
+    Node* root_;
+};
+
+} // namespace tree
@@ -0,0 +1,227 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "TreeClient.h"
+#include "err.h"
+
+/**
+ * Client side of TreeProtocol.h.
+ *
+ * Requests are queued in `out` and sent with as few writes as possible.
+ * Responses are read in large chunks into `in`, from which
+ * tree_client_recv takes them one by one.
+ *
+ * Sending never blocks: the server stops reading requests from
+ * a connection whose responses pile up (see TreeServer.c), so while
+ * a send would block, responses which have arrived are read into `in`.
+ */
+
+#define READ_CHUNK 65536
+#define MAX_PATH_BYTES 4095
+
+struct TreeClient {
+    int fd;
+    uint32_t next_id;
+    size_t n_outstanding; // Requests sent or queued, without a response received.
+    char *out;
+    size_t out_len, out_cap;
+    char *in;
+    size_t in_pos, in_len, in_cap; // Unprocessed bytes are in_pos..in_len.
+};
+
+static void reserve(char **data, size_t *cap, size_t len) {
+    if (len <= *cap) return;
+    size_t new_cap = *cap ? *cap : 4096;
+    while (new_cap < len) new_cap *= 2;
+    *data = realloc(*data, new_cap);
+    if (!*data) syserr("memory alloc failed!");
+    *cap = new_cap;
+}
+
+TreeClient *tree_client_connect(const char *path) {
+    assert(path);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return NULL;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+
+    TreeClient *c = calloc(1, sizeof(TreeClient));
+    if (!c) syserr("memory alloc failed!");
+    c->fd = fd;
+    return c;
+}
+
+void tree_client_close(TreeClient *c) {
+    assert(c);
+    close(c->fd);
+    free(c->out);
+    free(c->in);
+    free(c);
+}
+
+int tree_client_send(TreeClient *c, TreeOp op, const char *path, const char *target) {
+    assert(c && path);
+    size_t path_len = strlen(path);
+    size_t target_len = op == TREE_OP_MOVE && target ? strlen(target) : 0;
+    if (path_len > MAX_PATH_BYTES || target_len > MAX_PATH_BYTES) return EINVAL;
+
+    TreeRequestHeader h = {
+        .size = sizeof(h) + path_len + target_len,
+        .id = c->next_id++,
+        .op = op,
+        .path_len = path_len,
+        .target_len = target_len,
+    };
+    reserve(&c->out, &c->out_cap, c->out_len + h.size);
+    memcpy(c->out + c->out_len, &h, sizeof(h));
+    memcpy(c->out + c->out_len + sizeof(h), path, path_len);
+    if (target_len) memcpy(c->out + c->out_len + sizeof(h) + path_len, target, target_len);
+    c->out_len += h.size;
+    c->n_outstanding++;
+    return 0;
+}
+
+// Reads once into `in`, with room for at least `room` more bytes,
+// passing `flags` to recv. Returns 0 or errno.
+static int read_more(TreeClient *c, size_t room, int flags) {
+    if (c->in_pos > 0) {
+        memmove(c->in, c->in + c->in_pos, c->in_len - c->in_pos);
+        c->in_len -= c->in_pos;
+        c->in_pos = 0;
+    }
+    reserve(&c->in, &c->in_cap, c->in_len + room);
+    ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, flags);
+    if (n == 0) return ECONNRESET;
+    if (n < 0) return errno;
+    c->in_len += n;
+    return 0;
+}
+
+int tree_client_flush(TreeClient *c) {
+    assert(c);
+    size_t pos = 0;
+    int err = 0;
+    while (pos < c->out_len) {
+        ssize_t n = send(c->fd, c->out + pos, c->out_len - pos, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n >= 0) {
+            pos += n;
+            continue;
+        }
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            err = errno;
+            break;
+        }
+        struct pollfd p = {.fd = c->fd, .events = POLLIN | POLLOUT};
+        if (poll(&p, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            err = errno;
+            break;
+        }
+        if (p.revents & POLLIN) {
+            err = read_more(c, READ_CHUNK, MSG_DONTWAIT);
+            if (err == EAGAIN || err == EWOULDBLOCK || err == EINTR) err = 0;
+            if (err) break;
+        }
+    }
+    if (pos > 0) memmove(c->out, c->out + pos, c->out_len - pos);
+    c->out_len -= pos;
+    return err;
+}
+
+// Reads until `len` unprocessed bytes are buffered.
+static int fill(TreeClient *c, size_t len) {
+    while (c->in_len - c->in_pos < len) {
+        int err = read_more(c, len > READ_CHUNK ? len : READ_CHUNK, 0);
+        if (err == EINTR) continue;
+        if (err) return err;
+    }
+    return 0;
+}
+
+int tree_client_recv(TreeClient *c, int *status, char **list) {
+    assert(c && status);
+    if (c->n_outstanding == 0) return EINVAL;
+    int err = tree_client_flush(c);
+    if (err) return err;
+
+    TreeResponseHeader h;
+    err = fill(c, sizeof(h));
+    if (err) return err;
+    memcpy(&h, c->in + c->in_pos, sizeof(h));
+    if (h.size < sizeof(h)) return EPROTO;
+    err = fill(c, h.size);
+    if (err) return err;
+
+    size_t data_len = h.size - sizeof(h);
+    if (list) {
+        *list = NULL;
+        if (h.status == 0 && data_len > 0) {
+            *list = malloc(data_len + 1);
+            if (!*list) syserr("memory alloc failed!");
+            memcpy(*list, c->in + c->in_pos + sizeof(h), data_len);
+            (*list)[data_len] = '\0';
+        }
+    }
+    c->in_pos += h.size;
+    c->n_outstanding--;
+    *status = h.status;
+    return 0;
+}
+
+// Sends one request and waits for its response.
+static int call(TreeClient *c, TreeOp op, const char *path, const char *target, char **list) {
+    if (c->n_outstanding > 0) return EINVAL;
+    int status;
+    int err = tree_client_send(c, op, path, target);
+    if (!err) err = tree_client_recv(c, &status, list);
+    return err ? err : status;
+}
+
+char *tree_client_list(TreeClient *c, const char *path) {
+    assert(c && path);
+    char *list = NULL;
+    int err = call(c, TREE_OP_LIST, path, NULL, &list);
+    if (err) {
+        errno = err;
+        return NULL;
+    }
+    if (!list) {
+        // Empty directory.
+        list = calloc(1, 1);
+        if (!list) syserr("memory alloc failed!");
+    }
+    return list;
+}
+
+int tree_client_create(TreeClient *c, const char *path) {
+    assert(c && path);
+    return call(c, TREE_OP_CREATE, path, NULL, NULL);
+}
+
+int tree_client_remove(TreeClient *c, const char *path) {
+    assert(c && path);
+    return call(c, TREE_OP_REMOVE, path, NULL, NULL);
+}
+
+int tree_client_move(TreeClient *c, const char *source, const char *target) {
+    assert(c && source && target);
+    return call(c, TREE_OP_MOVE, source, target, NULL);
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include "TreeProtocol.h"
+
+// Connection to a tree_server (see TreeServer.h). Not thread-safe:
+// each thread should use its own connection.
+typedef struct TreeClient TreeClient;
+
+// Connect to the server listening on Unix socket `path`.
+// Returns NULL and sets errno on failure.
+TreeClient* tree_client_connect(const char* path);
+
+// Close the connection, dropping responses not received yet.
+void tree_client_close(TreeClient* client);
+
+// Remote tree_list, tree_create, tree_remove and tree_move.
+// They return what the Tree functions return, or errno of a broken
+// connection (e.g. ECONNRESET); tree_client_list returns NULL and sets errno.
+// Responses to pipelined requests sent before must have been received.
+char* tree_client_list(TreeClient* client, const char* path);
+
+int tree_client_create(TreeClient* client, const char* path);
+
+int tree_client_remove(TreeClient* client, const char* path);
+
+int tree_client_move(TreeClient* client, const char* source, const char* target);
+
+// Pipelining: tree_client_send queues a request (`target` only for TREE_OP_MOVE),
+// tree_client_flush sends all queued ones at once (reading responses
+// which arrive meanwhile, so any number may be queued), and tree_client_recv
+// waits for the oldest outstanding response (flushing first, if needed).
+// It stores the result of the operation in `*status` and, for a successful list,
+// the directory contents in `*list` (to be freed by the caller; NULL otherwise).
+// All return 0 or errno: EINVAL for a path too long to send
+// or for recv with no request outstanding, otherwise that of the connection.
+int tree_client_send(TreeClient* client, TreeOp op, const char* path, const char* target);
+
+int tree_client_flush(TreeClient* client);
+
+int tree_client_recv(TreeClient* client, int* status, char** list);
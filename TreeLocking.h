@@ -0,0 +1,260 @@
+#pragma once
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "NameTable.h"
+
+/*
+ * Locking protocol of the tree, shared by Tree.c and Tree.hpp:
+ * hand-over-hand traversals, write-locking the two parents of a move,
+ * and write-locking a whole subtree. Nodes are opaque here; a tree
+ * describes them with a TreeLockOps, known at compile time, so that
+ * the calls through it can be inlined.
+ *
+ * Paths are valid (see is_path_valid) and given with their length,
+ * so they need not be null-terminated.
+ *
+ * Deadlines are absolute CLOCK_MONOTONIC times, NULL for none. A lock
+ * whose deadline passes fails with ETIMEDOUT; TREE_NO_WAIT only tries.
+ */
+
+typedef enum TreeLockMode {
+    TREE_LOCK_READ,
+    TREE_LOCK_UPGRADABLE,
+    TREE_LOCK_WRITE,
+} TreeLockMode;
+
+typedef struct TreeLockOps TreeLockOps;
+
+struct TreeLockOps {
+    // Child `name` (not NAME_NONE) of locked `node`, or NULL.
+    void* (*child)(void* node, NameId name);
+    // Locks `node`, waiting at most until `deadline`. Returns 0 or ETIMEDOUT.
+    int (*lock)(void* node, TreeLockMode mode, const struct timespec* deadline);
+    void (*unlock)(void* node, TreeLockMode mode);
+    // Calls `fn` for children of locked `node` (in the same order while it is locked)
+    // until it returns non-zero, which is returned.
+    int (*for_each_child)(void* node, int (*fn)(void* child, void* arg), void* arg);
+    // If not NULL, called on a node once its subtree is write-locked.
+    void (*subtree_locked)(void* node);
+};
+
+// Deadline that has always passed: waiting until it means only trying.
+static const struct timespec TREE_NO_WAIT = {0, 0};
+
+// Rounds in which tree_lock2() tries to lock directories on two
+// branches with their common ancestor read-locked, before it write-locks it.
+#define TREE_LOCK2_TRIES 4
+
+// Initial and maximal pause of tree_backoff().
+#define TREE_BACKOFF_MIN_NS 1000L
+#define TREE_BACKOFF_MAX_NS 1000000L
+
+// Pauses before an operation is restarted,
+// doubling `*delay_ns` (which starts at 0) each time.
+// Returns ETIMEDOUT without pausing if the deadline (if not NULL) has passed.
+static inline int tree_backoff(long* delay_ns, const struct timespec* deadline) {
+    long long left = TREE_BACKOFF_MAX_NS;
+    if (deadline) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = (deadline->tv_sec - now.tv_sec) * 1000000000LL + (deadline->tv_nsec - now.tv_nsec);
+        if (left <= 0) return ETIMEDOUT;
+    }
+
+    *delay_ns = *delay_ns < TREE_BACKOFF_MIN_NS ? TREE_BACKOFF_MIN_NS : *delay_ns * 2;
+    if (*delay_ns > TREE_BACKOFF_MAX_NS) *delay_ns = TREE_BACKOFF_MAX_NS;
+    struct timespec pause = {0, *delay_ns < left ? *delay_ns : (long) left};
+    nanosleep(&pause, NULL);
+    return 0;
+}
+
+// Takes the first component off `*path` of `*len` bytes (not "/"),
+// which is left with the rest, and returns its id (NAME_NONE if not interned).
+static inline NameId tree_path_split(const char** path, size_t* len) {
+    const char* slash = (const char*) memchr(*path + 1, '/', *len - 1);
+    NameId id = name_find(*path + 1, slash - *path - 1);
+    *len -= slash - *path;
+    *path = slash;
+    return id;
+}
+
+// Finds the node at `path` and locks it in `mode`, read-locking its ancestors
+// hand over hand from `root`: each one until its child is locked.
+// Returns 0, ENOENT or ETIMEDOUT (then holding no lock).
+// Tree traversal lock type: READ.
+static inline int tree_lock_path(const TreeLockOps* ops, void* root, const char* path, size_t len,
+                                 TreeLockMode mode, const struct timespec* deadline, void** out) {
+    void* node = root;
+    int err = ops->lock(node, len == 1 ? mode : TREE_LOCK_READ, deadline);
+    if (err) return err;
+    while (len > 1) {
+        NameId name = tree_path_split(&path, &len);
+        void* child = name == NAME_NONE ? NULL : ops->child(node, name);
+        err = child ? ops->lock(child, len == 1 ? mode : TREE_LOCK_READ, deadline) : ENOENT;
+        ops->unlock(node, TREE_LOCK_READ);
+        if (err) return err;
+        node = child;
+    }
+    *out = node;
+    return 0;
+}
+
+// Finds the node at `path` relative to locked `from` (which stays locked)
+// and write-locks it (`from` itself for "/"), read-locking the ones
+// on the way hand over hand. Returns 0, ENOENT or ETIMEDOUT
+// (then holding no lock but `from`).
+// Tree traversal lock type: READ.
+static inline int tree_lock_below(const TreeLockOps* ops, void* from, const char* path, size_t len,
+                                  const struct timespec* deadline, void** out) {
+    void* node = from;
+    while (len > 1) {
+        NameId name = tree_path_split(&path, &len);
+        void* child = name == NAME_NONE ? NULL : ops->child(node, name);
+        int err = child ? ops->lock(child, len == 1 ? TREE_LOCK_WRITE : TREE_LOCK_READ, deadline)
+                        : ENOENT;
+        if (node != from) ops->unlock(node, TREE_LOCK_READ);
+        if (err) return err;
+        node = child;
+    }
+    *out = node;
+    return 0;
+}
+
+// Finds and write-locks the nodes at `path1` and `path2` (once if equal).
+// Returns 0, ENOENT or ETIMEDOUT (then holding no lock).
+//
+// Nodes on two different branches are locked without write-locking
+// their common ancestor, so that moves between them don't stall
+// all traffic through it (e.g. through the root for two top-level subtrees).
+// The common ancestor is found once (tree traversal lock type: READ)
+// and stays read-locked while both nodes are found below it,
+// in the order of their paths: the first one is write-locked waiting as usual,
+// the second one without waiting, as this thread already holds
+// a write lock which the holder of a lock on the way might need
+// (e.g. a move whose target is there, waiting for the subtree it moves).
+// If that fails, everything is released, and after a backoff tried again.
+// A write-locked node can't be moved or removed, nor can any
+// of its ancestors (a moved subtree is write-locked whole),
+// so the first one is still at its path when the second one is found.
+//
+// After TREE_LOCK2_TRIES such rounds, the common ancestor is write-locked instead.
+// Then nobody else can get below it, and whoever is there already never waits
+// for it, so the first node is waited for, and the second one tried
+// (again releasing the first one and backing off if busy) until those
+// who were there leave: an untimed move always gets through.
+//
+// When one of the nodes is below the other one, the upper one is
+// write-locked first and the lower one found below it, like on a branch.
+static inline int tree_lock2(const TreeLockOps* ops, void* root, const char* path1, size_t len1,
+                             const char* path2, size_t len2, const struct timespec* deadline,
+                             void** out1, void** out2) {
+    size_t common_len = 1;
+    for (size_t i = 0; i < len1 && i < len2 && path1[i] == path2[i]; ++i) {
+        if (path1[i] == '/') common_len = i + 1;
+    }
+    // Below the common ancestor, starting with its '/'.
+    const char* below1 = path1 + common_len - 1;
+    const char* below2 = path2 + common_len - 1;
+    size_t below1_len = len1 - common_len + 1;
+    size_t below2_len = len2 - common_len + 1;
+
+    if (below1_len == 1 || below2_len == 1) {
+        void* upper = NULL;
+        int err = tree_lock_path(ops, root, path1, common_len, TREE_LOCK_WRITE, deadline, &upper);
+        if (err) return err;
+        bool first_upper = below1_len == 1;
+        err = tree_lock_below(ops, upper, first_upper ? below2 : below1,
+                              first_upper ? below2_len : below1_len, deadline,
+                              first_upper ? out2 : out1);
+        if (err) {
+            ops->unlock(upper, TREE_LOCK_WRITE);
+            return err;
+        }
+        *(first_upper ? out1 : out2) = upper;
+        return 0;
+    }
+
+    bool swap = memcmp(below1, below2, below1_len < below2_len ? below1_len : below2_len) > 0;
+    void** first = swap ? out2 : out1;
+    void** second = swap ? out1 : out2;
+    const char* first_path = swap ? below2 : below1;
+    const char* second_path = swap ? below1 : below2;
+    size_t first_len = swap ? below2_len : below1_len;
+    size_t second_len = swap ? below1_len : below2_len;
+    long delay_ns = 0;
+    int err;
+    for (int round = 0;; ++round) {
+        TreeLockMode common_mode = round >= TREE_LOCK2_TRIES ? TREE_LOCK_WRITE : TREE_LOCK_READ;
+        void* common = NULL;
+        err = tree_lock_path(ops, root, path1, common_len, common_mode, deadline, &common);
+        if (err) break;
+
+        do {
+            err = tree_lock_below(ops, common, first_path, first_len, deadline, first);
+            if (err) break;
+            err = tree_lock_below(ops, common, second_path, second_len, &TREE_NO_WAIT, second);
+            if (err) ops->unlock(*first, TREE_LOCK_WRITE);
+        } while (common_mode == TREE_LOCK_WRITE && err == ETIMEDOUT
+                 && tree_backoff(&delay_ns, deadline) == 0);
+
+        ops->unlock(common, common_mode);
+        if (err != ETIMEDOUT || common_mode == TREE_LOCK_WRITE) break;
+        err = tree_backoff(&delay_ns, deadline);
+        if (err) break;
+    }
+    return err;
+}
+
+typedef struct TreeSubtreeWalk TreeSubtreeWalk;
+
+struct TreeSubtreeWalk {
+    const TreeLockOps* ops;
+    const struct timespec* deadline;
+    void* stop; // Child where the walk stopped.
+};
+
+static inline int tree_lock_subtree(const TreeLockOps* ops, void* node,
+                                    const struct timespec* deadline);
+static inline void tree_unlock_subtree(const TreeLockOps* ops, void* node);
+
+static inline int tree_lock_subtree_child(void* child, void* arg) {
+    TreeSubtreeWalk* walk = (TreeSubtreeWalk*) arg;
+    int err = tree_lock_subtree(walk->ops, child, walk->deadline);
+    if (err) walk->stop = child;
+    return err;
+}
+
+static inline int tree_unlock_subtree_child(void* child, void* arg) {
+    TreeSubtreeWalk* walk = (TreeSubtreeWalk*) arg;
+    if (child == walk->stop) return 1;
+    tree_unlock_subtree(walk->ops, child);
+    return 0;
+}
+
+// Write-unlocks the subtree of `node`.
+static inline void tree_unlock_subtree(const TreeLockOps* ops, void* node) {
+    TreeSubtreeWalk walk = {ops, NULL, NULL};
+    ops->for_each_child(node, tree_unlock_subtree_child, &walk);
+    ops->unlock(node, TREE_LOCK_WRITE);
+}
+
+// Write-locks the subtree of `node`, parents first, waiting at most until `deadline`.
+// Returns 0 or ETIMEDOUT, after releasing the part locked so far.
+static inline int tree_lock_subtree(const TreeLockOps* ops, void* node,
+                                    const struct timespec* deadline) {
+    int err = ops->lock(node, TREE_LOCK_WRITE, deadline);
+    if (err) return err;
+    TreeSubtreeWalk walk = {ops, deadline, NULL};
+    err = ops->for_each_child(node, tree_lock_subtree_child, &walk);
+    if (err) {
+        // The children are stable, so they come in the same order again.
+        ops->for_each_child(node, tree_unlock_subtree_child, &walk);
+        ops->unlock(node, TREE_LOCK_WRITE);
+        return err;
+    }
+    if (ops->subtree_locked) ops->subtree_locked(node);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Wire protocol of tree_server (see TreeServer.h and TreeClient.h).
+ *
+ * Both sides exchange frames over a Unix domain socket,
+ * so integers are in host byte order and there is no versioning.
+ * A request is a TreeRequestHeader followed by `path_len` bytes
+ * of the path and `target_len` bytes of the target (move only),
+ * without terminating nulls. A response is a TreeResponseHeader
+ * followed by `size - sizeof(TreeResponseHeader)` bytes of data:
+ * the directory contents for a successful list, nothing otherwise.
+ *
+ * Requests may be pipelined: a client can send any number of them
+ * without waiting. Responses come back in the order of requests,
+ * and carry the `id` of their request.
+ */
+
+typedef enum TreeOp {
+    TREE_OP_LIST = 1,
+    TREE_OP_CREATE = 2,
+    TREE_OP_REMOVE = 3,
+    TREE_OP_MOVE = 4,
+} TreeOp;
+
+typedef struct TreeRequestHeader TreeRequestHeader;
+
+struct TreeRequestHeader {
+    uint32_t size; // Of the whole frame, header included.
+    uint32_t id; // Chosen by the client, echoed in the response.
+    uint8_t op; // TreeOp.
+    uint8_t unused;
+    uint16_t path_len;
+    uint16_t target_len;
+    uint16_t unused2;
+};
+
+typedef struct TreeResponseHeader TreeResponseHeader;
+
+struct TreeResponseHeader {
+    uint32_t size; // Of the whole frame, header included.
+    uint32_t id;
+    int32_t status; // What the Tree function returned, or errno of tree_list.
+};
+
+// Longest request the server accepts; longer ones break the connection.
+#define TREE_MAX_REQUEST (sizeof(TreeRequestHeader) + 2 * 4096)
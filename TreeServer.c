@@ -0,0 +1,471 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "path_utils.h"
+#include "TreeProtocol.h"
+#include "TreeServer.h"
+#include "err.h"
+
+/**
+ * Tree server.
+ *
+ * One thread runs the epoll loop: it accepts connections, reads
+ * requests and writes responses, all without blocking.
+ * Requests are executed by worker threads.
+ *
+ * A connection has at most one batch of requests at a worker at a time.
+ * The batch is made of all complete requests received so far
+ * (up to BATCH_MAX_BYTES), so a pipelining client gets many requests
+ * executed per handoff, and its responses stay in order.
+ * Meanwhile the loop keeps reading into the connection's input buffer
+ * (until it holds INPUT_LIMIT bytes). The worker writes responses
+ * to the batch's own buffer and puts the connection on the `done` list,
+ * waking the loop up through an eventfd. The loop moves the responses
+ * to the output buffer, sends them and cuts the next batch.
+ * While more than OUTPUT_LIMIT bytes of responses wait to be sent,
+ * the loop neither reads from the connection nor cuts batches for it,
+ * so a client which doesn't read its responses can't make the server
+ * buffer them without bound; both resume once EPOLLOUT drains it.
+ *
+ * A connection which fails, or whose peer hangs up, is taken out of
+ * epoll right away, but freed only once its batch is back.
+ */
+
+#define READ_CHUNK 65536
+#define BATCH_MAX_BYTES (1 << 20)
+#define INPUT_LIMIT (4 << 20)
+#define OUTPUT_LIMIT (4 << 20)
+#define MAX_EVENTS 64
+
+typedef struct Buffer Buffer;
+
+struct Buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static void buffer_reserve(Buffer *b, size_t extra) {
+    if (b->len + extra <= b->cap) return;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + extra) cap *= 2;
+    b->data = realloc(b->data, cap);
+    if (!b->data) syserr("memory alloc failed!");
+    b->cap = cap;
+}
+
+static void buffer_append(Buffer *b, const void *data, size_t len) {
+    buffer_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+// Drops the first `len` bytes.
+static void buffer_consume(Buffer *b, size_t len) {
+    memmove(b->data, b->data + len, b->len - len);
+    b->len -= len;
+}
+
+typedef struct Conn Conn;
+
+struct Conn {
+    int fd;
+    uint32_t events; // Polled for, 0 once out of epoll.
+    Buffer in; // Received, not batched yet.
+    Buffer out; // Responses not sent yet, from `out_pos` on.
+    size_t out_pos;
+    Buffer batch; // Requests at a worker.
+    Buffer reply; // Their responses.
+    bool busy; // The batch is at a worker.
+    bool eof; // The peer has nothing more to send.
+    bool failed; // The connection is to be closed.
+    Conn *next; // In the work queue or the done list.
+    Conn *prev_conn, *next_conn; // All connections.
+};
+
+struct TreeServer {
+    Tree *tree;
+    char *path;
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;
+    atomic_bool stop;
+    Conn *conns;
+    Conn *closed; // Freed after the current round of events.
+
+    pthread_t *workers;
+    size_t n_workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_ready;
+    Conn *work_head, *work_tail;
+    Conn *done;
+    bool workers_stop;
+};
+
+// ----------------------------------------------
+// Workers.
+
+// Executes one request and appends its response to `reply`.
+static void execute(Tree *tree, const char *frame, Buffer *reply) {
+    TreeRequestHeader h;
+    memcpy(&h, frame, sizeof(h));
+    char path[MAX_PATH_LENGTH + 1];
+    char target[MAX_PATH_LENGTH + 1];
+    char *list = NULL;
+    int status = EINVAL;
+    if (h.path_len <= MAX_PATH_LENGTH && h.target_len <= MAX_PATH_LENGTH) {
+        memcpy(path, frame + sizeof(h), h.path_len);
+        path[h.path_len] = '\0';
+        memcpy(target, frame + sizeof(h) + h.path_len, h.target_len);
+        target[h.target_len] = '\0';
+
+        switch (h.op) {
+            case TREE_OP_LIST:
+                list = tree_list(tree, path);
+                status = list ? 0 : errno;
+                break;
+            case TREE_OP_CREATE:
+                status = tree_create(tree, path);
+                break;
+            case TREE_OP_REMOVE:
+                status = tree_remove(tree, path);
+                break;
+            case TREE_OP_MOVE:
+                status = tree_move(tree, path, target);
+                break;
+        }
+    }
+
+    size_t list_len = list ? strlen(list) : 0;
+    TreeResponseHeader r = {.size = sizeof(r) + list_len, .id = h.id, .status = status};
+    buffer_append(reply, &r, sizeof(r));
+    if (list) buffer_append(reply, list, list_len);
+    free(list);
+}
+
+static void *worker_main(void *arg) {
+    TreeServer *s = arg;
+    pthread_mutex_lock(&s->mutex);
+    while (true) {
+        while (!s->work_head && !s->workers_stop) {
+            pthread_cond_wait(&s->work_ready, &s->mutex);
+        }
+        Conn *c = s->work_head;
+        if (!c) break;
+        s->work_head = c->next;
+        if (!s->work_head) s->work_tail = NULL;
+        pthread_mutex_unlock(&s->mutex);
+
+        TreeRequestHeader h;
+        for (size_t pos = 0; pos < c->batch.len; pos += h.size) {
+            memcpy(&h, c->batch.data + pos, sizeof(h));
+            execute(s->tree, c->batch.data + pos, &c->reply);
+        }
+        c->batch.len = 0;
+
+        pthread_mutex_lock(&s->mutex);
+        c->next = s->done;
+        s->done = c;
+        uint64_t one = 1;
+        if (write(s->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) syserr("eventfd write failed");
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return NULL;
+}
+
+// ----------------------------------------------
+// Event loop.
+
+static void conn_new(TreeServer *s, int fd) {
+    Conn *c = calloc(1, sizeof(Conn));
+    if (!c) syserr("memory alloc failed!");
+    c->fd = fd;
+    c->events = EPOLLIN;
+    struct epoll_event ev = {.events = c->events, .data.ptr = c};
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        close(fd);
+        free(c);
+        return;
+    }
+    c->next_conn = s->conns;
+    if (s->conns) s->conns->prev_conn = c;
+    s->conns = c;
+}
+
+static void conn_unlink(TreeServer *s, Conn *c) {
+    if (c->prev_conn) c->prev_conn->next_conn = c->next_conn;
+    else s->conns = c->next_conn;
+    if (c->next_conn) c->next_conn->prev_conn = c->prev_conn;
+}
+
+static void conn_free(Conn *c) {
+    close(c->fd);
+    free(c->in.data);
+    free(c->out.data);
+    free(c->batch.data);
+    free(c->reply.data);
+    free(c);
+}
+
+// Whether too many responses wait to be sent to take more requests.
+static bool conn_backlogged(const Conn *c) {
+    return c->out.len - c->out_pos > OUTPUT_LIMIT;
+}
+
+static void accept_all(TreeServer *s) {
+    int fd;
+    while ((fd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        conn_new(s, fd);
+    }
+}
+
+static void conn_read(Conn *c) {
+    while (!c->eof && !c->failed && c->in.len < INPUT_LIMIT && !conn_backlogged(c)) {
+        buffer_reserve(&c->in, READ_CHUNK);
+        ssize_t n = read(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len);
+        if (n > 0) {
+            c->in.len += n;
+        } else if (n == 0) {
+            c->eof = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            c->failed = true;
+        }
+    }
+}
+
+static void conn_write(Conn *c) {
+    while (!c->failed && c->out_pos < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->out_pos, c->out.len - c->out_pos, MSG_NOSIGNAL);
+        if (n >= 0) {
+            c->out_pos += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            c->failed = true;
+        }
+    }
+    c->out.len = 0;
+    c->out_pos = 0;
+}
+
+// Hands all complete requests received so far to a worker,
+// unless a batch is out already or the output is backlogged.
+static void conn_dispatch(TreeServer *s, Conn *c) {
+    if (c->busy || c->failed || conn_backlogged(c)) return;
+    size_t cut = 0;
+    while (cut < BATCH_MAX_BYTES && c->in.len - cut >= sizeof(TreeRequestHeader)) {
+        TreeRequestHeader h;
+        memcpy(&h, c->in.data + cut, sizeof(h));
+        if (h.size != sizeof(h) + h.path_len + h.target_len || h.size > TREE_MAX_REQUEST) {
+            c->failed = true; // Not our protocol.
+            return;
+        }
+        if (c->in.len - cut < h.size) break;
+        cut += h.size;
+    }
+    if (cut == 0) return;
+
+    buffer_append(&c->batch, c->in.data, cut);
+    buffer_consume(&c->in, cut);
+    c->busy = true;
+    pthread_mutex_lock(&s->mutex);
+    c->next = NULL;
+    if (s->work_tail) s->work_tail->next = c;
+    else s->work_head = c;
+    s->work_tail = c;
+    pthread_cond_signal(&s->work_ready);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+// Brings the epoll registration up to date, or retires the connection.
+static void conn_update(TreeServer *s, Conn *c) {
+    bool finished = c->eof && !c->busy && c->out.len == 0;
+    if (c->failed || finished) {
+        if (c->events != 0) {
+            epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+            c->events = 0;
+        }
+        if (!c->busy) {
+            // It may still come up in the current round of events.
+            conn_unlink(s, c);
+            c->next_conn = s->closed;
+            s->closed = c;
+        }
+        return;
+    }
+
+    uint32_t events = 0;
+    if (!c->eof && c->in.len < INPUT_LIMIT && !conn_backlogged(c)) events |= EPOLLIN;
+    if (c->out.len > 0) events |= EPOLLOUT;
+    // With nothing to poll for, a peer's hang-up would still be reported over and over.
+    if (events == 0) events = EPOLLET;
+    if (events == c->events) return;
+    struct epoll_event ev = {.events = events, .data.ptr = c};
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+// Takes back batches executed by the workers.
+static void collect_done(TreeServer *s) {
+    uint64_t count;
+    if (read(s->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) syserr("eventfd read failed");
+    pthread_mutex_lock(&s->mutex);
+    Conn *done = s->done;
+    s->done = NULL;
+    pthread_mutex_unlock(&s->mutex);
+
+    while (done) {
+        Conn *c = done;
+        done = c->next;
+        c->busy = false;
+        if (c->out.len == 0) {
+            Buffer out = c->out;
+            c->out = c->reply;
+            c->reply = out;
+        } else {
+            buffer_consume(&c->out, c->out_pos);
+            c->out_pos = 0;
+            buffer_append(&c->out, c->reply.data, c->reply.len);
+        }
+        c->reply.len = 0;
+        conn_write(c);
+        conn_dispatch(s, c);
+        conn_update(s, c);
+    }
+}
+
+int tree_server_run(TreeServer *s) {
+    assert(s != NULL);
+    struct epoll_event events[MAX_EVENTS];
+    while (!atomic_load(&s->stop)) {
+        int n = epoll_wait(s->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        for (int i = 0; i < n; ++i) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &s->listen_fd) {
+                accept_all(s);
+            } else if (ptr == &s->wake_fd) {
+                collect_done(s);
+            } else {
+                Conn *c = ptr;
+                if (c->events == 0) continue; // Retired earlier in this round.
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) c->failed = true;
+                if (events[i].events & EPOLLIN) conn_read(c);
+                if (events[i].events & EPOLLOUT) conn_write(c);
+                conn_dispatch(s, c);
+                conn_update(s, c);
+            }
+        }
+        while (s->closed) {
+            Conn *c = s->closed;
+            s->closed = c->next_conn;
+            conn_free(c);
+        }
+    }
+    return 0;
+}
+
+void tree_server_stop(TreeServer *s) {
+    atomic_store(&s->stop, true);
+    uint64_t one = 1;
+    ssize_t ret = write(s->wake_fd, &one, sizeof(one));
+    (void) ret;
+}
+
+// ----------------------------------------------
+
+TreeServer *tree_server_new(Tree *tree, const char *path, size_t n_workers) {
+    assert(tree && path);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path) || n_workers == 0) {
+        errno = strlen(path) >= sizeof(addr.sun_path) ? ENAMETOOLONG : EINVAL;
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    TreeServer *s = calloc(1, sizeof(TreeServer));
+    if (!s) syserr("memory alloc failed!");
+    s->tree = tree;
+    s->path = strdup(path);
+    if (!s->path) syserr("memory alloc failed!");
+    s->epoll_fd = -1;
+    s->wake_fd = -1;
+    atomic_init(&s->stop, false);
+
+    s->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->listen_fd >= 0) unlink(path);
+    bool ok = s->listen_fd >= 0
+              && bind(s->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0
+              && listen(s->listen_fd, SOMAXCONN) == 0
+              && (s->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) >= 0
+              && (s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0;
+    if (ok) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &s->listen_fd};
+        ok = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev) == 0;
+        ev.data.ptr = &s->wake_fd;
+        ok = ok && epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->wake_fd, &ev) == 0;
+    }
+    if (!ok) {
+        int err = errno;
+        if (s->wake_fd >= 0) close(s->wake_fd);
+        if (s->epoll_fd >= 0) close(s->epoll_fd);
+        if (s->listen_fd >= 0) close(s->listen_fd);
+        free(s->path);
+        free(s);
+        errno = err;
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&s->mutex, 0) != 0) syserr("mutex init failed");
+    if (pthread_cond_init(&s->work_ready, 0) != 0) syserr("cond init failed");
+    s->n_workers = n_workers;
+    s->workers = malloc(n_workers * sizeof(pthread_t));
+    if (!s->workers) syserr("memory alloc failed!");
+    for (size_t i = 0; i < n_workers; ++i) {
+        if (pthread_create(&s->workers[i], NULL, worker_main, s) != 0) syserr("pthread_create failed");
+    }
+    return s;
+}
+
+void tree_server_free(TreeServer *s) {
+    assert(s != NULL);
+    pthread_mutex_lock(&s->mutex);
+    s->workers_stop = true;
+    pthread_cond_broadcast(&s->work_ready);
+    pthread_mutex_unlock(&s->mutex);
+    for (size_t i = 0; i < s->n_workers; ++i) {
+        pthread_join(s->workers[i], NULL);
+    }
+    free(s->workers);
+
+    // Batches which came back after the loop stopped are not on any other list.
+    while (s->conns) {
+        Conn *c = s->conns;
+        conn_unlink(s, c);
+        conn_free(c);
+    }
+    close(s->wake_fd);
+    close(s->epoll_fd);
+    close(s->listen_fd);
+    unlink(s->path);
+    free(s->path);
+    pthread_cond_destroy(&s->work_ready);
+    pthread_mutex_destroy(&s->mutex);
+    free(s);
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <stddef.h>
+#include "Tree.h"
+
+// Server sharing a tree with other processes over a Unix domain socket
+// (protocol: TreeProtocol.h, client: TreeClient.h).
+typedef struct TreeServer TreeServer;
+
+// Create a server of `tree` listening on Unix socket `path`
+// (replacing a stale socket file there), which executes requests
+// on `n_workers` threads. Returns NULL and sets errno on failure.
+TreeServer* tree_server_new(Tree* tree, const char* path, size_t n_workers);
+
+// Run the event loop in the calling thread until tree_server_stop is called.
+// Returns 0, or errno of a failed epoll_wait.
+int tree_server_run(TreeServer* server);
+
+// Make tree_server_run return. Safe to call from any thread and from a signal handler.
+void tree_server_stop(TreeServer* server);
+
+// Wait for requests being executed, close all connections, remove the socket file
+// and free the server. The tree is not freed. Not to be called during tree_server_run.
+void tree_server_free(TreeServer* server);
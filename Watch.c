@@ -0,0 +1,433 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "Watch.h"
+#include "Epoch.h"
+#include "err.h"
+
+/**
+ * Change notifications.
+ *
+ * Every watch owns a bounded ring of events,
+ * filled by any number of mutating threads and drained
+ * by a single consumer. The ring is lock-free:
+ * each slot carries a sequence number telling whether
+ * it is free for the producer holding position `pos`
+ * (seq == pos) or ready for the consumer (seq == pos + 1).
+ * Producers claim positions with a CAS on `head`;
+ * the consumer owns `tail` exclusively.
+ *
+ * When the ring is full, the event is dropped and
+ * the `overflow` flag is raised. The consumer reports it
+ * as a TREE_EVENT_OVERFLOW after the buffered events.
+ *
+ * Publishers find watches in an index: a trie of the watched
+ * paths, one node per path component, rebuilt by every
+ * watch_add() and watch_remove() and never changed afterwards.
+ * A publisher walks the trie along the event path and stops
+ * at the first component nobody watches, so changes outside
+ * watched subtrees cost a lookup or two, and without watches
+ * a single relaxed load (of a NULL index).
+ *
+ * Publishers take no lock, as they run with directories
+ * write-locked. Instead, an index (and a watch removed
+ * with it) is freed only once no publisher can still see it,
+ * which is told by epochs (see Epoch.h): a publisher announces the epoch
+ * it entered at in its thread's own record, and watch_add()
+ * or watch_remove() moves to a new epoch after swapping
+ * the index and waits until no record shows an older one.
+ */
+
+typedef struct WatchSlot WatchSlot;
+
+struct WatchSlot {
+    atomic_size_t seq;
+    TreeEvent event;
+};
+
+struct TreeWatch {
+    _Alignas(64) atomic_size_t head; // next position to be claimed by a producer
+    _Alignas(64) size_t tail; // next position to be read by the consumer
+    TreeEvent pending; // event read from the ring, but not returned yet
+    bool has_pending;
+    atomic_bool overflow;
+    char *path;
+    size_t path_len;
+    bool recursive;
+    size_t mask; // capacity - 1
+    WatchSlot *slots;
+    TreeWatch *next; // next watch on the list
+};
+
+typedef struct WatchNode WatchNode;
+
+// Node of the index, standing for a path.
+struct WatchNode {
+    const char *name; // last component of the path (not terminated), in a watch's path
+    size_t name_len;
+    WatchNode *children;
+    size_t n_children;
+    TreeWatch **watches; // watches of exactly this path
+    size_t n_watches;
+};
+
+struct WatchList {
+    _Atomic(WatchNode *) index; // root of the index, NULL without watches
+    pthread_mutex_t mutex; // guards `first`, serializes changes of the index
+    TreeWatch *first;
+};
+
+static WatchNode *node_child(WatchNode *node, const char *name, size_t name_len) {
+    for (size_t i = 0; i < node->n_children; ++i) {
+        WatchNode *child = &node->children[i];
+        if (child->name_len == name_len && memcmp(child->name, name, name_len) == 0)
+            return child;
+    }
+    return NULL;
+}
+
+static void node_init(WatchNode *node, const char *name, size_t name_len) {
+    node->name = name;
+    node->name_len = name_len;
+    node->children = NULL;
+    node->n_children = 0;
+    node->watches = NULL;
+    node->n_watches = 0;
+}
+
+static void index_insert(WatchNode *root, TreeWatch *watch) {
+    WatchNode *node = root;
+    const char *rest = watch->path + 1;
+    while (*rest) {
+        const char *end = strchr(rest, '/');
+        WatchNode *child = node_child(node, rest, end - rest);
+        if (!child) {
+            node->children = realloc(node->children, (node->n_children + 1) * sizeof(WatchNode));
+            if (!node->children) syserr("memory alloc failed!");
+            child = &node->children[node->n_children++];
+            node_init(child, rest, end - rest);
+        }
+        node = child;
+        rest = end + 1;
+    }
+    node->watches = realloc(node->watches, (node->n_watches + 1) * sizeof(TreeWatch *));
+    if (!node->watches) syserr("memory alloc failed!");
+    node->watches[node->n_watches++] = watch;
+}
+
+// Builds the index of watches on the list, NULL if there are none.
+static WatchNode *index_build(WatchList *list) {
+    if (!list->first) return NULL;
+    WatchNode *root = malloc(sizeof(WatchNode));
+    if (!root) syserr("memory alloc failed!");
+    node_init(root, "", 0);
+    for (TreeWatch *watch = list->first; watch; watch = watch->next) {
+        index_insert(root, watch);
+    }
+    return root;
+}
+
+static void node_free(WatchNode *node) {
+    for (size_t i = 0; i < node->n_children; ++i) {
+        node_free(&node->children[i]);
+    }
+    free(node->children);
+    free(node->watches);
+}
+
+static void index_free(WatchNode *root) {
+    if (!root) return;
+    node_free(root);
+    free(root);
+}
+
+WatchList *watch_list_new() {
+    WatchList *list = malloc(sizeof(WatchList));
+    if (!list) syserr("memory alloc failed!");
+
+    atomic_init(&list->index, NULL);
+    pthread_mutex_init(&list->mutex, NULL);
+    list->first = NULL;
+    return list;
+}
+
+static void watch_free(TreeWatch *watch) {
+    TreeEvent event;
+    while (watch_read(watch, &event, 1)) {
+        tree_event_clear(&event);
+    }
+    free(watch->slots);
+    free(watch->path);
+    free(watch);
+}
+
+void watch_list_free(WatchList *list) {
+    index_free(atomic_load(&list->index));
+    while (list->first) {
+        TreeWatch *watch = list->first;
+        list->first = watch->next;
+        watch_free(watch);
+    }
+    pthread_mutex_destroy(&list->mutex);
+    free(list);
+}
+
+// Replaces the index after a change of the list, which must be locked.
+// Returns the old index, to be freed after epoch_synchronize().
+static WatchNode *index_swap(WatchList *list) {
+    WatchNode *old = atomic_load_explicit(&list->index, memory_order_relaxed);
+    atomic_store(&list->index, index_build(list));
+    return old;
+}
+
+TreeWatch *watch_add(WatchList *list, const char *path, bool recursive, size_t capacity) {
+    TreeWatch *watch = malloc(sizeof(TreeWatch));
+    if (!watch) syserr("memory alloc failed!");
+
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    watch->slots = malloc(size * sizeof(WatchSlot));
+    if (!watch->slots) syserr("memory alloc failed!");
+    for (size_t i = 0; i < size; ++i) {
+        atomic_init(&watch->slots[i].seq, i);
+    }
+    watch->mask = size - 1;
+
+    watch->path = strdup(path);
+    if (!watch->path) syserr("memory alloc failed!");
+    watch->path_len = strlen(path);
+    watch->recursive = recursive;
+    atomic_init(&watch->head, 0);
+    watch->tail = 0;
+    watch->has_pending = false;
+    atomic_init(&watch->overflow, false);
+
+    pthread_mutex_lock(&list->mutex);
+    watch->next = list->first;
+    list->first = watch;
+    WatchNode *old = index_swap(list);
+    pthread_mutex_unlock(&list->mutex);
+    epoch_synchronize();
+    index_free(old);
+    return watch;
+}
+
+void watch_remove(WatchList *list, TreeWatch *watch) {
+    pthread_mutex_lock(&list->mutex);
+    TreeWatch **pw = &list->first;
+    while (*pw && *pw != watch) {
+        pw = &(*pw)->next;
+    }
+    WatchNode *old = NULL;
+    if (*pw) {
+        *pw = watch->next;
+        old = index_swap(list);
+    }
+    pthread_mutex_unlock(&list->mutex);
+    epoch_synchronize();
+    index_free(old);
+    watch_free(watch);
+}
+
+// Returns whether an event concerning `path` should be seen by the watch:
+// either the watched directory itself, its child,
+// or (for recursive watches) any of its descendants.
+static bool watch_matches(TreeWatch *watch, const char *path) {
+    if (!path || strncmp(watch->path, path, watch->path_len) != 0) return false;
+    const char *rest = path + watch->path_len;
+    if (*rest == '\0' || watch->recursive) return true;
+    // `rest` is "name/" for a child.
+    return strchr(rest, '/')[1] == '\0';
+}
+
+// Returns whether the watch gets an event through `path`
+// (its path or target): when it matches, or when a move
+// takes the watched directory or one of its ancestors away
+// or puts them in place.
+static bool watch_wants(TreeWatch *watch, TreeEventType type, const char *path) {
+    return watch_matches(watch, path)
+           || (type == TREE_EVENT_MOVE && strncmp(watch->path, path, strlen(path)) == 0);
+}
+
+static void watch_push(TreeWatch *watch, TreeEventType type, const char *path, const char *target) {
+    size_t pos = atomic_load_explicit(&watch->head, memory_order_relaxed);
+    WatchSlot *slot;
+    while (true) {
+        slot = &watch->slots[pos & watch->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t) (seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&watch->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // Ring is full.
+            atomic_store_explicit(&watch->overflow, true, memory_order_release);
+            return;
+        } else {
+            pos = atomic_load_explicit(&watch->head, memory_order_relaxed);
+        }
+    }
+
+    slot->event.type = type;
+    slot->event.path = strdup(path);
+    slot->event.target = target ? strdup(target) : NULL;
+    if (!slot->event.path || (target && !slot->event.target)) syserr("memory alloc failed!");
+    slot->event.count = 1;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+typedef struct Delivery Delivery;
+
+// An event, and the path its watches are looked for along.
+struct Delivery {
+    TreeEventType type;
+    const char *path;
+    const char *target;
+    const char *key; // `path` or `target`
+    const char *served; // the other one if it was looked up already, else NULL
+};
+
+static void deliver(const Delivery *e, TreeWatch *watch) {
+    if (e->served && watch_wants(watch, e->type, e->served)) return;
+    watch_push(watch, e->type, e->path, e->target);
+}
+
+// Delivers the moved event to all watches below `node`.
+static void deliver_below(const Delivery *e, WatchNode *node) {
+    for (size_t i = 0; i < node->n_children; ++i) {
+        WatchNode *child = &node->children[i];
+        for (size_t j = 0; j < child->n_watches; ++j) {
+            deliver(e, child->watches[j]);
+        }
+        deliver_below(e, child);
+    }
+}
+
+// Delivers the event to watches wanting it through `e->key`.
+static void index_deliver(const Delivery *e, WatchNode *node) {
+    const char *rest = e->key + 1;
+    while (true) {
+        for (size_t i = 0; i < node->n_watches; ++i) {
+            if (watch_matches(node->watches[i], e->key)) deliver(e, node->watches[i]);
+        }
+        if (*rest == '\0') break;
+        const char *end = strchr(rest, '/');
+        node = node_child(node, rest, end - rest);
+        if (!node) return;
+        rest = end + 1;
+    }
+    if (e->type == TREE_EVENT_MOVE) deliver_below(e, node);
+}
+
+void watch_publish(WatchList *list, TreeEventType type, const char *path, const char *target) {
+    if (!atomic_load_explicit(&list->index, memory_order_relaxed)) return;
+
+    EpochRecord *record = epoch_enter();
+    WatchNode *root = atomic_load(&list->index);
+    if (root) {
+        Delivery e = {.type = type, .path = path, .target = target, .key = path, .served = NULL};
+        index_deliver(&e, root);
+        if (target) {
+            e.key = target;
+            e.served = path;
+            index_deliver(&e, root);
+        }
+    }
+    epoch_exit(record);
+}
+
+bool watch_covers(WatchList *list, const char *path) {
+    if (!atomic_load_explicit(&list->index, memory_order_relaxed)) return false;
+
+    EpochRecord *record = epoch_enter();
+    WatchNode *node = atomic_load(&list->index);
+    bool covered = false;
+    const char *rest = path + 1;
+    while (node && !covered) {
+        if (*rest == '\0') {
+            // Watches of `path` see its children, those below it anything.
+            covered = node->n_watches > 0 || node->n_children > 0;
+            break;
+        }
+        for (size_t i = 0; i < node->n_watches && !covered; ++i) {
+            covered = node->watches[i]->recursive;
+        }
+        const char *end = strchr(rest, '/');
+        node = node_child(node, rest, end - rest);
+        rest = end + 1;
+    }
+    epoch_exit(record);
+    return covered;
+}
+
+// Takes the oldest event from the ring, if there is one.
+static bool watch_pop(TreeWatch *watch, TreeEvent *event) {
+    WatchSlot *slot = &watch->slots[watch->tail & watch->mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq != watch->tail + 1) return false;
+
+    *event = slot->event;
+    atomic_store_explicit(&slot->seq, watch->tail + watch->mask + 1, memory_order_release);
+    ++watch->tail;
+    return true;
+}
+
+static bool same_string(const char *s1, const char *s2) {
+    if (!s1 || !s2) return s1 == s2;
+    return strcmp(s1, s2) == 0;
+}
+
+static bool same_event(const TreeEvent *e1, const TreeEvent *e2) {
+    return e1->type == e2->type && same_string(e1->path, e2->path)
+           && same_string(e1->target, e2->target);
+}
+
+void tree_event_clear(TreeEvent *event) {
+    free(event->path);
+    free(event->target);
+    event->path = NULL;
+    event->target = NULL;
+}
+
+size_t watch_read(TreeWatch *watch, TreeEvent *events, size_t max_events) {
+    size_t n = 0;
+    TreeEvent event;
+    while (n < max_events) {
+        if (watch->has_pending) {
+            event = watch->pending;
+            watch->has_pending = false;
+        } else if (!watch_pop(watch, &event)) {
+            break;
+        }
+
+        if (n > 0 && same_event(&events[n - 1], &event)) {
+            // Coalesce identical consecutive events.
+            events[n - 1].count += event.count;
+            tree_event_clear(&event);
+        } else {
+            events[n++] = event;
+        }
+    }
+
+    // Try to coalesce also the first event that does not fit.
+    while (n == max_events && n > 0 && !watch->has_pending && watch_pop(watch, &event)) {
+        if (same_event(&events[n - 1], &event)) {
+            events[n - 1].count += event.count;
+            tree_event_clear(&event);
+        } else {
+            watch->pending = event;
+            watch->has_pending = true;
+        }
+    }
+
+    if (n < max_events && atomic_exchange_explicit(&watch->overflow, false, memory_order_acquire)) {
+        events[n].type = TREE_EVENT_OVERFLOW;
+        events[n].path = NULL;
+        events[n].target = NULL;
+        events[n].count = 1;
+        ++n;
+    }
+    return n;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include "Tree.h"
+
+// Default number of events a watch can buffer before it overflows.
+#define WATCH_CAPACITY 1024
+
+// Set of watches of a single tree.
+typedef struct WatchList WatchList;
+
+WatchList *watch_list_new();
+
+// Frees the list together with watches still registered on it.
+void watch_list_free(WatchList *list);
+
+// Registers a new watch of `path` (and its whole subtree if `recursive`),
+// buffering at most `capacity` events (rounded up to a power of two).
+TreeWatch *watch_add(WatchList *list, const char *path, bool recursive, size_t capacity);
+
+// Unregisters and frees the watch.
+void watch_remove(WatchList *list, TreeWatch *watch);
+
+// Delivers an event to every matching watch, and for a move also to
+// watches below its source or target. `target` is only given for TREE_EVENT_MOVE.
+// Never blocks. Costs a single relaxed load when there are no watches,
+// and a few lookups when no watch is on the way to `path` or `target`.
+void watch_publish(WatchList *list, TreeEventType type, const char *path, const char *target);
+
+// Returns whether some watch would get an event about a directory below `path`.
+bool watch_covers(WatchList *list, const char *path);
+
+// Moves up to `max_events` buffered events to `events`, see tree_watch_read().
+size_t watch_read(TreeWatch *watch, TreeEvent *events, size_t max_events);
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "Tree.h"
+#include "err.h"
+
+/*
+ * Benchmark of tree_bulk_load against serial tree_create,
+ * and of tree_free_parallel against tree_free.
+ *
+ * Usage: bulk_load_bench [fanout] [depth] [max_threads]
+ *
+ * Builds a complete tree with `fanout` children per directory,
+ * `depth` levels deep, into a new tree: once with one tree_create
+ * per path, then with tree_bulk_load on 1, 2, 4, ... up to
+ * max_threads threads, each tree being freed with tree_free_parallel
+ * on as many threads. Prints throughput in directories per second
+ * and the speedup over tree_create (or tree_free).
+ */
+
+typedef struct Paths Paths;
+
+struct Paths {
+    char **paths;
+    size_t n_paths;
+    size_t next;
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Appends paths of the subtree below `prefix` in sorted order.
+// Names have a fixed length, so their order is the order of their numbers.
+static void generate(Paths *p, char *prefix, size_t prefix_len, size_t fanout, size_t depth) {
+    if (depth == 0) return;
+    for (size_t i = 0; i < fanout; ++i) {
+        size_t len = prefix_len;
+        for (size_t k = fanout, j = i; k > 1; k = (k + 25) / 26, j /= 26) {
+            prefix[len++] = 'a' + j % 26;
+        }
+        if (len == prefix_len) prefix[len++] = 'a';
+        // Digits were written least significant first.
+        for (size_t a = prefix_len, b = len - 1; a < b; ++a, --b) {
+            char c = prefix[a];
+            prefix[a] = prefix[b];
+            prefix[b] = c;
+        }
+        prefix[len++] = '/';
+        prefix[len] = '\0';
+        p->paths[p->n_paths] = strdup(prefix);
+        if (!p->paths[p->n_paths]) syserr("memory alloc failed!");
+        ++p->n_paths;
+        generate(p, prefix, len, fanout, depth - 1);
+    }
+}
+
+static const char *next_path(void *arg) {
+    Paths *p = arg;
+    return p->next < p->n_paths ? p->paths[p->next++] : NULL;
+}
+
+static void report(const char *name, size_t n, uint64_t ns, uint64_t base_ns) {
+    printf("%-16s %10.0f dirs/s  %6.2fx\n", name, n * 1e9 / ns, (double) base_ns / ns);
+}
+
+int main(int argc, char *argv[]) {
+    size_t fanout = argc > 1 ? atoi(argv[1]) : 10;
+    size_t depth = argc > 2 ? atoi(argv[2]) : 5;
+    size_t max_threads = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (fanout == 0 || depth == 0 || max_threads == 0)
+        fatal("usage: %s [fanout] [depth] [max_threads]", argv[0]);
+
+    size_t n = 0;
+    for (size_t level = 1, count = 1; level <= depth; ++level) {
+        count *= fanout;
+        n += count;
+    }
+    Paths p = {.n_paths = 0, .next = 0};
+    p.paths = malloc(n * sizeof(char *));
+    if (!p.paths) syserr("memory alloc failed!");
+    char prefix[4096] = "/";
+    generate(&p, prefix, 1, fanout, depth);
+    printf("%zu directories (fanout %zu, depth %zu)\n", n, fanout, depth);
+
+    Tree *tree = tree_new();
+    uint64_t begin = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        if (tree_create(tree, p.paths[i]) != 0) fatal("tree_create failed");
+    }
+    uint64_t base_ns = now_ns() - begin;
+    begin = now_ns();
+    tree_free(tree);
+    uint64_t free_base_ns = now_ns() - begin;
+    report("tree_create", n, base_ns, base_ns);
+    report("tree_free", n, free_base_ns, free_base_ns);
+
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        tree = tree_new();
+        p.next = 0;
+        begin = now_ns();
+        if (tree_bulk_load(tree, "/", next_path, &p, threads) != 0) fatal("tree_bulk_load failed");
+        uint64_t ns = now_ns() - begin;
+        begin = now_ns();
+        tree_free_parallel(tree, threads);
+        uint64_t free_ns = now_ns() - begin;
+        char name[32];
+        snprintf(name, sizeof(name), "bulk_load x%zu", threads);
+        report(name, n, ns, base_ns);
+        snprintf(name, sizeof(name), "free x%zu", threads);
+        report(name, n, free_ns, free_base_ns);
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        free(p.paths[i]);
+    }
+    free(p.paths);
+    return 0;
+}
@@ -38,6 +38,14 @@ const char *split_path(const char *path, char *component) {
     return subpath;
 }
 
+const char *split_path_id(const char *path, NameId *id) {
+    const char *subpath = strchr(path + 1, '/'); // Pointer to second '/' character.
+    if (!subpath) // Path is "/".
+        return NULL;
+    *id = name_find(path + 1, subpath - (path + 1));
+    return subpath;
+}
+
 char *make_path_to_parent(const char *path, char *component) {
     size_t len = strlen(path);
     if (len == 1) // Path is "/".
@@ -74,8 +82,10 @@ const char **make_map_contents_array(HashMap *map) {
     const char **result = calloc(n_keys + 1, sizeof(char *));
     HashMapIterator it = hmap_iterator(map);
     const char **key = result;
+    NameId id;
     void *value = NULL;
-    while (hmap_next(map, &it, key, &value)) {
+    while (hmap_next(map, &it, &id, &value)) {
+        *key = name_str(id);
         key++;
     }
     *key = NULL; // Set last array element to NULL.
@@ -140,6 +150,11 @@ char *make_common_path(const char *path1, const char *path2) {
            && path1[i] == path2[i]) {
         ++i;
     }
+    // Cut back to the last common '/', so that partially common names
+    // (as in "/ab/" and "/ac/") are not taken into the result.
+    while (i > 0 && path1[i - 1] != '/') {
+        --i;
+    }
 
     size_t common_len = i;
     char *subpath = malloc(common_len + 1);
@@ -162,4 +177,46 @@ int split_common_path(char **path1, char **path2) {
     *path2 += common_path_len - 1;
     free(common_path);
     return 0;
+}
+
+bool is_pattern_valid(const char *pattern) {
+    size_t len = strlen(pattern);
+    if (len == 0 || len > MAX_PATH_LENGTH)
+        return false;
+    if (pattern[0] != '/' || pattern[len - 1] != '/')
+        return false;
+    const char *name_start = pattern + 1;
+    while (name_start < pattern + len) {
+        char *name_end = strchr(name_start, '/');
+        if (!name_end || name_end == name_start || name_end > name_start + MAX_FOLDER_NAME_LENGTH)
+            return false;
+        for (const char *p = name_start; p != name_end; ++p)
+            if ((*p < 'a' || *p > 'z') && *p != '*' && *p != '?')
+                return false;
+        name_start = name_end + 1;
+    }
+    return true;
+}
+
+bool match_component(const char *pattern, const char *name) {
+    // Greedy matching with backtracking to the last '*'.
+    const char *star = NULL;
+    const char *star_name = NULL;
+    while (*name) {
+        if (*pattern == '?' || *pattern == *name) {
+            ++pattern;
+            ++name;
+        } else if (*pattern == '*') {
+            star = pattern++;
+            star_name = name;
+        } else if (star) {
+            pattern = star + 1;
+            name = ++star_name;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*')
+        ++pattern;
+    return *pattern == '\0';
 }
\ No newline at end of file
@@ -29,6 +29,10 @@ bool is_path_valid(const char *path);
 //         printf("%s", component);
 const char *split_path(const char *path, char *component);
 
+// As `split_path`, but set `*id` to the id of the first component (see NameTable.h),
+// or to NAME_NONE if no such name was ever interned (so no folder has it).
+const char *split_path_id(const char *path, NameId *id);
+
 // Return a copy of the subpath obtained by removing the last component.
 // The caller should free the result, unless it is NULL.
 // Args:
@@ -41,7 +45,7 @@ char *make_path_to_parent(const char *path, char *component);
 
 // Return an array containing all keys, lexicographically sorted.
 // The result is null-terminated.
-// Keys are not copied, they are only valid as long as the map.
+// Keys are interned names (see `name_str`), not copies.
 // The caller should free the result.
 const char **make_map_contents_array(HashMap *map);
 
@@ -53,6 +57,18 @@ char *make_map_contents_string(HashMap *map);
 // Return true if, and only if `path1` is a subpath of `path2`.
 bool is_subpath(const char *path1, const char *path2);
 
+// Return a copy of the longest path which both `path1` and `path2` are subpaths of
+// (or equal to). The caller should free the result.
 char *make_common_path(const char *path1, const char *path2);
 
 int split_common_path(char **path1, char **path2);
+
+
+// Return whether a glob pattern is valid.
+// Valid patterns are like valid paths (see `is_path_valid`), except that folder names
+// may also contain '*' (any sequence of characters) and '?' (any single character).
+// A component equal to "**" matches any number (including zero) of nested folders.
+bool is_pattern_valid(const char *pattern);
+
+// Return whether folder name `name` matches a single pattern component `pattern`.
+bool match_component(const char *pattern, const char *name);
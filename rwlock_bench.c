@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "ReadWriteLock.h"
+#include "err.h"
+
+/*
+ * Microbenchmark of the read-write lock implementation
+ * it is linked with (RWLOCK_BENCH_BACKEND names it).
+ *
+ * Usage: rwlock_bench [duration_ms] [max_threads]
+ *
+ * For thread counts 1, 2, 4, ... up to max_threads it measures:
+ * - latency: uncontended acquire + release, in ns
+ *   (for upgrade: upgradable acquire, upgrade and release),
+ * - readers: throughput of readers only, in ops/s,
+ * - writer: latency of one writer acquiring against
+ *   all other threads reading (mean, p99, max, in ns),
+ * - fairness: 90% reads / 10% writes on every thread;
+ *   throughput, ratio of the slowest to the fastest thread,
+ *   and the longest single wait (starvation bound) in ns.
+ */
+
+#ifndef RWLOCK_BENCH_BACKEND
+#define RWLOCK_BENCH_BACKEND "unknown"
+#endif
+
+// Touched inside critical sections, so they are not empty.
+static volatile uint64_t shared_counter;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int compare_u64(const void *p1, const void *p2) {
+    uint64_t a = *(const uint64_t *) p1;
+    uint64_t b = *(const uint64_t *) p2;
+    return (a > b) - (a < b);
+}
+
+typedef struct Bench Bench;
+
+struct Bench {
+    RWLock *lock;
+    atomic_bool start;
+    atomic_bool stop;
+};
+
+typedef struct Worker Worker;
+
+struct Worker {
+    Bench *bench;
+    pthread_t thread;
+    unsigned seed;
+    int write_percent; // -1: dedicated writer measuring its latency
+    uint64_t ops;
+    uint64_t max_wait;
+    uint64_t *latencies;
+    size_t n_latencies;
+    size_t cap_latencies;
+};
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    Bench *b = w->bench;
+    while (!atomic_load(&b->start)) {}
+
+    while (!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+        bool write = w->write_percent < 0 || (int) (rand_r(&w->seed) % 100) < w->write_percent;
+        uint64_t begin = now_ns();
+        if (write) rwlock_wr_lock(b->lock);
+        else rwlock_rd_lock(b->lock);
+        uint64_t wait = now_ns() - begin;
+
+        shared_counter = shared_counter + 1;
+
+        if (write) rwlock_wr_unlock(b->lock);
+        else rwlock_rd_unlock(b->lock);
+
+        ++w->ops;
+        if (wait > w->max_wait) w->max_wait = wait;
+        if (w->write_percent < 0) {
+            if (w->n_latencies == w->cap_latencies) {
+                w->cap_latencies = w->cap_latencies ? 2 * w->cap_latencies : 1024;
+                w->latencies = realloc(w->latencies, w->cap_latencies * sizeof(uint64_t));
+                if (!w->latencies) syserr("memory alloc failed!");
+            }
+            w->latencies[w->n_latencies++] = wait;
+            // Give readers time to pile up again.
+            usleep(50);
+        }
+    }
+    return NULL;
+}
+
+// Runs `n_threads` workers for `duration_ms`.
+// Worker 0 is a dedicated writer if `dedicated_writer`.
+static Worker *run(size_t n_threads, int write_percent, bool dedicated_writer,
+                   unsigned duration_ms) {
+    Bench bench;
+    bench.lock = rwlock_new();
+    atomic_init(&bench.start, false);
+    atomic_init(&bench.stop, false);
+
+    Worker *workers = calloc(n_threads, sizeof(Worker));
+    if (!workers) syserr("memory alloc failed!");
+    for (size_t i = 0; i < n_threads; ++i) {
+        workers[i].bench = &bench;
+        workers[i].seed = i + 1;
+        workers[i].write_percent = (dedicated_writer && i == 0) ? -1 : write_percent;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+            syserr("pthread_create failed");
+    }
+
+    atomic_store(&bench.start, true);
+    usleep(duration_ms * 1000);
+    atomic_store(&bench.stop, true);
+
+    for (size_t i = 0; i < n_threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    rwlock_free(bench.lock);
+    return workers;
+}
+
+static void free_workers(Worker *workers, size_t n_threads) {
+    for (size_t i = 0; i < n_threads; ++i) {
+        free(workers[i].latencies);
+    }
+    free(workers);
+}
+
+static void bench_latency() {
+    RWLock *lock = rwlock_new();
+    const size_t n = 10000000;
+
+    uint64_t begin = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        rwlock_rd_lock(lock);
+        rwlock_rd_unlock(lock);
+    }
+    uint64_t rd = now_ns() - begin;
+
+    begin = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        rwlock_wr_lock(lock);
+        rwlock_wr_unlock(lock);
+    }
+    uint64_t wr = now_ns() - begin;
+
+    begin = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        rwlock_up_lock(lock);
+        rwlock_upgrade(lock);
+        rwlock_wr_unlock(lock);
+    }
+    uint64_t up = now_ns() - begin;
+
+    printf("%-8s latency  threads=1  read=%.1fns write=%.1fns upgrade=%.1fns\n",
+           RWLOCK_BENCH_BACKEND, (double) rd / n, (double) wr / n, (double) up / n);
+    rwlock_free(lock);
+}
+
+static void bench_readers(size_t n_threads, unsigned duration_ms) {
+    Worker *workers = run(n_threads, 0, false, duration_ms);
+    uint64_t ops = 0;
+    for (size_t i = 0; i < n_threads; ++i) {
+        ops += workers[i].ops;
+    }
+    printf("%-8s readers  threads=%-3zu ops/s=%.0f\n", RWLOCK_BENCH_BACKEND, n_threads,
+           ops * 1000.0 / duration_ms);
+    free_workers(workers, n_threads);
+}
+
+static void bench_writer(size_t n_threads, unsigned duration_ms) {
+    Worker *workers = run(n_threads, 0, true, duration_ms);
+    Worker *writer = &workers[0];
+    uint64_t sum = 0;
+    for (size_t i = 0; i < writer->n_latencies; ++i) {
+        sum += writer->latencies[i];
+    }
+    qsort(writer->latencies, writer->n_latencies, sizeof(uint64_t), compare_u64);
+    size_t n = writer->n_latencies;
+    printf("%-8s writer   threads=%-3zu acquires=%zu mean=%.0fns p99=%luns max=%luns\n",
+           RWLOCK_BENCH_BACKEND, n_threads, n, n ? (double) sum / n : 0.0,
+           n ? (unsigned long) writer->latencies[n * 99 / 100] : 0,
+           n ? (unsigned long) writer->latencies[n - 1] : 0);
+    free_workers(workers, n_threads);
+}
+
+static void bench_fairness(size_t n_threads, unsigned duration_ms) {
+    Worker *workers = run(n_threads, 10, false, duration_ms);
+    uint64_t ops = 0;
+    uint64_t min_ops = UINT64_MAX;
+    uint64_t max_ops = 0;
+    uint64_t max_wait = 0;
+    for (size_t i = 0; i < n_threads; ++i) {
+        ops += workers[i].ops;
+        if (workers[i].ops < min_ops) min_ops = workers[i].ops;
+        if (workers[i].ops > max_ops) max_ops = workers[i].ops;
+        if (workers[i].max_wait > max_wait) max_wait = workers[i].max_wait;
+    }
+    printf("%-8s fairness threads=%-3zu ops/s=%.0f min/max=%.3f max_wait=%luns\n",
+           RWLOCK_BENCH_BACKEND, n_threads, ops * 1000.0 / duration_ms,
+           max_ops ? (double) min_ops / max_ops : 0.0, (unsigned long) max_wait);
+    free_workers(workers, n_threads);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned duration_ms = argc > 1 ? atoi(argv[1]) : 200;
+    size_t max_threads = argc > 2 ? atoi(argv[2]) : 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    if (duration_ms == 0 || max_threads == 0) fatal("usage: %s [duration_ms] [max_threads]", argv[0]);
+
+    bench_latency();
+    for (size_t n = 1; n <= max_threads; n *= 2) {
+        bench_readers(n, duration_ms);
+    }
+    for (size_t n = 2; n <= max_threads; n *= 2) {
+        bench_writer(n, duration_ms);
+    }
+    for (size_t n = 1; n <= max_threads; n *= 2) {
+        bench_fairness(n, duration_ms);
+    }
+    return 0;
+}
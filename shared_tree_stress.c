@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "SharedTree.h"
+#include "path_utils.h"
+#include "err.h"
+
+/*
+ * Stress test of SharedTree recovery from processes killed mid-operation.
+ *
+ * Usage: shared_tree_stress [duration_ms] [n_workers] [kill_every_ms]
+ *
+ * Forks n_workers processes, each running a mix of 30% create, 30% remove,
+ * 20% move and 20% list on a small tree through its own handle, and every
+ * kill_every_ms SIGKILLs one of them at random and forks a replacement,
+ * listing the root in between (so that locks of the killed one are
+ * recovered by waiting for them). At the end all workers are killed, and
+ * the whole tree is listed again: every listed directory must be found,
+ * a handle must be available in every slot, and operations must still
+ * work. Prints kills, throughput in ops/s and the final number of
+ * directories; any failure is fatal.
+ */
+
+#define REGION_SIZE (64 << 20)
+#define MAX_HANDLES 64 // As in SharedTree.c.
+#define MAX_WORKERS 32
+#define TIMEOUT_S 60 // A hang (e.g. a lock never recovered) ends the test.
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void random_path(unsigned *seed, char *path) {
+    int depth = 1 + rand_r(seed) % 3;
+    char *p = path;
+    *p++ = '/';
+    for (int i = 0; i < depth; ++i) {
+        *p++ = 'a' + rand_r(seed) % 4;
+        *p++ = '/';
+    }
+    *p = '\0';
+}
+
+static void worker_main(const char *name, _Atomic uint64_t *ops) {
+    SharedTree *t = shared_tree_open(name, 0);
+    if (!t) syserr("worker cannot open %s", name);
+    unsigned seed = getpid();
+    char path[16], target[16];
+    for (;;) {
+        int r = rand_r(&seed) % 10;
+        random_path(&seed, path);
+        random_path(&seed, target);
+        if (r < 3) shared_tree_create(t, path);
+        else if (r < 6) shared_tree_remove(t, path);
+        else if (r < 8) shared_tree_move(t, path, target);
+        else free(shared_tree_list(t, path));
+        atomic_fetch_add_explicit(ops, 1, memory_order_relaxed);
+    }
+}
+
+static pid_t spawn(const char *name, _Atomic uint64_t *ops) {
+    pid_t pid = fork();
+    if (pid < 0) syserr("fork failed");
+    if (pid == 0) worker_main(name, ops);
+    return pid;
+}
+
+// Lists the subtree at `path` (ending with '/'), counting its directories.
+// Moves can nest directories beyond the longest path; those are only counted.
+static size_t check_subtree(SharedTree *t, char *path, size_t len) {
+    char *list = shared_tree_list(t, path);
+    if (!list) fatal("cannot list %s", path);
+    size_t count = 1;
+    for (char *name = list, *end; *name; name = *end ? end + 1 : end) {
+        size_t name_len = strcspn(name, ",");
+        end = name + name_len;
+        if (name_len == 0 || strspn(name, "abcd") < name_len)
+            fatal("bad name in listing of %s: %s", path, list);
+        if (len + name_len + 1 > MAX_PATH_LENGTH) {
+            ++count;
+            continue;
+        }
+        memcpy(path + len, name, name_len);
+        path[len + name_len] = '/';
+        path[len + name_len + 1] = '\0';
+        count += check_subtree(t, path, len + name_len + 1);
+        path[len] = '\0';
+    }
+    free(list);
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned duration_ms = argc > 1 ? atoi(argv[1]) : 2000;
+    size_t n_workers = argc > 2 ? atoi(argv[2]) : 8;
+    unsigned kill_every_ms = argc > 3 ? atoi(argv[3]) : 10;
+    if (duration_ms == 0 || n_workers == 0 || n_workers > MAX_WORKERS || kill_every_ms == 0)
+        fatal("usage: %s [duration_ms] [n_workers <= %d] [kill_every_ms]", argv[0], MAX_WORKERS);
+    alarm(duration_ms / 1000 + TIMEOUT_S);
+
+    char name[64];
+    snprintf(name, sizeof(name), "/shared_tree_stress.%d", (int) getpid());
+    SharedTree *t = shared_tree_open(name, REGION_SIZE);
+    if (!t) syserr("cannot create %s", name);
+    _Atomic uint64_t *ops = mmap(NULL, sizeof(*ops), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ops == MAP_FAILED) syserr("mmap failed");
+    atomic_init(ops, 0);
+
+    pid_t workers[MAX_WORKERS];
+    for (size_t i = 0; i < n_workers; ++i) workers[i] = spawn(name, ops);
+    unsigned seed = 1;
+    size_t kills = 0;
+    uint64_t begin = now_ns();
+    while (now_ns() - begin < duration_ms * 1000000ull) {
+        usleep(kill_every_ms * 1000);
+        size_t i = rand_r(&seed) % n_workers;
+        kill(workers[i], SIGKILL);
+        waitpid(workers[i], NULL, 0);
+        ++kills;
+        free(shared_tree_list(t, "/"));
+        workers[i] = spawn(name, ops);
+    }
+    for (size_t i = 0; i < n_workers; ++i) {
+        kill(workers[i], SIGKILL);
+        waitpid(workers[i], NULL, 0);
+    }
+    uint64_t elapsed = now_ns() - begin;
+
+    char path[MAX_PATH_LENGTH + 1] = "/";
+    size_t n_dirs = check_subtree(t, path, 1);
+    // Opening reaps the slots of all killed workers.
+    SharedTree *others[MAX_HANDLES - 1];
+    for (size_t i = 0; i < MAX_HANDLES - 1; ++i) {
+        others[i] = shared_tree_open(name, 0);
+        if (!others[i]) syserr("slot %zu not recovered", i + 1);
+    }
+    for (size_t i = 0; i < MAX_HANDLES - 1; ++i) shared_tree_close(others[i]);
+    if (shared_tree_create(t, "/x/") != 0 || shared_tree_create(t, "/x/y/") != 0
+        || shared_tree_move(t, "/x/y/", "/x/z/") != 0 || shared_tree_remove(t, "/x/z/") != 0
+        || shared_tree_remove(t, "/x/") != 0)
+        fatal("operations fail after recovery");
+
+    printf("%-10s %7s %11s %10s\n", "workers", "kills", "ops/s", "dirs");
+    printf("%-10zu %7zu %11.0f %10zu\n", n_workers, kills, atomic_load(ops) * 1e9 / elapsed, n_dirs);
+    shared_tree_close(t);
+    shared_tree_unlink(name);
+    return 0;
+}
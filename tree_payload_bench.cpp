@@ -0,0 +1,137 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Tree.hpp"
+
+extern "C" {
+#include "Tree.h"
+}
+
+/*
+ * Benchmark of per-directory metadata: the C tree with a side table
+ * keyed by path, against tree::Tree with the metadata inline.
+ *
+ * Usage: tree_payload_bench [fanout] [depth] [n_lookups]
+ *
+ * Builds a complete tree with `fanout` children per directory,
+ * `depth` levels deep, each directory with its metadata, then reads
+ * the metadata of `n_lookups` random directories. Prints nanoseconds
+ * per directory built and per lookup, for:
+ * - the C tree and a std::unordered_map<std::string, Meta> under
+ *   a std::shared_mutex (a tree lookup, then a map lookup with a copied key),
+ * - tree::Tree<Meta> with each lock policy and child index.
+ */
+
+struct Meta {
+    uint64_t size;
+    uint64_t mtime;
+
+    Meta(uint64_t size, uint64_t mtime) : size(size), mtime(mtime) {}
+};
+
+static std::vector<std::string> generate(size_t fanout, size_t depth) {
+    std::vector<std::string> paths;
+    std::vector<std::string> level{"/"};
+    for (size_t d = 0; d < depth; ++d) {
+        std::vector<std::string> next;
+        for (const std::string& parent : level) {
+            for (size_t i = 0; i < fanout; ++i) {
+                std::string name;
+                for (size_t k = fanout, j = i; k > 1 || name.empty(); k = (k + 25) / 26, j /= 26) {
+                    name += char('a' + j % 26);
+                }
+                next.push_back(parent + name + "/");
+            }
+        }
+        paths.insert(paths.end(), next.begin(), next.end());
+        level = std::move(next);
+    }
+    return paths;
+}
+
+using Clock = std::chrono::steady_clock;
+
+static double ns_per(Clock::time_point begin, size_t n) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - begin).count() / n;
+}
+
+static void report(const char* name, double build_ns, double lookup_ns, uint64_t checksum) {
+    printf("%-28s %8.1f ns/create  %8.1f ns/lookup  (%llu)\n", name, build_ns, lookup_ns,
+           (unsigned long long) checksum);
+}
+
+static void bench_side_table(const std::vector<std::string>& paths, const std::vector<size_t>& lookups) {
+    Tree* tree = tree_new();
+    std::unordered_map<std::string, Meta> table;
+    std::shared_mutex table_lock;
+
+    auto begin = Clock::now();
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (tree_create(tree, paths[i].c_str()) != 0) fatal("tree_create failed");
+        std::unique_lock lock(table_lock);
+        table.emplace(paths[i], Meta(i, i));
+    }
+    double build_ns = ns_per(begin, paths.size());
+
+    uint64_t checksum = 0;
+    begin = Clock::now();
+    for (size_t i : lookups) {
+        TreeStat stat;
+        if (tree_stat(tree, paths[i].c_str(), &stat) != 0) fatal("tree_stat failed");
+        std::shared_lock lock(table_lock);
+        checksum += table.find(paths[i])->second.size;
+    }
+    report("C tree + side table", build_ns, ns_per(begin, lookups.size()), checksum);
+    tree_free(tree);
+}
+
+template <class T>
+static void bench_template(const char* name, const std::vector<std::string>& paths,
+                           const std::vector<size_t>& lookups) {
+    T tree(0, 0);
+    auto begin = Clock::now();
+    for (size_t i = 0; i < paths.size(); ++i) {
+        if (tree.create(paths[i], i, i) != 0) fatal("create failed");
+    }
+    double build_ns = ns_per(begin, paths.size());
+
+    uint64_t checksum = 0;
+    begin = Clock::now();
+    for (size_t i : lookups) {
+        typename T::ReadHandle handle;
+        if (tree.find(paths[i], handle) != 0) fatal("find failed");
+        checksum += handle->size;
+    }
+    report(name, build_ns, ns_per(begin, lookups.size()), checksum);
+}
+
+int main(int argc, char* argv[]) {
+    size_t fanout = argc > 1 ? atoi(argv[1]) : 10;
+    size_t depth = argc > 2 ? atoi(argv[2]) : 5;
+    size_t n_lookups = argc > 3 ? atoi(argv[3]) : 1000000;
+    if (fanout == 0 || depth == 0 || n_lookups == 0)
+        fatal("usage: %s [fanout] [depth] [n_lookups]", argv[0]);
+
+    std::vector<std::string> paths = generate(fanout, depth);
+    std::mt19937_64 random(42);
+    std::vector<size_t> lookups(n_lookups);
+    for (size_t& i : lookups) i = random() % paths.size();
+    printf("%zu directories (fanout %zu, depth %zu), %zu lookups\n", paths.size(), fanout, depth,
+           n_lookups);
+
+    bench_side_table(paths, lookups);
+    bench_template<tree::Tree<Meta>>("Tree<Meta>", paths, lookups);
+    bench_template<tree::Tree<Meta, tree::SharedMutexPolicy>>("Tree<Meta, SharedMutex>", paths,
+                                                              lookups);
+    bench_template<tree::Tree<Meta, tree::NoLockPolicy>>("Tree<Meta, NoLock>", paths, lookups);
+    bench_template<tree::Tree<Meta, tree::NoLockPolicy, tree::SortedIndex>>(
+        "Tree<Meta, NoLock, Sorted>", paths, lookups);
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Tree.hpp"
+
+/*
+ * Stress test of tree::Tree under concurrent create, remove, move and find.
+ *
+ * Usage: tree_payload_stress [duration_ms] [n_threads]
+ *
+ * For each lock policy and child index, n_threads threads (one for
+ * NoLockPolicy, which is for one thread at a time) run a mix of 25% create,
+ * 15% remove, 15% move, 30% find of a read handle and 15% find of a write
+ * handle on a small tree, through paths 1 to 3 levels deep. Writers set
+ * both halves of the payload to one value and readers check they agree.
+ * Then the whole tree is listed (every listed directory must be found),
+ * destroyed, and every name must have been released.
+ * Prints throughput in ops/s and the final number of directories;
+ * any failure is fatal.
+ */
+
+struct Pair {
+    uint64_t first = 0;
+    uint64_t second = 0;
+};
+
+static const char NAMES[] = "abcd";
+
+static std::string random_path(std::mt19937& random) {
+    std::string path = "/";
+    for (int depth = 1 + random() % 3; depth > 0; --depth) {
+        path += NAMES[random() % (sizeof(NAMES) - 1)];
+        path += '/';
+    }
+    return path;
+}
+
+template <class T>
+static void run_mix(T& tree, unsigned seed, const std::atomic<bool>& stop, uint64_t& ops) {
+    std::mt19937 random(seed);
+    while (!stop.load(std::memory_order_relaxed)) {
+        std::string path = random_path(random);
+        int r = random() % 20;
+        if (r < 5) {
+            tree.create(path);
+        } else if (r < 8) {
+            tree.remove(path);
+        } else if (r < 11) {
+            tree.move(path, random_path(random));
+        } else if (r < 17) {
+            typename T::ReadHandle handle;
+            if (tree.find(path, handle) == 0 && handle->first != handle->second)
+                fatal("torn payload at %s", path.c_str());
+        } else {
+            typename T::WriteHandle handle;
+            if (tree.find(path, handle) == 0) {
+                handle->first = random();
+                handle->second = handle->first;
+            }
+        }
+        ++ops;
+    }
+}
+
+// Lists the subtree at `path`, counting its directories.
+template <class T>
+static size_t check_subtree(T& tree, const std::string& path) {
+    std::vector<std::string> names;
+    if (tree.list(path, names) != 0) fatal("cannot list %s", path.c_str());
+    size_t count = 1;
+    for (const std::string& name : names) count += check_subtree(tree, path + name + "/");
+    return count;
+}
+
+template <class T>
+static void stress(const char* name, unsigned duration_ms, size_t n_threads) {
+    uint64_t total_ops = 0;
+    size_t n_dirs = 0;
+    double elapsed = 0;
+    {
+        T tree;
+        std::atomic<bool> stop(false);
+        std::vector<uint64_t> ops(n_threads);
+        std::vector<std::thread> threads;
+        auto begin = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n_threads; ++i)
+            threads.emplace_back([&, i] { run_mix(tree, i + 1, stop, ops[i]); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+        stop = true;
+        for (std::thread& thread : threads) thread.join();
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        for (uint64_t n : ops) total_ops += n;
+        n_dirs = check_subtree(tree, "/");
+    }
+    for (const char* c = NAMES; *c; ++c) {
+        if (name_find(c, 1) != NAME_NONE) fatal("%s: name %c still interned", name, *c);
+    }
+    printf("%-28s %7zu %11.0f %10zu\n", name, n_threads, total_ops / elapsed, n_dirs);
+}
+
+int main(int argc, char* argv[]) {
+    unsigned duration_ms = argc > 1 ? atoi(argv[1]) : 500;
+    size_t n_threads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency() + 1;
+    if (duration_ms == 0 || n_threads == 0) fatal("usage: %s [duration_ms] [n_threads]", argv[0]);
+
+    printf("%-28s %7s %11s %10s\n", "tree", "threads", "ops/s", "dirs");
+    stress<tree::Tree<Pair>>("Tree<RWLock, Hash>", duration_ms, n_threads);
+    stress<tree::Tree<Pair, tree::RWLockPolicy, tree::SortedIndex>>("Tree<RWLock, Sorted>",
+                                                                    duration_ms, n_threads);
+    stress<tree::Tree<Pair, tree::SharedMutexPolicy>>("Tree<SharedMutex, Hash>", duration_ms,
+                                                      n_threads);
+    stress<tree::Tree<Pair, tree::SharedMutexPolicy, tree::SortedIndex>>(
+        "Tree<SharedMutex, Sorted>", duration_ms, n_threads);
+    stress<tree::Tree<Pair, tree::NoLockPolicy>>("Tree<NoLock, Hash>", duration_ms, 1);
+    stress<tree::Tree<Pair, tree::NoLockPolicy, tree::SortedIndex>>("Tree<NoLock, Sorted>",
+                                                                    duration_ms, 1);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "Tree.h"
+#include "TreeServer.h"
+#include "err.h"
+
+/*
+ * Serves one tree to other processes.
+ *
+ * Usage: tree_server [socket_path] [n_workers]
+ *
+ * Runs until SIGINT or SIGTERM. Clients use TreeClient.h.
+ */
+
+static TreeServer *server;
+
+static void on_signal(int sig) {
+    (void) sig;
+    tree_server_stop(server);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/tree_server.sock";
+    long n_workers = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_workers <= 0) fatal("usage: %s [socket_path] [n_workers]", argv[0]);
+
+    Tree *tree = tree_new();
+    server = tree_server_new(tree, path, n_workers);
+    if (!server) syserr("cannot listen on %s", path);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int err = tree_server_run(server);
+    tree_server_free(server);
+    tree_free(tree);
+    if (err) fatal("event loop failed: %s", strerror(err));
+    return 0;
+}
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "Tree.h"
+#include "TreeClient.h"
+#include "TreeServer.h"
+#include "err.h"
+
+/*
+ * Benchmark of tree_server against in-process calls.
+ *
+ * Usage: tree_server_bench [duration_ms] [max_clients] [n_workers]
+ *
+ * Every thread runs a mix of 50% list, 20% create, 20% remove
+ * and 10% move on a small tree, either calling the Tree directly
+ * or through its own connection to a server running in this process,
+ * with 1, 2, 4, ... up to max_clients connections, sending requests
+ * one at a time or pipelined PIPELINE_DEPTH at a time.
+ * Finally, "deep" pipelines DEEP_PIPELINE_DEPTH requests at a time:
+ * DEEP_LISTS listings of a directory with BIG_DIR_CHILDREN children,
+ * more than the server buffers for a connection, followed by creates
+ * of long paths, more than fit in the socket, so that the client
+ * must read responses while it is still sending.
+ * Prints throughput in ops/s, and mean and p99 latency of a request
+ * in us (for pipelined ones, from sending their batch to their response).
+ */
+
+#define PIPELINE_DEPTH 32
+#define DEEP_PIPELINE_DEPTH 2048
+#define DEEP_LISTS 320
+#define BIG_DIR "/big/"
+#define BIG_DIR_CHILDREN 1024
+#define BIG_DIR_NAME_LENGTH 16
+#define LONG_PATH_COMPONENTS 16
+#define LONG_PATH_COMPONENT_LENGTH 250
+#define LONG_PATH_LENGTH (1 + LONG_PATH_COMPONENTS * (LONG_PATH_COMPONENT_LENGTH + 1) + 1)
+
+typedef struct Bench Bench;
+
+struct Bench {
+    Tree *tree;
+    const char *socket_path;
+    size_t depth; // 0: in-process
+    bool deep; // Batches of deep_op() instead of random_op().
+    atomic_bool start;
+    atomic_bool stop;
+};
+
+typedef struct Worker Worker;
+
+struct Worker {
+    Bench *bench;
+    pthread_t thread;
+    unsigned seed;
+    uint64_t ops;
+    uint64_t *latencies;
+    size_t n_latencies;
+    size_t cap_latencies;
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int compare_u64(const void *p1, const void *p2) {
+    uint64_t a = *(const uint64_t *) p1;
+    uint64_t b = *(const uint64_t *) p2;
+    return (a > b) - (a < b);
+}
+
+static void record(Worker *w, uint64_t latency) {
+    if (w->n_latencies == w->cap_latencies) {
+        w->cap_latencies = w->cap_latencies ? 2 * w->cap_latencies : 4096;
+        w->latencies = realloc(w->latencies, w->cap_latencies * sizeof(uint64_t));
+        if (!w->latencies) syserr("memory alloc failed!");
+    }
+    w->latencies[w->n_latencies++] = latency;
+    ++w->ops;
+}
+
+static void random_path(Worker *w, char *path) {
+    int depth = 1 + rand_r(&w->seed) % 2;
+    char *p = path;
+    *p++ = '/';
+    for (int i = 0; i < depth; ++i) {
+        *p++ = 'a' + rand_r(&w->seed) % 8;
+        *p++ = '/';
+    }
+    *p = '\0';
+}
+
+static TreeOp random_op(Worker *w, char *path, char *target) {
+    int r = rand_r(&w->seed) % 10;
+    random_path(w, path);
+    random_path(w, target);
+    return r < 5 ? TREE_OP_LIST : r < 7 ? TREE_OP_CREATE : r < 9 ? TREE_OP_REMOVE : TREE_OP_MOVE;
+}
+
+// Request `i` of a deep batch. Long paths are created under missing
+// directories, so they fail and the tree does not grow.
+static TreeOp deep_op(Worker *w, size_t i, char *path) {
+    if (i < DEEP_LISTS) {
+        strcpy(path, BIG_DIR);
+        return TREE_OP_LIST;
+    }
+    char *p = path;
+    *p++ = '/';
+    for (int j = 0; j < LONG_PATH_COMPONENTS; ++j) {
+        memset(p, 'a' + rand_r(&w->seed) % 26, LONG_PATH_COMPONENT_LENGTH);
+        p += LONG_PATH_COMPONENT_LENGTH;
+        *p++ = '/';
+    }
+    *p = '\0';
+    return TREE_OP_CREATE;
+}
+
+static void run_local(Worker *w) {
+    Bench *b = w->bench;
+    char path[16], target[16];
+    while (!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+        TreeOp op = random_op(w, path, target);
+        uint64_t begin = now_ns();
+        switch (op) {
+            case TREE_OP_LIST:
+                free(tree_list(b->tree, path));
+                break;
+            case TREE_OP_CREATE:
+                tree_create(b->tree, path);
+                break;
+            case TREE_OP_REMOVE:
+                tree_remove(b->tree, path);
+                break;
+            case TREE_OP_MOVE:
+                tree_move(b->tree, path, target);
+                break;
+        }
+        record(w, now_ns() - begin);
+    }
+}
+
+static void run_remote(Worker *w) {
+    Bench *b = w->bench;
+    TreeClient *client = tree_client_connect(b->socket_path);
+    if (!client) syserr("cannot connect to %s", b->socket_path);
+    char path[LONG_PATH_LENGTH], target[16];
+    while (!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+        for (size_t i = 0; i < b->depth; ++i) {
+            TreeOp op = b->deep ? deep_op(w, i, path) : random_op(w, path, target);
+            if (tree_client_send(client, op, path, target) != 0) fatal("tree_client_send failed");
+        }
+        uint64_t begin = now_ns();
+        if (tree_client_flush(client) != 0) fatal("tree_client_flush failed");
+        for (size_t i = 0; i < b->depth; ++i) {
+            int status;
+            char *list;
+            if (tree_client_recv(client, &status, &list) != 0) fatal("tree_client_recv failed");
+            free(list);
+            record(w, now_ns() - begin);
+        }
+    }
+    tree_client_close(client);
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    while (!atomic_load(&w->bench->start)) {}
+    if (w->bench->depth == 0) run_local(w);
+    else run_remote(w);
+    return NULL;
+}
+
+static void run(Bench *b, size_t n_threads, unsigned duration_ms, const char *name) {
+    Worker *workers = calloc(n_threads, sizeof(Worker));
+    if (!workers) syserr("memory alloc failed!");
+    atomic_store(&b->start, false);
+    atomic_store(&b->stop, false);
+    for (size_t i = 0; i < n_threads; ++i) {
+        workers[i].bench = b;
+        workers[i].seed = i + 1;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+            syserr("pthread_create failed");
+    }
+    uint64_t begin = now_ns();
+    atomic_store(&b->start, true);
+    usleep(duration_ms * 1000);
+    atomic_store(&b->stop, true);
+
+    uint64_t ops = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < n_threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+        n += workers[i].n_latencies;
+    }
+    uint64_t elapsed = now_ns() - begin;
+
+    uint64_t *all = malloc((n + 1) * sizeof(uint64_t));
+    if (!all) syserr("memory alloc failed!");
+    size_t k = 0;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n_threads; ++i) {
+        for (size_t j = 0; j < workers[i].n_latencies; ++j) {
+            sum += workers[i].latencies[j];
+            all[k++] = workers[i].latencies[j];
+        }
+        free(workers[i].latencies);
+    }
+    qsort(all, n, sizeof(uint64_t), compare_u64);
+    printf("%-10s %7zu %11.0f %10.1f %10.1f\n", name, n_threads, ops * 1e9 / elapsed,
+           n ? sum / 1e3 / n : 0.0, n ? all[n * 99 / 100] / 1e3 : 0.0);
+    free(all);
+    free(workers);
+}
+
+static void *server_main(void *arg) {
+    int err = tree_server_run(arg);
+    if (err) fatal("event loop failed: %d", err);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned duration_ms = argc > 1 ? atoi(argv[1]) : 500;
+    size_t max_clients = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n_workers = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (duration_ms == 0 || max_clients == 0 || n_workers == 0)
+        fatal("usage: %s [duration_ms] [max_clients] [n_workers]", argv[0]);
+
+    char socket_path[64];
+    snprintf(socket_path, sizeof(socket_path), "/tmp/tree_server_bench.%d.sock", (int) getpid());
+    Bench b = {.tree = tree_new(), .socket_path = socket_path};
+    TreeServer *server = tree_server_new(b.tree, socket_path, n_workers);
+    if (!server) syserr("cannot listen on %s", socket_path);
+    pthread_t server_thread;
+    if (pthread_create(&server_thread, NULL, server_main, server) != 0) syserr("pthread_create failed");
+
+    if (tree_create(b.tree, BIG_DIR) != 0) fatal("cannot create %s", BIG_DIR);
+    for (size_t i = 0; i < BIG_DIR_CHILDREN; ++i) {
+        char path[sizeof(BIG_DIR) + BIG_DIR_NAME_LENGTH + 1];
+        char *p = stpcpy(path, BIG_DIR);
+        for (size_t j = 0, k = i; j < BIG_DIR_NAME_LENGTH; ++j, k /= 26) *p++ = 'a' + k % 26;
+        *p++ = '/';
+        *p = '\0';
+        if (tree_create(b.tree, path) != 0) fatal("cannot create %s", path);
+    }
+
+    printf("%-10s %7s %11s %10s %10s\n", "mode", "threads", "ops/s", "mean_us", "p99_us");
+    for (size_t threads = 1; threads <= max_clients; threads *= 2) {
+        b.depth = 0;
+        run(&b, threads, duration_ms, "local");
+        b.depth = 1;
+        run(&b, threads, duration_ms, "remote");
+        b.depth = PIPELINE_DEPTH;
+        run(&b, threads, duration_ms, "pipelined");
+        b.depth = DEEP_PIPELINE_DEPTH;
+        b.deep = true;
+        run(&b, threads, duration_ms, "deep");
+        b.deep = false;
+    }
+
+    tree_server_stop(server);
+    pthread_join(server_thread, NULL);
+    tree_server_free(server);
+    tree_free(b.tree);
+    return 0;
+}